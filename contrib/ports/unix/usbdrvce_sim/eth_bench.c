@@ -0,0 +1,656 @@
+/**
+ * @file
+ * Throughput benchmark for the USB-Ethernet driver on the usbdrvce simulator.
+ *
+ * For each adapter class, lwIP sends UDP broadcasts as fast as the driver
+ * accepts them (tx), then the peer floods UDP datagrams at the calculator
+ * (rx). Frames/s and bytes/s are reported per direction, bytes counting
+ * whole Ethernet frames. Last, the peer streams a TCP connection at the
+ * stack, which shows how many segments NCM receive coalescing merges.
+ *
+ * With -T <tap>, the adapter is bridged to a tap device instead and the
+ * stack runs DHCP until interrupted.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lwip/init.h"
+#include "lwip/mem.h"
+#include "lwip/netif.h"
+#include "lwip/timeouts.h"
+#include "lwip/udp.h"
+#include "lwip/tcp.h"
+#include "lwip/dhcp.h"
+#include "lwip/inet_chksum.h"
+#include "lwip/prot/ethernet.h"
+#include "lwip/prot/ip4.h"
+#include "lwip/prot/udp.h"
+#include "lwip/prot/tcp.h"
+#include "lwip/prot/etharp.h"
+#include "lwip/prot/icmp.h"
+
+#include "drivers/usb_ethernet.h"
+#include "usbdrvce_sim.h"
+
+#define BENCH_PORT      7000
+#define BENCH_HEAP      24576
+
+static const uint8_t peer_mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+static const uint8_t dev_mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x02};
+
+static struct {
+  unsigned long frames;
+  unsigned long long bytes;
+} counted;
+
+/* calls lwIP makes into the program's heap, and memory pressure it reports */
+static struct {
+  unsigned long mallocs;
+  unsigned long frees;
+  unsigned long pressure[MEM_PRESSURE_HIGH + 1];
+} heap_calls;
+
+static volatile sig_atomic_t stop;
+static bool offer_ntb32;
+static bool bond;
+
+static double
+now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void *
+bench_malloc(size_t size)
+{
+  heap_calls.mallocs++;
+  return malloc(size);
+}
+
+static void
+bench_free(void *ptr)
+{
+  heap_calls.frees++;
+  free(ptr);
+}
+
+static void
+bench_pressure(enum mem_pressure level)
+{
+  heap_calls.pressure[level]++;
+}
+
+static void
+pump(void)
+{
+  usb_HandleEvents();
+  eth_poll(16);
+  sys_check_timeouts();
+}
+
+static void
+on_signal(int sig)
+{
+  (void)sig;
+  stop = 1;
+}
+
+/* echo requests the peer sends during the tx run, by sequence number */
+static struct {
+  double sent[256];     /* when each request went out */
+  unsigned long count;  /* requests sent */
+  unsigned long replies;
+  double rtt_sum;
+  double rtt_max;
+} ping;
+
+/* answers the stack's ARP request for the peer, false if the frame is something else */
+static bool
+peer_arp_reply(const uint8_t *frame, size_t len)
+{
+  uint8_t reply[SIZEOF_ETH_HDR + SIZEOF_ETHARP_HDR];
+  const struct etharp_hdr *req = (const struct etharp_hdr *)(frame + SIZEOF_ETH_HDR);
+  struct etharp_hdr *arp = (struct etharp_hdr *)(reply + SIZEOF_ETH_HDR);
+  if ((len < SIZEOF_ETH_HDR + SIZEOF_ETHARP_HDR) || (frame[12] != 0x08) || (frame[13] != 0x06)) {
+    return false;
+  }
+  if (req->opcode != PP_HTONS(ARP_REQUEST)) {
+    return true;
+  }
+  memcpy(reply, frame, sizeof(reply));
+  memcpy(reply, frame + 6, 6);
+  memcpy(reply + 6, peer_mac, 6);
+  arp->opcode = PP_HTONS(ARP_REPLY);
+  memcpy(&arp->shwaddr, peer_mac, 6);
+  memcpy(&arp->sipaddr, &req->dipaddr, 4);
+  memcpy(&arp->dhwaddr, &req->shwaddr, 6);
+  memcpy(&arp->dipaddr, &req->sipaddr, 4);
+  usbsim_peer_send(reply, sizeof(reply));
+  return true;
+}
+
+static size_t
+build_ping_frame(uint8_t *frame, u16_t seq)
+{
+  struct ip_hdr *ip = (struct ip_hdr *)(frame + SIZEOF_ETH_HDR);
+  struct icmp_echo_hdr *echo = (struct icmp_echo_hdr *)(frame + SIZEOF_ETH_HDR + IP_HLEN);
+  size_t len = SIZEOF_ETH_HDR + IP_HLEN + sizeof(struct icmp_echo_hdr) + 8;
+  ip4_addr_t src, dst;
+
+  memset(frame, 0, len);
+  memcpy(frame, dev_mac, 6);
+  memcpy(frame + 6, peer_mac, 6);
+  frame[12] = 0x08;
+  frame[13] = 0x00;
+  IP4_ADDR(&src, 10, 0, 0, 1);
+  IP4_ADDR(&dst, 10, 0, 0, 2);
+  IPH_VHL_SET(ip, 4, IP_HLEN / 4);
+  IPH_LEN_SET(ip, lwip_htons((u16_t)(len - SIZEOF_ETH_HDR)));
+  IPH_TTL_SET(ip, 64);
+  IPH_PROTO_SET(ip, IP_PROTO_ICMP);
+  ip4_addr_copy(ip->src, src);
+  ip4_addr_copy(ip->dest, dst);
+  IPH_CHKSUM_SET(ip, inet_chksum(ip, IP_HLEN));
+  ICMPH_TYPE_SET(echo, ICMP_ECHO);
+  echo->id = PP_HTONS(0xbe);
+  echo->seqno = lwip_htons(seq);
+  echo->chksum = inet_chksum(echo, (u16_t)(len - SIZEOF_ETH_HDR - IP_HLEN));
+  return len;
+}
+
+/* counts the benchmark's UDP frames leaving the driver, and the echo replies */
+static void
+peer_recv(const uint8_t *frame, size_t len, void *arg)
+{
+  (void)arg;
+  if (peer_arp_reply(frame, len)) {
+    return;
+  }
+  if ((len >= SIZEOF_ETH_HDR + IP_HLEN + sizeof(struct icmp_echo_hdr)) &&
+      (frame[12] == 0x08) && (frame[13] == 0x00) &&
+      (frame[SIZEOF_ETH_HDR + 9] == IP_PROTO_ICMP)) {
+    const struct icmp_echo_hdr *echo = (const struct icmp_echo_hdr *)(frame + SIZEOF_ETH_HDR + IP_HLEN);
+    if (ICMPH_TYPE(echo) == ICMP_ER) {
+      double rtt = now_s() - ping.sent[lwip_ntohs(echo->seqno) & 0xff];
+      ping.replies++;
+      ping.rtt_sum += rtt;
+      ping.rtt_max = LWIP_MAX(ping.rtt_max, rtt);
+    }
+    return;
+  }
+  if ((len >= SIZEOF_ETH_HDR + IP_HLEN + UDP_HLEN) &&
+      (frame[12] == 0x08) && (frame[13] == 0x00) &&
+      (frame[SIZEOF_ETH_HDR + 9] == IP_PROTO_UDP)) {
+    counted.frames++;
+    counted.bytes += len;
+  }
+}
+
+/* counts the datagrams the peer floods at us */
+static void
+bench_udp_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+  (void)arg;
+  (void)pcb;
+  (void)addr;
+  (void)port;
+  counted.frames++;
+  counted.bytes += p->tot_len + SIZEOF_ETH_HDR + IP_HLEN + UDP_HLEN;
+  pbuf_free(p);
+}
+
+/* the peer's end of the TCP receive run */
+static struct {
+  bool established;     /* SYN-ACK seen */
+  u32_t snd_nxt;        /* next sequence number to send */
+  u32_t snd_una;        /* oldest unacknowledged sequence number */
+  u32_t rcv_nxt;        /* what the peer acknowledges */
+  u16_t wnd;            /* window advertised by the stack */
+  unsigned long acks;   /* pure ACKs sent by the stack */
+  double progress;      /* when snd_una last moved */
+} tpeer;
+
+static size_t
+build_tcp_frame(uint8_t *frame, u8_t flags, u32_t seq, size_t payload)
+{
+  struct ip_hdr *ip = (struct ip_hdr *)(frame + SIZEOF_ETH_HDR);
+  struct tcp_hdr *tcp = (struct tcp_hdr *)(frame + SIZEOF_ETH_HDR + IP_HLEN);
+  size_t len = SIZEOF_ETH_HDR + IP_HLEN + TCP_HLEN + payload;
+  ip_addr_t src, dst;
+  struct pbuf *p;
+
+  memset(frame, 0, len);
+  memcpy(frame, dev_mac, 6);
+  memcpy(frame + 6, peer_mac, 6);
+  frame[12] = 0x08;
+  frame[13] = 0x00;
+  IP_ADDR4(&src, 10, 0, 0, 1);
+  IP_ADDR4(&dst, 10, 0, 0, 2);
+  IPH_VHL_SET(ip, 4, IP_HLEN / 4);
+  IPH_LEN_SET(ip, lwip_htons((u16_t)(IP_HLEN + TCP_HLEN + payload)));
+  IPH_TTL_SET(ip, 64);
+  IPH_PROTO_SET(ip, IP_PROTO_TCP);
+  ip4_addr_copy(ip->src, *ip_2_ip4(&src));
+  ip4_addr_copy(ip->dest, *ip_2_ip4(&dst));
+  IPH_CHKSUM_SET(ip, inet_chksum(ip, IP_HLEN));
+  tcp->src = lwip_htons(BENCH_PORT);
+  tcp->dest = lwip_htons(BENCH_PORT);
+  tcp->seqno = lwip_htonl(seq);
+  tcp->ackno = lwip_htonl(tpeer.rcv_nxt);
+  TCPH_HDRLEN_FLAGS_SET(tcp, TCP_HLEN / 4, flags);
+  tcp->wnd = lwip_htons(0xffff);
+  memset((uint8_t *)tcp + TCP_HLEN, (int)(seq & 0xff), payload);
+  p = pbuf_alloc(PBUF_RAW, (u16_t)(TCP_HLEN + payload), PBUF_REF);
+  p->payload = tcp;
+  tcp->chksum = ip_chksum_pseudo(p, IP_PROTO_TCP, p->tot_len, &src, &dst);
+  pbuf_free(p);
+  return len;
+}
+
+/* follows the stack's side of the connection */
+static void
+tcp_peer_recv(const uint8_t *frame, size_t len, void *arg)
+{
+  const struct ip_hdr *ip = (const struct ip_hdr *)(frame + SIZEOF_ETH_HDR);
+  const struct tcp_hdr *tcp = (const struct tcp_hdr *)(frame + SIZEOF_ETH_HDR + IP_HLEN);
+  u32_t ack;
+  (void)arg;
+  if (peer_arp_reply(frame, len)) {
+    return;
+  }
+  if ((len < SIZEOF_ETH_HDR + IP_HLEN + TCP_HLEN) || (frame[12] != 0x08) || (frame[13] != 0x00) ||
+      (IPH_PROTO(ip) != IP_PROTO_TCP)) {
+    return;
+  }
+  ack = lwip_ntohl(tcp->ackno);
+  if ((TCPH_FLAGS(tcp) & (TCP_SYN | TCP_ACK)) == (TCP_SYN | TCP_ACK)) {
+    tpeer.established = true;
+    tpeer.rcv_nxt = lwip_ntohl(tcp->seqno) + 1;
+  } else if (lwip_ntohs(IPH_LEN(ip)) == IP_HLEN + TCPH_HDRLEN_BYTES(tcp)) {
+    tpeer.acks++;
+  }
+  if ((TCPH_FLAGS(tcp) & TCP_ACK) && ((s32_t)(ack - tpeer.snd_una) > 0)) {
+    tpeer.snd_una = ack;
+    tpeer.progress = now_s();
+  }
+  tpeer.wnd = lwip_ntohs(tcp->wnd);
+}
+
+static err_t
+bench_tcp_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
+{
+  (void)arg;
+  (void)err;
+  if (p == NULL) {
+    return ERR_OK;
+  }
+  counted.frames++;
+  counted.bytes += p->tot_len;
+  tcp_recved(pcb, p->tot_len);
+  pbuf_free(p);
+  return ERR_OK;
+}
+
+static err_t
+bench_tcp_accept(void *arg, struct tcp_pcb *pcb, err_t err)
+{
+  (void)err;
+  *(struct tcp_pcb **)arg = pcb;
+  tcp_recv(pcb, bench_tcp_recv);
+  return ERR_OK;
+}
+
+/* the peer streams MSS-sized segments at a listening pcb, as far as the window allows */
+static void
+bench_tcp_rx(const char *cls, struct netif *port, double seconds, size_t payload)
+{
+  struct tcp_pcb *lpcb = tcp_new(), *pcb = NULL;
+  struct eth_stats before, after;
+  uint8_t frame[1518];
+  size_t seg = LWIP_MIN(payload, TCP_MSS);
+  unsigned long segments = 0;
+  double start;
+
+  tcp_bind(lpcb, IP4_ADDR_ANY, BENCH_PORT);
+  lpcb = tcp_listen(lpcb);
+  tcp_arg(lpcb, &pcb);
+  tcp_accept(lpcb, bench_tcp_accept);
+  memset(&tpeer, 0, sizeof(tpeer));
+  tpeer.snd_nxt = tpeer.snd_una = 1000;
+  usbsim_set_peer_recv(tcp_peer_recv, NULL);
+  while (usbsim_peer_pending()) {
+    pump();
+  }
+
+  usbsim_peer_send(frame, build_tcp_frame(frame, TCP_SYN, tpeer.snd_nxt++, 0));
+  tpeer.snd_una = tpeer.snd_nxt;
+  start = now_s();
+  while (!tpeer.established && (now_s() - start < 1.0)) {
+    pump();
+  }
+  usbsim_peer_send(frame, build_tcp_frame(frame, TCP_ACK, tpeer.snd_nxt, 0));
+  pump();
+  if (pcb == NULL) {
+    fprintf(stderr, "%s: tcp connection not accepted\n", cls);
+    tcp_close(lpcb);
+    usbsim_set_peer_recv(NULL, NULL);
+    return;
+  }
+
+  eth_get_stats(port->num, &before);
+  memset(&counted, 0, sizeof(counted));
+  start = tpeer.progress = now_s();
+  while (now_s() - start < seconds) {
+    /* go back to the oldest unacknowledged segment if the stack stopped acking */
+    if (now_s() - tpeer.progress > 0.05) {
+      tpeer.snd_nxt = tpeer.snd_una;
+      tpeer.progress = now_s();
+    }
+    while ((u32_t)(tpeer.snd_nxt + seg - tpeer.snd_una) <= tpeer.wnd) {
+      if (!usbsim_peer_send(frame, build_tcp_frame(frame, TCP_ACK | TCP_PSH, tpeer.snd_nxt, seg))) {
+        break;
+      }
+      tpeer.snd_nxt += (u32_t)seg;
+      segments++;
+    }
+    pump();
+  }
+  eth_get_stats(port->num, &after);
+  printf("%-4s tcp: %9.0f segs/s %12.0f bytes/s  (%lu segments, %lu recv callbacks, %lu acks, %lu coalesced)\n",
+         cls, segments / (now_s() - start), counted.bytes / (now_s() - start), segments, counted.frames,
+         tpeer.acks, (unsigned long)(after.coalesced - before.coalesced));
+
+  tcp_abort(pcb);
+  tcp_close(lpcb);
+  usbsim_set_peer_recv(NULL, NULL);
+}
+
+static size_t
+build_rx_frame(uint8_t *frame, size_t payload)
+{
+  struct ip_hdr *ip = (struct ip_hdr *)(frame + SIZEOF_ETH_HDR);
+  struct udp_hdr *udp = (struct udp_hdr *)(frame + SIZEOF_ETH_HDR + IP_HLEN);
+  ip4_addr_t src, dst;
+  size_t len = SIZEOF_ETH_HDR + IP_HLEN + UDP_HLEN + payload;
+
+  memset(frame, 0, len);
+  memcpy(frame, dev_mac, 6);
+  memcpy(frame + 6, peer_mac, 6);
+  frame[12] = 0x08;
+  frame[13] = 0x00;
+  IP4_ADDR(&src, 10, 0, 0, 1);
+  IP4_ADDR(&dst, 10, 0, 0, 2);
+  IPH_VHL_SET(ip, 4, IP_HLEN / 4);
+  IPH_LEN_SET(ip, lwip_htons((u16_t)(IP_HLEN + UDP_HLEN + payload)));
+  IPH_TTL_SET(ip, 64);
+  IPH_PROTO_SET(ip, IP_PROTO_UDP);
+  ip4_addr_copy(ip->src, src);
+  ip4_addr_copy(ip->dest, dst);
+  IPH_CHKSUM_SET(ip, inet_chksum(ip, IP_HLEN));
+  udp->src = lwip_htons(BENCH_PORT);
+  udp->dest = lwip_htons(BENCH_PORT);
+  udp->len = lwip_htons((u16_t)(UDP_HLEN + payload));
+  udp->chksum = 0;      /* no checksum */
+  return len;
+}
+
+static struct netif *
+wait_for_netif(void)
+{
+  double deadline = now_s() + 2.0;
+  struct netif *netif;
+  do {
+    pump();
+    netif = netif_find("en0");
+    if ((netif != NULL) && netif_is_link_up(netif)) {
+      return netif;
+    }
+  } while (now_s() < deadline);
+  return NULL;
+}
+
+static void
+report(const char *cls, const char *dir, double elapsed)
+{
+  struct usbsim_stats st;
+  usbsim_get_stats(&st);
+  printf("%-4s %s: %9.0f frames/s %12.0f bytes/s  (%lu frames, %lu transfers)\n",
+         cls, dir, counted.frames / elapsed, counted.bytes / elapsed, counted.frames,
+         (unsigned long)(dir[0] == 't' ? st.bulk_out : st.bulk_in));
+}
+
+static void
+report_driver(const char *cls, struct netif *netif)
+{
+  struct eth_stats st;
+  if (!eth_get_stats(netif->num, &st)) {
+    return;
+  }
+  printf("%-4s drv: %lu ntbs in, %lu ntbs out, %lu filtered, %lu queue drops, %lu alloc fails, "
+         "%lu tx full, %u retries, %lu urgent\n", cls, (unsigned long)st.ntbs_in, (unsigned long)st.ntbs_out,
+         (unsigned long)st.filtered, (unsigned long)st.queue_drops, (unsigned long)st.alloc_fails,
+         (unsigned long)st.tx_full, st.retries, (unsigned long)st.urgent);
+  printf("%-4s tx latency (ms):", cls);
+  for (int i = 0; i < ETH_TX_LATENCY_BUCKETS; i++) {
+    printf(" %s%u:%lu", (i == ETH_TX_LATENCY_BUCKETS - 1) ? ">=" : "<",
+           (i == ETH_TX_LATENCY_BUCKETS - 1) ? (1u << (i - 1)) : (1u << i),
+           (unsigned long)st.tx_latency[i]);
+  }
+  printf("\n");
+#if MEM_PROFILE
+  mem_profile_display();
+#endif
+  printf("%-4s heap: %lu mallocs, %lu frees, pressure none/low/high %lu/%lu/%lu, in use rx %zu tx %zu other %zu\n",
+         cls, heap_calls.mallocs, heap_calls.frees, heap_calls.pressure[MEM_PRESSURE_NONE],
+         heap_calls.pressure[MEM_PRESSURE_LOW], heap_calls.pressure[MEM_PRESSURE_HIGH],
+         mem_category_usage(MEM_CAT_RX), mem_category_usage(MEM_CAT_TX), mem_category_usage(MEM_CAT_OTHER));
+}
+
+static int
+bench_class(enum usbsim_class cls, uint32_t latency_us, double seconds, size_t payload)
+{
+  const char *name = (cls == USBSIM_NCM) ? "ncm" : "ecm";
+  struct usbsim_config conf;
+  struct netif *netif, *port;
+  struct udp_pcb *pcb;
+  ip4_addr_t ip, mask, gw;
+  ip_addr_t bcast;
+  uint8_t frame[1518];
+  size_t frame_len;
+  double start;
+
+  memset(&heap_calls, 0, sizeof(heap_calls));
+#if MEM_PROFILE
+  mem_profile_reset();
+#endif
+  memset(&conf, 0, sizeof(conf));
+  conf.cls = cls;
+  memcpy(conf.hwaddr, dev_mac, 6);
+  conf.latency_us = latency_us;
+  conf.mc_filters = 16;
+  conf.ntb32 = offer_ntb32;
+  usbsim_attach(&conf);
+  if ((netif = port = wait_for_netif()) == NULL) {
+    fprintf(stderr, "%s: adapter did not come up\n", name);
+    return 1;
+  }
+  if (bond && ((netif = eth_bond_add(port->num)) == NULL)) {
+    fprintf(stderr, "%s: bond failed\n", name);
+    return 1;
+  }
+  IP4_ADDR(&ip, 10, 0, 0, 2);
+  IP4_ADDR(&mask, 255, 255, 255, 0);
+  IP4_ADDR(&gw, 10, 0, 0, 1);
+  IP_ADDR4(&bcast, 10, 0, 0, 255);
+  netif_set_addr(netif, &ip, &mask, &gw);
+
+  pcb = udp_new();
+  udp_bind(pcb, IP4_ADDR_ANY, BENCH_PORT);
+  udp_recv(pcb, bench_udp_recv, NULL);
+
+  /* tx: broadcast, so no ARP round trip is needed
+   * the peer pings every 10 ms meanwhile, the replies compete with the flood */
+  usbsim_set_peer_recv(peer_recv, NULL);
+  usbsim_reset_stats();
+  memset(&counted, 0, sizeof(counted));
+  memset(&ping, 0, sizeof(ping));
+  start = now_s();
+  while (now_s() - start < seconds) {
+    if (now_s() - ping.sent[(ping.count - 1) & 0xff] >= 0.01) {
+      ping.sent[ping.count & 0xff] = now_s();
+      usbsim_peer_send(frame, build_ping_frame(frame, (u16_t)ping.count++));
+    }
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, (u16_t)payload, PBUF_RAM);
+    if (p != NULL) {
+      udp_sendto(pcb, p, &bcast, 9);
+      pbuf_free(p);
+    }
+    pump();
+  }
+  /* let in-flight frames reach the peer */
+  for (int i = 0; i < 100; i++) {
+    pump();
+  }
+  report(name, "tx", now_s() - start);
+  printf("%-4s ping: %lu sent, %lu replies, rtt avg %.3f ms, max %.3f ms\n", name, ping.count, ping.replies,
+         ping.replies ? ping.rtt_sum * 1e3 / ping.replies : 0.0, ping.rtt_max * 1e3);
+  usbsim_set_peer_recv(NULL, NULL);
+
+  /* rx: keep the peer's queue full */
+  frame_len = build_rx_frame(frame, payload);
+  usbsim_reset_stats();
+  memset(&counted, 0, sizeof(counted));
+  start = now_s();
+  while (now_s() - start < seconds) {
+    while (usbsim_peer_send(frame, frame_len)) {
+    }
+    pump();
+  }
+  report(name, "rx", now_s() - start);
+  bench_tcp_rx(name, port, seconds, payload);
+  report_driver(name, port);
+  if (cls == USBSIM_NCM) {
+    struct usbsim_stats st;
+    usbsim_get_stats(&st);
+    printf("%-4s ntb: NTB-%d input, %lu bytes, %u datagrams\n", name, st.ntb32 ? 32 : 16,
+           (unsigned long)st.ntb_in_size, st.ntb_in_datagrams);
+  }
+
+  udp_remove(pcb);
+  usbsim_detach();
+  while (eth_get_interfaces()) {
+    pump();
+  }
+  return 0;
+}
+
+static int
+run_tap(const char *tap)
+{
+  struct usbsim_config conf;
+  struct netif *netif;
+  bool shown = false;
+
+  memset(&conf, 0, sizeof(conf));
+  conf.cls = USBSIM_NCM;
+  memcpy(conf.hwaddr, dev_mac, 6);
+  conf.mc_filters = 16;
+  conf.tap = tap;
+  usbsim_attach(&conf);
+  signal(SIGINT, on_signal);
+  while (!stop) {
+    pump();
+    netif = netif_find("en0");
+    if (!shown && (netif != NULL) && dhcp_supplied_address(netif)) {
+      printf("en0: %s\n", ip4addr_ntoa(netif_ip4_addr(netif)));
+      shown = true;
+    }
+    usleep(100);
+  }
+  usbsim_detach();
+  pump();
+  return 0;
+}
+
+static void
+usage(const char *argv0)
+{
+  fprintf(stderr,
+          "usage: %s [-c ecm|ncm|all] [-l latency_us] [-t seconds] [-s payload] [-H heap] [-A arena] [-R rx_quota] [-N] [-D] [-B] [-T tap]\n"
+          "  -H  lwIP heap limit, NCM rx NTBs are sized against it\n"
+          "  -R  heap bytes rx buffers and received pbufs may hold\n"
+          "  -N  adapter offers NTB-32\n"
+          "  -D  deferred input, frames are handed to lwIP from eth_poll()\n"
+          "  -B  run over a bonding interface with the adapter as its port\n",
+          argv0);
+}
+
+int
+main(int argc, char **argv)
+{
+  struct mem_configurator memcfg = {MEM_CONFIGURATOR_V3, bench_malloc, bench_free, BENCH_HEAP, NULL, 0,
+                                    {0}, 0, 0, 0, bench_pressure};
+  struct eth_configurator ethcfg = {ETH_CONFIGURATOR_V6, USB_CDC_MAX_RETRIES, false, false,
+                                    ETH_RX_BUFFERS_DEFAULT, ETH_TX_QUEUE_DEFAULT, false,
+                                    ETH_LINK_HOLDDOWN_DEFAULT, false, {1, 1, 1, 1, 1, 1, 1, 1}};
+  const char *cls = "all", *tap = NULL;
+  uint32_t latency_us = 0;
+  double seconds = 1.0;
+  size_t payload = 1472;
+  int opt, err = 0;
+
+  while ((opt = getopt(argc, argv, "c:l:t:s:H:A:R:NDBT:h")) != -1) {
+    switch (opt) {
+      case 'c': cls = optarg; break;
+      case 'l': latency_us = (uint32_t)strtoul(optarg, NULL, 0); break;
+      case 't': seconds = strtod(optarg, NULL); break;
+      case 's': payload = strtoul(optarg, NULL, 0); break;
+      case 'H': memcfg.heap_max = strtoul(optarg, NULL, 0); break;
+      case 'A': memcfg.arena_size = strtoul(optarg, NULL, 0); break;
+      case 'R': memcfg.quota[MEM_CAT_RX] = strtoul(optarg, NULL, 0); break;
+      case 'N': offer_ntb32 = true; break;
+      case 'D': ethcfg.do_deferred_input = true; break;
+      case 'B': bond = true; break;
+      case 'T': tap = optarg; break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+  if ((payload == 0) || (payload > 1472)) {
+    fprintf(stderr, "payload must be 1 to 1472 bytes\n");
+    return 2;
+  }
+
+  if (memcfg.arena_size && ((memcfg.arena = malloc(memcfg.arena_size)) == NULL)) {
+    return 1;
+  }
+  if (!mem_configure(&memcfg) || (lwip_init() != ERR_OK)) {
+    return 1;
+  }
+  if (tap != NULL) {
+    ethcfg.do_dhcp_auto = true;
+  }
+  eth_configure(&ethcfg);
+  if (usb_Init(eth_usb_event_callback, NULL, NULL, USB_DEFAULT_INIT_FLAGS)) {
+    return 1;
+  }
+  if (tap != NULL) {
+    err = run_tap(tap);
+  } else {
+    printf("payload %zu bytes, latency %u us, %.1f s per run\n", payload, latency_us, seconds);
+    if (strcmp(cls, "ncm")) {
+      err |= bench_class(USBSIM_ECM, latency_us, seconds, payload);
+    }
+    if (strcmp(cls, "ecm")) {
+      err |= bench_class(USBSIM_NCM, latency_us, seconds, payload);
+    }
+  }
+  usb_Cleanup();
+  return err;
+}
@@ -0,0 +1,40 @@
+/**
+ * @file
+ * Host stand-in for src/include/arch/cc.h.
+ *
+ * The calculator's cc.h prints through the LCD console; here diagnostics go
+ * to stdout. Like the CE toolchain headers, this makes bool available.
+ */
+
+#ifndef LWIP_CC_H
+#define LWIP_CC_H
+
+#undef NDEBUG
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LWIP_TIMEVAL_PRIVATE 0
+#include <sys/time.h>
+
+#define LWIP_ERRNO_INCLUDE <errno.h>
+#define LWIP_ERRNO_STDINCLUDE 1
+
+/* the CE toolchain's <stdint.h> has 24-bit types */
+#include <stdint.h>
+typedef int32_t int24_t;
+typedef uint32_t uint24_t;
+
+#define LWIP_PLATFORM_DIAG(x) \
+  do                          \
+  {                           \
+    printf x;                 \
+    putchar('\n');            \
+  } while (0)
+
+#endif // LWIP_CC_H
+
+#ifndef BYTE_ORDER
+#define BYTE_ORDER LITTLE_ENDIAN
+#endif
@@ -0,0 +1,5 @@
+/**
+ * @file
+ * Empty host stand-in for the CE C toolchain's <graphx.h>, which
+ * src/drivers/usb_ethernet.c includes for on-calculator logging only.
+ */
@@ -0,0 +1,12 @@
+/**
+ * @file
+ * Host stand-in for the CE C toolchain's <sys/util.h>.
+ * random()/srandom() come from the host libc.
+ */
+
+#ifndef USBDRVCE_SIM_SYS_UTIL_H
+#define USBDRVCE_SIM_SYS_UTIL_H
+
+#include <stdlib.h>
+
+#endif /* USBDRVCE_SIM_SYS_UTIL_H */
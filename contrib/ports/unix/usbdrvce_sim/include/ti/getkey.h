@@ -0,0 +1,15 @@
+/**
+ * @file
+ * Host stand-in for the CE C toolchain's <ti/getkey.h>.
+ * lwipopts.h waits for a key after a failed assertion; on the host we abort at once.
+ */
+
+#ifndef USBDRVCE_SIM_TI_GETKEY_H
+#define USBDRVCE_SIM_TI_GETKEY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define os_GetKey() ((void)0)
+
+#endif /* USBDRVCE_SIM_TI_GETKEY_H */
@@ -0,0 +1,248 @@
+/**
+ * @file
+ * Host stand-in for the CE C toolchain's usbdrvce library.
+ *
+ * Declares the subset of the usbdrvce API used by src/drivers/usb_ethernet.c,
+ * with the same names, values and calling conventions, so the driver builds
+ * unchanged on Linux. The implementation in usbdrvce_sim.c emulates a single
+ * CDC-ECM or CDC-NCM adapter (see usbdrvce_sim.h).
+ */
+
+#ifndef USBDRVCE_SIM_USBDRVCE_H
+#define USBDRVCE_SIM_USBDRVCE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum usb_error {
+    USB_SUCCESS,
+    USB_IGNORE,
+    USB_ERROR_SYSTEM,
+    USB_ERROR_INVALID_PARAM,
+    USB_ERROR_SCHEDULE_FULL,
+    USB_ERROR_NO_DEVICE,
+    USB_ERROR_NO_MEMORY,
+    USB_ERROR_NOT_SUPPORTED,
+    USB_ERROR_OVERFLOW,
+    USB_ERROR_TIMEOUT,
+    USB_ERROR_FAILED,
+    USB_USER_ERROR = 100
+} usb_error_t;
+
+typedef enum usb_transfer_status {
+    USB_TRANSFER_COMPLETED = 0,
+    USB_TRANSFER_STALLED = 1 << 0,
+    USB_TRANSFER_NO_DEVICE = 1 << 1,
+    USB_TRANSFER_HOST_ERROR = 1 << 2,
+    USB_TRANSFER_ERROR = 1 << 3,
+    USB_TRANSFER_OVERFLOW = 1 << 4,
+    USB_TRANSFER_BUS_ERROR = 1 << 5,
+    USB_TRANSFER_FAILED = 1 << 6,
+    USB_TRANSFER_CANCELLED = 1 << 7
+} usb_transfer_status_t;
+
+typedef enum usb_role {
+    USB_ROLE_HOST = 0,
+    USB_ROLE_DEVICE = 1 << 4
+} usb_role_t;
+
+typedef enum usb_device_flags {
+    USB_IS_DISABLED = 1 << 0,
+    USB_IS_ENABLED = 1 << 1,
+    USB_IS_DEVICE = 1 << 2,
+    USB_IS_HUB = 1 << 3
+} usb_device_flags_t;
+
+typedef enum usb_endpoint_flag {
+    USB_MANUAL_TERMINATE = 0 << 0,
+    USB_AUTO_TERMINATE = 1 << 0
+} usb_endpoint_flag_t;
+
+typedef enum usb_event {
+    USB_ROLE_CHANGED_EVENT,
+    USB_DEVICE_DISCONNECTED_EVENT,
+    USB_DEVICE_CONNECTED_EVENT,
+    USB_DEVICE_DISABLED_EVENT,
+    USB_DEVICE_ENABLED_EVENT,
+    USB_HUB_LOCAL_POWER_GOOD_EVENT,
+    USB_HUB_LOCAL_POWER_LOST_EVENT,
+    USB_DEVICE_RESUMED_EVENT,
+    USB_DEVICE_SUSPENDED_EVENT,
+    USB_DEVICE_OVERCURRENT_DEACTIVATED_EVENT,
+    USB_DEVICE_OVERCURRENT_ACTIVATED_EVENT,
+    USB_DEFAULT_SETUP_EVENT,
+    USB_HOST_CONFIGURE_EVENT,
+    USB_HOST_PORT_CONNECT_STATUS_CHANGE_INTERRUPT
+} usb_event_t;
+
+typedef enum usb_descriptor_type {
+    USB_DEVICE_DESCRIPTOR = 1,
+    USB_CONFIGURATION_DESCRIPTOR,
+    USB_STRING_DESCRIPTOR,
+    USB_INTERFACE_DESCRIPTOR,
+    USB_ENDPOINT_DESCRIPTOR
+} usb_descriptor_type_t;
+
+typedef enum usb_class {
+    USB_INTERFACE_SPECIFIC_CLASS = 0x00,
+    USB_COMM_CLASS = 0x02,
+    USB_CDC_DATA_CLASS = 0x0A
+} usb_class_t;
+
+typedef enum usb_request_direction {
+    USB_HOST_TO_DEVICE = 0 << 7,
+    USB_DEVICE_TO_HOST = 1 << 7
+} usb_request_direction_t;
+
+typedef enum usb_transfer_type {
+    USB_CONTROL_TRANSFER,
+    USB_ISOCHRONOUS_TRANSFER,
+    USB_BULK_TRANSFER,
+    USB_INTERRUPT_TRANSFER
+} usb_transfer_type_t;
+
+#define USB_DEFAULT_INIT_FLAGS 0
+
+typedef struct usb_device *usb_device_t;
+typedef struct usb_endpoint *usb_endpoint_t;
+
+#ifndef usb_transfer_data_t
+#define usb_transfer_data_t void
+#endif
+#ifndef usb_callback_data_t
+#define usb_callback_data_t void
+#endif
+#ifndef usb_device_data_t
+#define usb_device_data_t void
+#endif
+
+typedef usb_error_t (*usb_transfer_callback_t)(usb_endpoint_t endpoint,
+                                               usb_transfer_status_t status,
+                                               size_t transferred,
+                                               usb_transfer_data_t *data);
+typedef usb_error_t (*usb_event_callback_t)(usb_event_t event, void *event_data,
+                                            usb_callback_data_t *callback_data);
+
+/* Descriptors are byte packed on the calculator, keep the same layout here */
+typedef struct __attribute__((packed)) usb_control_setup {
+    uint8_t bmRequestType;
+    uint8_t bRequest;
+    uint16_t wValue;
+    uint16_t wIndex;
+    uint16_t wLength;
+} usb_control_setup_t;
+
+typedef struct __attribute__((packed)) usb_descriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t data[];
+} usb_descriptor_t;
+
+typedef struct __attribute__((packed)) usb_device_descriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint16_t bcdUSB;
+    uint8_t bDeviceClass;
+    uint8_t bDeviceSubClass;
+    uint8_t bDeviceProtocol;
+    uint8_t bMaxPacketSize0;
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint16_t bcdDevice;
+    uint8_t iManufacturer;
+    uint8_t iProduct;
+    uint8_t iSerialNumber;
+    uint8_t bNumConfigurations;
+} usb_device_descriptor_t;
+
+typedef struct __attribute__((packed)) usb_configuration_descriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint16_t wTotalLength;
+    uint8_t bNumInterfaces;
+    uint8_t bConfigurationValue;
+    uint8_t iConfiguration;
+    uint8_t bmAttributes;
+    uint8_t bMaxPower;
+} usb_configuration_descriptor_t;
+
+typedef struct __attribute__((packed)) usb_interface_descriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bInterfaceNumber;
+    uint8_t bAlternateSetting;
+    uint8_t bNumEndpoints;
+    uint8_t bInterfaceClass;
+    uint8_t bInterfaceSubClass;
+    uint8_t bInterfaceProtocol;
+    uint8_t iInterface;
+} usb_interface_descriptor_t;
+
+typedef struct __attribute__((packed)) usb_endpoint_descriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bEndpointAddress;
+    uint8_t bmAttributes;
+    uint16_t wMaxPacketSize;
+    uint8_t bInterval;
+} usb_endpoint_descriptor_t;
+
+typedef struct __attribute__((packed)) usb_string_descriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint16_t bString[];
+} usb_string_descriptor_t;
+
+usb_error_t usb_Init(usb_event_callback_t handler, usb_callback_data_t *data,
+                     const void *device_descriptors, unsigned int flags);
+void usb_Cleanup(void);
+usb_error_t usb_HandleEvents(void);
+usb_role_t usb_GetRole(void);
+
+usb_device_t usb_RefDevice(usb_device_t device);
+usb_device_t usb_UnrefDevice(usb_device_t device);
+usb_error_t usb_ResetDevice(usb_device_t device);
+usb_error_t usb_DisableDevice(usb_device_t device);
+usb_device_flags_t usb_GetDeviceFlags(usb_device_t device);
+void usb_SetDeviceData(usb_device_t device, usb_device_data_t *data);
+usb_device_data_t *usb_GetDeviceData(usb_device_t device);
+
+usb_error_t usb_GetDeviceDescriptor(usb_device_t device, usb_device_descriptor_t *descriptor,
+                                    size_t length, size_t *transferred);
+size_t usb_GetConfigurationDescriptorTotalLength(usb_device_t device, uint8_t index);
+usb_error_t usb_GetConfigurationDescriptor(usb_device_t device, uint8_t index,
+                                           usb_configuration_descriptor_t *descriptor,
+                                           size_t length, size_t *transferred);
+usb_error_t usb_SetConfiguration(usb_device_t device,
+                                 const usb_configuration_descriptor_t *descriptor,
+                                 size_t length);
+usb_error_t usb_SetInterface(usb_device_t device, const usb_interface_descriptor_t *descriptor,
+                             size_t length);
+usb_error_t usb_GetStringDescriptor(usb_device_t device, uint8_t index, uint16_t langid,
+                                    usb_string_descriptor_t *descriptor, size_t length,
+                                    size_t *transferred);
+
+usb_endpoint_t usb_GetDeviceEndpoint(usb_device_t device, uint8_t address);
+size_t usb_GetEndpointMaxPacketSize(usb_endpoint_t endpoint);
+void usb_SetEndpointFlags(usb_endpoint_t endpoint, usb_endpoint_flag_t flags);
+
+usb_error_t usb_DefaultControlTransfer(usb_device_t device, const usb_control_setup_t *setup,
+                                       void *buffer, unsigned int retries, size_t *transferred);
+usb_error_t usb_ScheduleDefaultControlTransfer(usb_device_t device, const usb_control_setup_t *setup,
+                                               void *buffer, usb_transfer_callback_t handler,
+                                               usb_transfer_data_t *data);
+usb_error_t usb_ScheduleBulkTransfer(usb_endpoint_t endpoint, void *buffer, size_t length,
+                                     usb_transfer_callback_t handler, usb_transfer_data_t *data);
+usb_error_t usb_ScheduleInterruptTransfer(usb_endpoint_t endpoint, void *buffer, size_t length,
+                                          usb_transfer_callback_t handler, usb_transfer_data_t *data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* USBDRVCE_SIM_USBDRVCE_H */
@@ -0,0 +1,967 @@
+/**
+ * @file
+ * Regression checks for the USB-Ethernet driver and the heap layer, run on
+ * the usbdrvce simulator. ctest runs this as sim_check.
+ *
+ * Covered: NCM receive parsing of malformed NTBs, which segments NCM receive
+ * coalescing merges, which frames are sent ahead of bulk data and how far
+ * ahead, category quotas refusing allocations, memp recycle limits, receiving
+ * while the stack and the application hold on to earlier frames, and
+ * unplugging or resetting an adapter while its transfers are still in flight.
+ * Build with -fsanitize=address to have the last two catch callbacks into a
+ * freed device.
+ *
+ * Each check prints one line, the exit status is nonzero if any failed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lwip/init.h"
+#include "lwip/mem.h"
+#include "lwip/memp.h"
+#include "lwip/pbuf.h"
+#include "lwip/netif.h"
+#include "lwip/timeouts.h"
+#include "lwip/udp.h"
+#include "lwip/tcp.h"
+#include "lwip/inet_chksum.h"
+#include "lwip/prot/ethernet.h"
+#include "lwip/prot/ip4.h"
+#include "lwip/prot/ip6.h"
+#include "lwip/prot/udp.h"
+#include "lwip/prot/tcp.h"
+#include "lwip/prot/etharp.h"
+#include "netif/ethernet.h"
+
+#include "drivers/usb_ethernet.h"
+#include "usbdrvce_sim.h"
+
+#define CHECK_HEAP      65536
+#define CHECK_PAYLOAD   100
+#define CHECK_ETHTYPE   0x88B5      /* local experimental, lwIP drops it after the driver counts it */
+
+static const uint8_t peer_mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+static const uint8_t dev_mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x02};
+
+static unsigned int failures;
+static unsigned long pressure_high;
+
+#define CHECK(what, cond) check((what), (cond), #cond)
+
+static void
+check(const char *what, bool ok, const char *cond)
+{
+  printf("%-4s %s\n", ok ? "ok" : "FAIL", what);
+  if (!ok) {
+    printf("     %s\n", cond);
+    failures++;
+  }
+}
+
+static double
+now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+pump(void)
+{
+  usb_HandleEvents();
+  eth_poll(16);
+  sys_check_timeouts();
+}
+
+static void
+check_pressure(enum mem_pressure level)
+{
+  if (level == MEM_PRESSURE_HIGH) {
+    pressure_high++;
+  }
+}
+
+/* late_cancel has unplug and reset report their event before cancelling transfers */
+static struct netif *
+attach(enum usbsim_class cls, uint32_t latency_us, bool late_cancel)
+{
+  struct usbsim_config conf;
+  double deadline = now_s() + 5.0;
+  struct netif *netif;
+  memset(&conf, 0, sizeof(conf));
+  conf.cls = cls;
+  memcpy(conf.hwaddr, dev_mac, 6);
+  conf.latency_us = latency_us;
+  conf.mc_filters = 16;
+  conf.cancel_after_disconnect = late_cancel;
+  conf.cancel_after_reset = late_cancel;
+  usbsim_attach(&conf);
+  do {
+    pump();
+    netif = netif_find("en0");
+    if ((netif != NULL) && netif_is_link_up(netif)) {
+      return netif;
+    }
+  } while (now_s() < deadline);
+  return NULL;
+}
+
+/* unplugs the adapter, false if the driver did not let go of it */
+static bool
+detach(void)
+{
+  double deadline = now_s() + 5.0;
+  usbsim_detach();
+  do {
+    pump();
+  } while (eth_get_interfaces() && (now_s() < deadline));
+  /* completions of anything the driver left behind */
+  for (int i = 0; i < 10; i++) {
+    pump();
+  }
+  return eth_get_interfaces() == 0;
+}
+
+/* runs until the peer's queue is delivered, with a few passes for the completions */
+static void
+drain(void)
+{
+  double deadline = now_s() + 2.0;
+  while (usbsim_peer_pending() && (now_s() < deadline)) {
+    pump();
+  }
+  for (int i = 0; i < 4; i++) {
+    pump();
+  }
+}
+
+static struct eth_stats
+stats(struct netif *netif)
+{
+  struct eth_stats st;
+  memset(&st, 0, sizeof(st));
+  eth_get_stats(netif->num, &st);
+  return st;
+}
+
+static void
+put16(uint8_t *p, uint16_t v)
+{
+  p[0] = v & 0xff;
+  p[1] = v >> 8;
+}
+
+static void
+put32(uint8_t *p, uint32_t v)
+{
+  put16(p, v & 0xffff);
+  put16(p + 2, v >> 16);
+}
+
+/*-----------------------------------------------------------------------------------*/
+/* Frames */
+
+static uint8_t *
+build_eth(uint8_t *frame, const uint8_t *dst, const uint8_t *src, uint16_t type)
+{
+  memcpy(frame, dst, 6);
+  memcpy(frame + 6, src, 6);
+  frame[12] = type >> 8;
+  frame[13] = type & 0xff;
+  return frame + SIZEOF_ETH_HDR;
+}
+
+/* IPv4 header from 10.0.0.1 to 10.0.0.2, frag is the flags and offset field */
+static uint8_t *
+build_ip4(uint8_t *ip, uint8_t proto, uint16_t frag, uint16_t l4_len)
+{
+  uint16_t len = IP_HLEN + l4_len, chksum;
+  memset(ip, 0, IP_HLEN);
+  ip[0] = 0x45;
+  ip[2] = len >> 8;
+  ip[3] = len & 0xff;
+  ip[6] = frag >> 8;
+  ip[7] = frag & 0xff;
+  ip[8] = 64;
+  ip[9] = proto;
+  ip[12] = 10, ip[15] = 1;
+  ip[16] = 10, ip[19] = 2;
+  chksum = inet_chksum(ip, IP_HLEN);
+  memcpy(&ip[10], &chksum, 2);
+  return ip + IP_HLEN;
+}
+
+/* a TCP segment of the peer's, as the GRO checks vary it */
+struct seg {
+  uint8_t flags;
+  uint32_t seq;
+  uint16_t window;
+  uint16_t sport;
+  uint16_t frag;
+  uint32_t tsval;       /* nonzero adds NOP, NOP, timestamp */
+  bool bad_ip_chksum;
+};
+
+static size_t
+build_tcp(uint8_t *frame, const struct seg *s)
+{
+  uint8_t pseudo[12 + TCP_HLEN + 12 + CHECK_PAYLOAD];
+  uint16_t opt_len = s->tsval ? 12 : 0;
+  uint16_t tcp_len = TCP_HLEN + opt_len + CHECK_PAYLOAD, chksum;
+  uint8_t *ip = build_eth(frame, dev_mac, peer_mac, ETHTYPE_IP);
+  uint8_t *tcp = build_ip4(ip, IP_PROTO_TCP, s->frag, tcp_len);
+  memset(tcp, 0, tcp_len);
+  tcp[0] = s->sport >> 8;
+  tcp[1] = s->sport & 0xff;
+  tcp[2] = 7000 >> 8;
+  tcp[3] = 7000 & 0xff;
+  tcp[4] = s->seq >> 24;
+  tcp[5] = (s->seq >> 16) & 0xff;
+  tcp[6] = (s->seq >> 8) & 0xff;
+  tcp[7] = s->seq & 0xff;
+  tcp[11] = 1;
+  tcp[12] = ((TCP_HLEN + opt_len) / 4) << 4;
+  tcp[13] = s->flags;
+  tcp[14] = s->window >> 8;
+  tcp[15] = s->window & 0xff;
+  if (s->tsval) {
+    tcp[TCP_HLEN] = tcp[TCP_HLEN + 1] = 1;
+    tcp[TCP_HLEN + 2] = 8;
+    tcp[TCP_HLEN + 3] = 10;
+    memcpy(&tcp[TCP_HLEN + 4], &s->tsval, 4);
+  }
+  memset(tcp + TCP_HLEN + opt_len, 'x', CHECK_PAYLOAD);
+  memcpy(pseudo, ip + 12, 8);
+  pseudo[8] = 0;
+  pseudo[9] = IP_PROTO_TCP;
+  pseudo[10] = tcp_len >> 8;
+  pseudo[11] = tcp_len & 0xff;
+  memcpy(pseudo + 12, tcp, tcp_len);
+  chksum = inet_chksum(pseudo, 12 + tcp_len);
+  memcpy(&tcp[16], &chksum, 2);
+  if (s->bad_ip_chksum) {
+    ip[10] ^= 0xff;
+  }
+  return SIZEOF_ETH_HDR + IP_HLEN + tcp_len;
+}
+
+/*-----------------------------------------------------------------------------------*/
+/* NCM receive parsing */
+
+#define NTB_DG_LEN      60
+#define NTB_MAX         1024
+
+/* NTB-16 with its NDP at ndp_index and an entry per (index, length) pair, null entry included */
+static size_t
+build_ntb(uint8_t *ntb, size_t len, uint16_t ndp_index, const uint16_t (*dg)[2], unsigned int n)
+{
+  unsigned int i;
+  memset(ntb, 0, NTB_MAX);
+  put32(ntb, 0x484D434EUL);         /* "NCMH" */
+  put16(ntb + 4, 12);
+  put16(ntb + 8, (uint16_t)len);
+  put16(ntb + 10, ndp_index);
+  if (ndp_index + 8 <= NTB_MAX) {
+    put32(ntb + ndp_index, 0x304D434EUL);     /* "NCM0" */
+    put16(ntb + ndp_index + 4, (uint16_t)(8 + 4 * n));
+  }
+  for (i = 0; i < n; i++) {
+    if (ndp_index + 12 + 4 * i <= NTB_MAX) {
+      put16(ntb + ndp_index + 8 + 4 * i, dg[i][0]);
+      put16(ntb + ndp_index + 10 + 4 * i, dg[i][1]);
+    }
+  }
+  /* datagrams go wherever the entries point, as far as they fit */
+  for (i = 0; i < n; i++) {
+    if (dg[i][0] && (dg[i][0] + SIZEOF_ETH_HDR <= NTB_MAX)) {
+      build_eth(ntb + dg[i][0], dev_mac, peer_mac, CHECK_ETHTYPE);
+    }
+  }
+  return len;
+}
+
+/* frames the driver handed to lwIP out of one NTB */
+static uint32_t
+ntb_frames(struct netif *netif, const uint8_t *ntb, size_t len)
+{
+  uint32_t before = stats(netif).frames_in;
+  usbsim_peer_send_ntb(ntb, len);
+  drain();
+  return stats(netif).frames_in - before;
+}
+
+static void
+check_ntb_parsing(void)
+{
+  static const uint16_t good[][2] = {{64, NTB_DG_LEN}, {128, NTB_DG_LEN}, {0, 0}};
+  static const uint16_t long_dg[][2] = {{64, NTB_DG_LEN}, {128, 1000}, {0, 0}};
+  static const uint16_t far_dg[][2] = {{64, NTB_DG_LEN}, {5000, NTB_DG_LEN}, {0, 0}};
+  static const uint16_t wrap_dg[][2] = {{64, NTB_DG_LEN}, {128, 0xffc0}, {0, 0}};
+  static const uint16_t unterminated[][2] = {{64, NTB_DG_LEN}, {128, NTB_DG_LEN}};
+  uint8_t ntb[NTB_MAX];
+  struct netif *netif = attach(USBSIM_NCM, 0, false);
+  size_t len;
+
+  CHECK("ntb: adapter up", netif != NULL);
+  if (netif == NULL) {
+    return;
+  }
+  len = build_ntb(ntb, 192, 12, good, 3);
+  CHECK("ntb: well-formed NTB delivers both datagrams", ntb_frames(netif, ntb, len) == 2);
+
+  len = build_ntb(ntb, 192, 12, good, 3);
+  ntb[0] ^= 0xff;
+  CHECK("ntb: bad NTH signature is dropped", ntb_frames(netif, ntb, len) == 0);
+
+  len = build_ntb(ntb, 8, 12, good, 3);
+  CHECK("ntb: transfer shorter than the NTH is dropped", ntb_frames(netif, ntb, len) == 0);
+
+  len = build_ntb(ntb, 192, 4000, good, 3);
+  CHECK("ntb: NDP index past the transfer is dropped", ntb_frames(netif, ntb, len) == 0);
+
+  len = build_ntb(ntb, 192, 188, good, 3);
+  CHECK("ntb: NDP header crossing the end of the transfer is dropped", ntb_frames(netif, ntb, len) == 0);
+
+  len = build_ntb(ntb, 192, 12, good, 3);
+  ntb[12] ^= 0xff;
+  CHECK("ntb: bad NDP signature is dropped", ntb_frames(netif, ntb, len) == 0);
+
+  len = build_ntb(ntb, 192, 12, long_dg, 3);
+  CHECK("ntb: datagram running past the transfer stops parsing", ntb_frames(netif, ntb, len) == 1);
+
+  len = build_ntb(ntb, 192, 12, far_dg, 3);
+  CHECK("ntb: datagram index past the transfer stops parsing", ntb_frames(netif, ntb, len) == 1);
+
+  len = build_ntb(ntb, 192, 12, wrap_dg, 3);
+  CHECK("ntb: datagram length wrapping the index stops parsing", ntb_frames(netif, ntb, len) == 1);
+
+  /* entries run up to the end of the transfer without a null entry */
+  len = build_ntb(ntb, 208, 192, unterminated, 2);
+  CHECK("ntb: NDP without a null entry ends at the transfer", ntb_frames(netif, ntb, len) == 2);
+
+  len = build_ntb(ntb, 192, 12, good, 3);
+  put16(ntb + 12 + 6, 12);
+  CHECK("ntb: NDP chain pointing at itself is parsed once", ntb_frames(netif, ntb, len) == 2);
+
+  CHECK("ntb: adapter removed", detach());
+}
+
+/*-----------------------------------------------------------------------------------*/
+/* NCM receive coalescing */
+
+/* segments merged into the one before them when sent in one NTB */
+static uint32_t
+gro_merged(struct netif *netif, const struct seg *segs, unsigned int n)
+{
+  uint8_t frame[SIZEOF_ETH_HDR + IP_HLEN + TCP_HLEN + 12 + CHECK_PAYLOAD];
+  uint32_t before = stats(netif).coalesced;
+  unsigned int i;
+  for (i = 0; i < n; i++) {
+    usbsim_peer_send(frame, build_tcp(frame, &segs[i]));
+  }
+  drain();
+  return stats(netif).coalesced - before;
+}
+
+static void
+check_gro(void)
+{
+#if NCM_RX_GRO
+  const uint8_t ack = TCP_ACK, psh = TCP_ACK | TCP_PSH;
+  const uint16_t p = CHECK_PAYLOAD;
+  const struct seg in_order[] = {{ack, 1000, 8192, 40000, 0, 0, false}, {psh, 1000 + p, 8192, 40000, 0, 0, false}, {ack, 1000 + 2 * p, 8192, 40000, 0, 0, false}};
+  const struct seg gap[] = {{ack, 1000, 8192, 40000, 0, 0, false}, {ack, 1000 + p, 8192, 40000, 0, 0, false}, {ack, 1000 + 3 * p, 8192, 40000, 0, 0, false}};
+  const struct seg window[] = {{ack, 1000, 8192, 40000, 0, 0, false}, {ack, 1000 + p, 4096, 40000, 0, 0, false}};
+  const struct seg ports[] = {{ack, 1000, 8192, 40000, 0, 0, false}, {ack, 1000 + p, 8192, 40001, 0, 0, false}};
+  const struct seg fin[] = {{ack, 1000, 8192, 40000, 0, 0, false}, {ack | TCP_FIN, 1000 + p, 8192, 40000, 0, 0, false}};
+  const struct seg syn[] = {{ack | TCP_SYN, 1000, 8192, 40000, 0, 0, false}, {ack, 1000 + p, 8192, 40000, 0, 0, false}};
+  const struct seg first_frag[] = {{ack, 1000, 8192, 40000, 0, 0, false}, {ack, 1000 + p, 8192, 40000, IP_MF, 0, false}};
+  const struct seg frag[] = {{ack, 1000, 8192, 40000, 0, 0, false}, {ack, 1000 + p, 8192, 40000, 0x0010, 0, false}};
+  const struct seg chksum[] = {{ack, 1000, 8192, 40000, 0, 0, false}, {ack, 1000 + p, 8192, 40000, 0, 0, true}};
+  const struct seg ts[] = {{ack, 1000, 8192, 40000, 0, 1, false}, {ack, 1000 + p, 8192, 40000, 0, 2, false}};
+  const struct seg ts_mixed[] = {{ack, 1000, 8192, 40000, 0, 1, false}, {ack, 1000 + p, 8192, 40000, 0, 0, false}};
+  struct netif *netif = attach(USBSIM_NCM, 0, false);
+
+  CHECK("gro: adapter up", netif != NULL);
+  if (netif == NULL) {
+    return;
+  }
+  CHECK("gro: in-order segments merge, PSH included", gro_merged(netif, in_order, 3) == 2);
+  CHECK("gro: sequence gap starts a new segment", gro_merged(netif, gap, 3) == 1);
+  CHECK("gro: window change is not merged", gro_merged(netif, window, 2) == 0);
+  CHECK("gro: other connection is not merged", gro_merged(netif, ports, 2) == 0);
+  CHECK("gro: FIN is not merged", gro_merged(netif, fin, 2) == 0);
+  CHECK("gro: SYN is not merged", gro_merged(netif, syn, 2) == 0);
+  CHECK("gro: first fragment (MF, offset 0) is not merged", gro_merged(netif, first_frag, 2) == 0);
+  CHECK("gro: later fragment is not merged", gro_merged(netif, frag, 2) == 0);
+  CHECK("gro: bad IP checksum is not merged", gro_merged(netif, chksum, 2) == 0);
+  CHECK("gro: differing timestamp values merge", gro_merged(netif, ts, 2) == 1);
+  CHECK("gro: differing options are not merged", gro_merged(netif, ts_mixed, 2) == 0);
+  CHECK("gro: adapter removed", detach());
+#else
+  printf("skip gro: built with NCM_RX_GRO=0\n");
+#endif
+}
+
+/*-----------------------------------------------------------------------------------*/
+/* Urgent frames */
+
+/* whether linkoutput counted the frame as urgent */
+static bool
+sent_urgent(struct netif *netif, const uint8_t *frame, size_t len)
+{
+  uint32_t before = stats(netif).urgent;
+  struct pbuf *p = pbuf_alloc(PBUF_RAW, (u16_t)len, PBUF_RAM);
+  if (p == NULL) {
+    return false;
+  }
+  pbuf_take(p, frame, (u16_t)len);
+  netif->linkoutput(netif, p);
+  pbuf_free(p);
+  drain();
+  return stats(netif).urgent != before;
+}
+
+static size_t
+build_udp(uint8_t *frame, uint16_t dport, uint16_t frag)
+{
+  uint8_t *udp = build_ip4(build_eth(frame, peer_mac, dev_mac, ETHTYPE_IP), IP_PROTO_UDP, frag, UDP_HLEN + 32);
+  memset(udp, 0, UDP_HLEN + 32);
+  udp[0] = 0xc0;
+  udp[2] = dport >> 8;
+  udp[3] = dport & 0xff;
+  udp[5] = UDP_HLEN + 32;
+  return SIZEOF_ETH_HDR + IP_HLEN + UDP_HLEN + 32;
+}
+
+static size_t
+build_tcp_out(uint8_t *frame, uint8_t flags, uint16_t payload)
+{
+  uint8_t *tcp = build_ip4(build_eth(frame, peer_mac, dev_mac, ETHTYPE_IP), IP_PROTO_TCP, 0, TCP_HLEN + payload);
+  memset(tcp, 0, TCP_HLEN + payload);
+  tcp[12] = (TCP_HLEN / 4) << 4;
+  tcp[13] = flags;
+  return SIZEOF_ETH_HDR + IP_HLEN + TCP_HLEN + payload;
+}
+
+static void
+check_urgent(void)
+{
+  uint8_t frame[256];
+  uint8_t *l3;
+  struct netif *netif = attach(USBSIM_ECM, 0, false);
+
+  CHECK("urgent: adapter up", netif != NULL);
+  if (netif == NULL) {
+    return;
+  }
+  l3 = build_eth(frame, ethbroadcast.addr, dev_mac, ETHTYPE_ARP);
+  memset(l3, 0, SIZEOF_ETHARP_HDR);
+  CHECK("urgent: ARP", sent_urgent(netif, frame, SIZEOF_ETH_HDR + SIZEOF_ETHARP_HDR));
+
+  l3 = build_ip4(build_eth(frame, peer_mac, dev_mac, ETHTYPE_IP), IP_PROTO_ICMP, 0, 8);
+  memset(l3, 0, 8);
+  CHECK("urgent: ICMP", sent_urgent(netif, frame, SIZEOF_ETH_HDR + IP_HLEN + 8));
+
+  l3 = build_eth(frame, peer_mac, dev_mac, ETHTYPE_IPV6);
+  memset(l3, 0, IP6_HLEN + 8);
+  l3[0] = 0x60;
+  l3[5] = 8;
+  l3[6] = IP6_NEXTH_ICMP6;
+  CHECK("urgent: ICMPv6", sent_urgent(netif, frame, SIZEOF_ETH_HDR + IP6_HLEN + 8));
+
+  CHECK("urgent: DNS query", sent_urgent(netif, frame, build_udp(frame, 53, 0)));
+  CHECK("urgent: pure ACK", sent_urgent(netif, frame, build_tcp_out(frame, TCP_ACK, 0)));
+  CHECK("bulk: other UDP", !sent_urgent(netif, frame, build_udp(frame, 9, 0)));
+  CHECK("bulk: ACK with payload", !sent_urgent(netif, frame, build_tcp_out(frame, TCP_ACK, 16)));
+  CHECK("bulk: SYN", !sent_urgent(netif, frame, build_tcp_out(frame, TCP_SYN, 0)));
+  CHECK("bulk: FIN", !sent_urgent(netif, frame, build_tcp_out(frame, TCP_ACK | TCP_FIN, 0)));
+  CHECK("bulk: RST", !sent_urgent(netif, frame, build_tcp_out(frame, TCP_RST, 0)));
+  CHECK("bulk: first fragment of a DNS query (MF, offset 0)", !sent_urgent(netif, frame, build_udp(frame, 53, IP_MF)));
+  CHECK("bulk: later fragment", !sent_urgent(netif, frame, build_udp(frame, 53, 0x0010)));
+  CHECK("bulk: fragment with only the offset's high bits set", !sent_urgent(netif, frame, build_udp(frame, 53, 0x1000)));
+  CHECK("urgent: adapter removed", detach());
+}
+
+/* the peer's view of the order frames were sent in */
+static struct {
+  bool seen;                    /* the ARP frame came in */
+  uint32_t urgent_at;           /* transfers completed ahead of the one carrying it */
+} order;
+
+static void
+order_peer_recv(const uint8_t *frame, size_t len, void *arg)
+{
+  struct usbsim_stats st;
+  (void)arg;
+  if ((len >= SIZEOF_ETH_HDR) && (frame[12] == (ETHTYPE_ARP >> 8)) && (frame[13] == (ETHTYPE_ARP & 0xff))) {
+    /* counted before its frames are delivered */
+    usbsim_get_stats(&st);
+    order.seen = true;
+    order.urgent_at = st.bulk_out - 1;
+  }
+}
+
+static void
+order_send(struct netif *netif, const uint8_t *frame, size_t len)
+{
+  struct pbuf *p = pbuf_alloc(PBUF_RAW, (u16_t)len, PBUF_RAM);
+  if (p != NULL) {
+    pbuf_take(p, frame, (u16_t)len);
+    netif->linkoutput(netif, p);
+    pbuf_free(p);
+  }
+}
+
+/* an ARP frame sent behind a full ring of bulk transfers overtakes all but those on the endpoint */
+static void
+check_urgent_order(enum usbsim_class cls)
+{
+  const char *name = (cls == USBSIM_NCM) ? "ncm" : "ecm";
+  char what[80];
+  uint8_t frame[1400];
+  struct netif *netif;
+  double deadline;
+  unsigned int i;
+
+  /* transfers take 5 ms, so the bulk frames below are still queued when the ARP frame comes */
+  netif = attach(cls, 5000, false);
+  snprintf(what, sizeof(what), "urgent order %s: adapter up", name);
+  CHECK(what, netif != NULL);
+  if (netif == NULL) {
+    return;
+  }
+  memset(&order, 0, sizeof(order));
+  usbsim_reset_stats();
+  usbsim_set_peer_recv(order_peer_recv, NULL);
+  /* padded so that NCM fits one in an NTB, and each takes a transfer of its own */
+  memset(frame, 0, sizeof(frame));
+  build_udp(frame, 9, 0);
+  for (i = 0; i < ETH_TX_QUEUE_DEFAULT; i++) {
+    order_send(netif, frame, sizeof(frame));
+  }
+  memset(build_eth(frame, ethbroadcast.addr, dev_mac, ETHTYPE_ARP), 0, SIZEOF_ETHARP_HDR);
+  order_send(netif, frame, SIZEOF_ETH_HDR + SIZEOF_ETHARP_HDR);
+  deadline = now_s() + 1.0;
+  while (!order.seen && (now_s() < deadline)) {
+    pump();
+  }
+  drain();
+  usbsim_set_peer_recv(NULL, NULL);
+  snprintf(what, sizeof(what), "urgent order %s: ARP sent", name);
+  CHECK(what, order.seen);
+  snprintf(what, sizeof(what), "urgent order %s: ARP behind at most %u bulk transfers", name, ETH_TX_BULK_INFLIGHT);
+  CHECK(what, order.seen && (order.urgent_at <= ETH_TX_BULK_INFLIGHT));
+  snprintf(what, sizeof(what), "urgent order %s: adapter removed", name);
+  CHECK(what, detach());
+}
+
+/*-----------------------------------------------------------------------------------*/
+/* Receiving while frames are held */
+
+#define HELD_UDP        3
+
+/* the peer's end of the connection, and what the stack and the application kept */
+static struct {
+  bool established;     /* SYN-ACK seen */
+  uint32_t rcv_nxt;     /* what the peer acknowledges */
+  struct tcp_pcb *pcb;  /* accepted connection */
+  bool refuse;          /* the recv callback refuses data */
+  uint32_t tcp_bytes;   /* taken by the recv callback */
+  struct pbuf *udp[HELD_UDP];
+  unsigned int udp_n;   /* datagrams the application holds on to */
+} held;
+
+static bool
+peer_arp_reply(const uint8_t *frame, size_t len)
+{
+  uint8_t reply[SIZEOF_ETH_HDR + SIZEOF_ETHARP_HDR];
+  const struct etharp_hdr *req = (const struct etharp_hdr *)(frame + SIZEOF_ETH_HDR);
+  struct etharp_hdr *arp = (struct etharp_hdr *)(reply + SIZEOF_ETH_HDR);
+  if ((len < SIZEOF_ETH_HDR + SIZEOF_ETHARP_HDR) || (frame[12] != 0x08) || (frame[13] != 0x06)) {
+    return false;
+  }
+  if (req->opcode != PP_HTONS(ARP_REQUEST)) {
+    return true;
+  }
+  memcpy(reply, frame, sizeof(reply));
+  memcpy(reply, frame + 6, 6);
+  memcpy(reply + 6, peer_mac, 6);
+  arp->opcode = PP_HTONS(ARP_REPLY);
+  memcpy(&arp->shwaddr, peer_mac, 6);
+  memcpy(&arp->sipaddr, &req->dipaddr, 4);
+  memcpy(&arp->dhwaddr, &req->shwaddr, 6);
+  memcpy(&arp->dipaddr, &req->sipaddr, 4);
+  usbsim_peer_send(reply, sizeof(reply));
+  return true;
+}
+
+static void
+held_peer_recv(const uint8_t *frame, size_t len, void *arg)
+{
+  const struct tcp_hdr *tcp = (const struct tcp_hdr *)(frame + SIZEOF_ETH_HDR + IP_HLEN);
+  (void)arg;
+  if (peer_arp_reply(frame, len)) {
+    return;
+  }
+  if ((len >= SIZEOF_ETH_HDR + IP_HLEN + TCP_HLEN) && (frame[SIZEOF_ETH_HDR + 9] == IP_PROTO_TCP) &&
+      ((TCPH_FLAGS(tcp) & (TCP_SYN | TCP_ACK)) == (TCP_SYN | TCP_ACK))) {
+    held.established = true;
+    held.rcv_nxt = lwip_ntohl(tcp->seqno) + 1;
+  }
+}
+
+/* a segment of the peer's on the connection, payload bytes of 'x' */
+static size_t
+build_tcp_conn(uint8_t *frame, uint8_t flags, uint32_t seq, uint16_t payload)
+{
+  uint8_t *ip = build_eth(frame, dev_mac, peer_mac, ETHTYPE_IP);
+  struct tcp_hdr *tcp = (struct tcp_hdr *)build_ip4(ip, IP_PROTO_TCP, 0, TCP_HLEN + payload);
+  ip_addr_t src, dst;
+  struct pbuf *p;
+  memset(tcp, 0, TCP_HLEN);
+  tcp->src = PP_HTONS(40000);
+  tcp->dest = PP_HTONS(7000);
+  tcp->seqno = lwip_htonl(seq);
+  tcp->ackno = lwip_htonl(held.rcv_nxt);
+  TCPH_HDRLEN_FLAGS_SET(tcp, TCP_HLEN / 4, flags);
+  tcp->wnd = PP_HTONS(8192);
+  memset((uint8_t *)tcp + TCP_HLEN, 'x', payload);
+  IP_ADDR4(&src, 10, 0, 0, 1);
+  IP_ADDR4(&dst, 10, 0, 0, 2);
+  p = pbuf_alloc(PBUF_RAW, TCP_HLEN + payload, PBUF_REF);
+  if (p != NULL) {
+    p->payload = tcp;
+    tcp->chksum = ip_chksum_pseudo(p, IP_PROTO_TCP, p->tot_len, &src, &dst);
+    pbuf_free(p);
+  }
+  return SIZEOF_ETH_HDR + IP_HLEN + TCP_HLEN + payload;
+}
+
+static err_t
+held_tcp_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
+{
+  (void)arg;
+  (void)err;
+  if (p == NULL) {
+    return ERR_OK;
+  }
+  if (held.refuse) {
+    /* lwIP keeps it as refused data and offers it again later */
+    return ERR_MEM;
+  }
+  held.tcp_bytes += p->tot_len;
+  tcp_recved(pcb, p->tot_len);
+  pbuf_free(p);
+  return ERR_OK;
+}
+
+static err_t
+held_tcp_accept(void *arg, struct tcp_pcb *pcb, err_t err)
+{
+  (void)arg;
+  (void)err;
+  held.pcb = pcb;
+  tcp_recv(pcb, held_tcp_recv);
+  return ERR_OK;
+}
+
+/* keeps every datagram, as an application slow to read them would */
+static void
+held_udp_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+  (void)arg;
+  (void)pcb;
+  (void)addr;
+  (void)port;
+  if (held.udp_n < HELD_UDP) {
+    held.udp[held.udp_n++] = p;
+  } else {
+    pbuf_free(p);
+  }
+}
+
+static void
+held_send(const uint8_t *frame, size_t len)
+{
+  usbsim_peer_send(frame, len);
+  drain();
+}
+
+static void
+check_rx_held(enum usbsim_class cls)
+{
+  const char *name = (cls == USBSIM_NCM) ? "ncm" : "ecm";
+  const uint32_t iss = 1000, p = CHECK_PAYLOAD;
+  char what[80];
+  uint8_t frame[SIZEOF_ETH_HDR + IP_HLEN + TCP_HLEN + CHECK_PAYLOAD];
+  struct netif *netif;
+  struct tcp_pcb *lpcb;
+  struct udp_pcb *upcb;
+  ip4_addr_t ip, mask, gw;
+  double deadline;
+  unsigned int i;
+
+  netif = attach(cls, 0, false);
+  snprintf(what, sizeof(what), "rx held %s: adapter up", name);
+  CHECK(what, netif != NULL);
+  if (netif == NULL) {
+    return;
+  }
+  IP4_ADDR(&ip, 10, 0, 0, 2);
+  IP4_ADDR(&mask, 255, 255, 255, 0);
+  IP4_ADDR(&gw, 10, 0, 0, 1);
+  netif_set_addr(netif, &ip, &mask, &gw);
+  memset(&held, 0, sizeof(held));
+  usbsim_set_peer_recv(held_peer_recv, NULL);
+  lpcb = tcp_new();
+  tcp_bind(lpcb, IP4_ADDR_ANY, 7000);
+  lpcb = tcp_listen(lpcb);
+  tcp_accept(lpcb, held_tcp_accept);
+  upcb = udp_new();
+  udp_bind(upcb, IP4_ADDR_ANY, 7001);
+  udp_recv(upcb, held_udp_recv, NULL);
+
+  held_send(frame, build_tcp_conn(frame, TCP_SYN, iss, 0));
+  held_send(frame, build_tcp_conn(frame, TCP_ACK, iss + 1, 0));
+  snprintf(what, sizeof(what), "rx held %s: connection accepted", name);
+  CHECK(what, held.established && (held.pcb != NULL));
+  if (held.pcb == NULL) {
+    goto out;
+  }
+
+  /* the two later segments sit on the ooseq queue until the first one comes in */
+  held_send(frame, build_tcp_conn(frame, TCP_ACK, iss + 1 + p, p));
+  held_send(frame, build_tcp_conn(frame, TCP_ACK, iss + 1 + 2 * p, p));
+  held_send(frame, build_tcp_conn(frame, TCP_ACK, iss + 1, p));
+  snprintf(what, sizeof(what), "rx held %s: segment filling the gap received behind ooseq data", name);
+  CHECK(what, held.tcp_bytes == 3 * p);
+
+  /* refused data and datagrams the application has not read yet */
+  held.refuse = true;
+  held_send(frame, build_tcp_conn(frame, TCP_ACK, iss + 1 + 3 * p, p));
+  for (i = 0; i < HELD_UDP; i++) {
+    size_t len = build_udp(frame, 7001, 0);
+    memcpy(frame, dev_mac, 6);
+    memcpy(frame + 6, peer_mac, 6);
+    held_send(frame, len);
+  }
+  snprintf(what, sizeof(what), "rx held %s: datagrams received behind refused and unread data", name);
+  CHECK(what, (held.udp_n == HELD_UDP) && (usbsim_peer_pending() == 0));
+
+  held.refuse = false;
+  while (held.udp_n) {
+    pbuf_free(held.udp[--held.udp_n]);
+  }
+  deadline = now_s() + 2.0;
+  while ((held.tcp_bytes < 4 * p) && (now_s() < deadline)) {
+    pump();
+  }
+  snprintf(what, sizeof(what), "rx held %s: refused data delivered once taken", name);
+  CHECK(what, held.tcp_bytes == 4 * p);
+  tcp_abort(held.pcb);
+
+out:
+  udp_remove(upcb);
+  tcp_close(lpcb);
+  drain();
+  usbsim_set_peer_recv(NULL, NULL);
+  snprintf(what, sizeof(what), "rx held %s: adapter removed", name);
+  CHECK(what, detach());
+}
+
+/*-----------------------------------------------------------------------------------*/
+/* Heap quotas and recycling */
+
+static size_t
+heap_used(void)
+{
+  size_t used = 0;
+  for (uint8_t cat = 0; cat < MEM_CATEGORIES; cat++) {
+    used += mem_category_usage(cat);
+  }
+  return used;
+}
+
+static void
+check_quota(void)
+{
+  struct pbuf *held[256];
+  size_t quota = 8 * PBUF_POOL_BUFSIZE, peak;
+  unsigned int n = 0;
+
+  mem_conf.quota[MEM_CAT_RX] = mem_category_usage(MEM_CAT_RX) + quota;
+  pressure_high = 0;
+  while ((n < LWIP_ARRAYSIZE(held)) && ((held[n] = pbuf_alloc(PBUF_RAW, 128, PBUF_POOL)) != NULL)) {
+    n++;
+  }
+  peak = mem_category_usage(MEM_CAT_RX);
+  CHECK("quota: pool pbufs allocated under the rx quota", n > 0);
+  CHECK("quota: allocation refused at the rx quota", n < LWIP_ARRAYSIZE(held));
+  CHECK("quota: rx usage stays within the quota", peak <= mem_conf.quota[MEM_CAT_RX]);
+  CHECK("quota: refusal raises memory pressure", mem_pressure_pending);
+  mem_pressure_check();
+  CHECK("quota: pressure callback told MEM_PRESSURE_HIGH", pressure_high > 0);
+  while (n) {
+    pbuf_free(held[--n]);
+  }
+  mem_conf.quota[MEM_CAT_RX] = 0;
+  mem_pressure_check();
+  CHECK("quota: pressure back to none once freed", mem_pressure_level() == MEM_PRESSURE_NONE);
+}
+
+static void
+check_recycle(void)
+{
+#if MEMP_RECYCLING
+  struct udp_pcb *pcbs[5];
+  size_t base, each, used;
+  unsigned int i;
+
+  memp_recycle_flush();
+  memp_recycle_limit(MEMP_UDP_PCB, 2);
+  base = heap_used();
+  for (i = 0; i < LWIP_ARRAYSIZE(pcbs); i++) {
+    pcbs[i] = udp_new();
+  }
+  each = (heap_used() - base) / LWIP_ARRAYSIZE(pcbs);
+  for (i = 0; i < LWIP_ARRAYSIZE(pcbs); i++) {
+    udp_remove(pcbs[i]);
+  }
+  used = heap_used();
+  CHECK("recycle: pcbs allocated from the heap", each > 0);
+  CHECK("recycle: only the limit's worth of freed pcbs kept", used == base + 2 * each);
+  CHECK("recycle: flush reports freeing", memp_recycle_flush() == 1);
+  CHECK("recycle: flush gives them back", heap_used() == base);
+  CHECK("recycle: second flush has nothing to free", memp_recycle_flush() == 0);
+  memp_recycle_limit(MEMP_UDP_PCB, 0);
+  pcbs[0] = udp_new();
+  udp_remove(pcbs[0]);
+  CHECK("recycle: limit 0 keeps none", heap_used() == base);
+#else
+  printf("skip recycle: built with MEMP_RECYCLE=0\n");
+#endif
+}
+
+/*-----------------------------------------------------------------------------------*/
+/* Unplug with transfers in flight */
+
+/* broadcasts a burst of datagrams, still in flight when the call returns */
+static void
+send_burst(struct netif *netif)
+{
+  struct udp_pcb *pcb;
+  ip4_addr_t ip, mask, gw;
+  ip_addr_t bcast;
+
+  IP4_ADDR(&ip, 10, 0, 0, 2);
+  IP4_ADDR(&mask, 255, 255, 255, 0);
+  IP4_ADDR(&gw, 10, 0, 0, 1);
+  IP_ADDR4(&bcast, 10, 0, 0, 255);
+  netif_set_addr(netif, &ip, &mask, &gw);
+  pcb = udp_new();
+  for (int i = 0; i < 16; i++) {
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, 1400, PBUF_RAM);
+    if (p != NULL) {
+      udp_sendto(pcb, p, &bcast, 9);
+      pbuf_free(p);
+    }
+  }
+  udp_remove(pcb);
+}
+
+static void
+check_unplug(enum usbsim_class cls)
+{
+  const char *name = (cls == USBSIM_NCM) ? "ncm" : "ecm";
+  char what[80];
+  struct netif *netif;
+
+  /* transfers take 20 ms, so the ones scheduled below are still queued on unplug */
+  netif = attach(cls, 20000, true);
+  snprintf(what, sizeof(what), "unplug %s: adapter up", name);
+  CHECK(what, netif != NULL);
+  if (netif == NULL) {
+    return;
+  }
+  send_burst(netif);
+  snprintf(what, sizeof(what), "unplug %s: transfers in flight when unplugged", name);
+  CHECK(what, stats(netif).frames_out > 0);
+  snprintf(what, sizeof(what), "unplug %s: device released after its transfers were cancelled", name);
+  CHECK(what, detach());
+
+  netif = attach(cls, 0, false);
+  snprintf(what, sizeof(what), "unplug %s: adapter comes back up", name);
+  CHECK(what, netif != NULL);
+  if (netif != NULL) {
+    detach();
+  }
+}
+
+static void
+check_resume(enum usbsim_class cls)
+{
+  const char *name = (cls == USBSIM_NCM) ? "ncm" : "ecm";
+  char what[80];
+  struct netif *netif;
+  double deadline;
+
+  /* the reset reports the device enabled again before cancelling what was in flight */
+  netif = attach(cls, 20000, true);
+  snprintf(what, sizeof(what), "resume %s: adapter up", name);
+  CHECK(what, netif != NULL);
+  if (netif == NULL) {
+    return;
+  }
+  send_burst(netif);
+  snprintf(what, sizeof(what), "resume %s: transfers in flight when reset", name);
+  CHECK(what, stats(netif).frames_out > 0);
+  usb_ResetDevice(((eth_device_t *)netif->state)->device);
+  deadline = now_s() + 5.0;
+  do {
+    pump();
+    netif = netif_find("en0");
+  } while (((netif == NULL) || !netif_is_link_up(netif)) && (now_s() < deadline));
+  snprintf(what, sizeof(what), "resume %s: adapter back up after a reset left transfers outstanding", name);
+  CHECK(what, (netif != NULL) && netif_is_link_up(netif));
+  snprintf(what, sizeof(what), "resume %s: adapter removed", name);
+  CHECK(what, detach());
+}
+
+int
+main(void)
+{
+  struct mem_configurator memcfg = {MEM_CONFIGURATOR_V3, malloc, free, CHECK_HEAP, NULL, 0,
+                                    {0}, 0, 0, 0, check_pressure};
+  struct eth_configurator ethcfg = {ETH_CONFIGURATOR_V6, USB_CDC_MAX_RETRIES, false, false,
+                                    ETH_RX_BUFFERS_DEFAULT, ETH_TX_QUEUE_DEFAULT, false,
+                                    ETH_LINK_HOLDDOWN_DEFAULT, false, {1, 1, 1, 1, 1, 1, 1, 1}};
+
+  if (!mem_configure(&memcfg) || (lwip_init() != ERR_OK)) {
+    return 1;
+  }
+  eth_configure(&ethcfg);
+  if (usb_Init(eth_usb_event_callback, NULL, NULL, USB_DEFAULT_INIT_FLAGS)) {
+    return 1;
+  }
+  check_quota();
+  check_recycle();
+  check_ntb_parsing();
+  check_gro();
+  check_urgent();
+  check_urgent_order(USBSIM_ECM);
+  check_urgent_order(USBSIM_NCM);
+  check_rx_held(USBSIM_ECM);
+  check_rx_held(USBSIM_NCM);
+  check_unplug(USBSIM_ECM);
+  check_unplug(USBSIM_NCM);
+  check_resume(USBSIM_ECM);
+  check_resume(USBSIM_NCM);
+  usb_Cleanup();
+  printf("%u failed\n", failures);
+  return failures ? 1 : 0;
+}
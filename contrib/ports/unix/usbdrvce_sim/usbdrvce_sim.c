@@ -0,0 +1,1085 @@
+/**
+ * @file
+ * Host stand-in for usbdrvce with an emulated CDC-ECM / CDC-NCM adapter.
+ *
+ * Only what src/drivers/usb_ethernet.c needs is implemented: one device on
+ * one port, a single configuration, the class requests the driver sends,
+ * and FIFO bulk/interrupt pipes. Everything runs from usb_HandleEvents(),
+ * as on the calculator, so callbacks never nest inside driver code.
+ */
+
+#include "usbdrvce.h"
+#include "usbdrvce_sim.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/if.h>
+#include <linux/if_tun.h>
+#include <sys/ioctl.h>
+#endif
+
+#define SIM_FRAME_MAX       1518
+#define SIM_RXQ_LEN         64
+#define SIM_XFER_QUEUE      16
+#define SIM_NOTIFY_MAX      4
+#define SIM_MAX_PACKET      512
+#define SIM_INT_MAX_PACKET  16
+
+/* Endpoint addresses in the emulated descriptors */
+#define SIM_EP_CONTROL      0x00
+#define SIM_EP_INTERRUPT    0x81
+#define SIM_EP_BULK_IN      0x82
+#define SIM_EP_BULK_OUT     0x03
+
+/* CDC class requests and notifications the adapter understands */
+#define CDC_SET_ETHERNET_MULTICAST_FILTERS  0x40
+#define CDC_SET_ETHERNET_PACKET_FILTER      0x43
+#define CDC_GET_NTB_PARAMETERS              0x80
+#define CDC_GET_NET_ADDRESS                 0x81
+#define CDC_SET_NET_ADDRESS                 0x82
+#define CDC_SET_NTB_FORMAT                  0x84
+#define CDC_SET_NTB_INPUT_SIZE              0x86
+#define CDC_NOTIFY_NETWORK_CONNECTION       0x00
+
+#define NCM_NTH16_SIG       0x484D434EUL    /* "NCMH" */
+#define NCM_NDP16_SIG0      0x304D434EUL    /* "NCM0" */
+#define NCM_NTH32_SIG       0x686D636EUL    /* "ncmh" */
+#define NCM_NDP32_SIG0      0x306D636EUL    /* "ncm0" */
+#define NCM_NTH16_LEN       12
+#define NCM_NDP16_LEN(n)    (8 + 4 * ((n) + 1))
+#define NCM_NTH32_LEN       16
+#define NCM_NDP32_LEN(n)    (16 + 8 * ((n) + 1))
+#define NCM_ALIGN           4
+#define NCM_NTB_MAX_SIZE    16384
+#define NCM_NTB_OUT_SIZE    8192
+#define NCM_TX_MAX_DG       16
+
+struct sim_xfer {
+  uint8_t *buf;
+  size_t len;
+  usb_transfer_callback_t handler;
+  usb_transfer_data_t *data;
+  usb_control_setup_t setup;
+  uint64_t due;
+};
+
+struct usb_endpoint {
+  uint8_t address;
+  usb_transfer_type_t type;
+  usb_endpoint_flag_t flags;
+  struct sim_xfer queue[SIM_XFER_QUEUE];
+  uint8_t head;
+  uint8_t count;
+  uint8_t stale;        /* transfers from before a reset, cancelled once it completes */
+};
+
+struct usb_device {
+  bool present;         /* plugged in */
+  bool enabled;         /* reset done, requests accepted */
+  bool data_active;     /* data interface switched to its alternate setting */
+  unsigned int refs;
+  usb_device_data_t *data;
+  struct usb_endpoint control, interrupt, bulk_in, bulk_out;
+};
+
+struct sim_frame {
+  uint16_t len;
+  bool raw;             /* a whole NTB from usbsim_peer_send_ntb(), delivered as is */
+  uint8_t data[SIM_FRAME_MAX];
+};
+
+static struct {
+  usb_event_callback_t handler;
+  usb_callback_data_t *handler_data;
+  struct usbsim_config config;
+  struct usb_device device;
+  bool pending_connect, pending_enable, pending_disconnect;
+  bool link_up;
+  uint8_t config_desc[128];
+  size_t config_len;
+  /* NCM state set by the driver */
+  uint32_t ntb_in_max;
+  uint16_t ntb_in_max_datagrams;
+  uint16_t ntb_sequence;
+  bool ntb32;
+  /* peer -> driver */
+  struct sim_frame rxq[SIM_RXQ_LEN];
+  unsigned int rxq_head, rxq_count;
+  /* interrupt notifications not yet delivered */
+  usb_control_setup_t notify[SIM_NOTIFY_MAX];
+  unsigned int notify_count;
+  usbsim_peer_recv_fn peer_recv;
+  void *peer_arg;
+  int tap_fd;
+  struct usbsim_stats stats;
+} sim = { .tap_fd = -1 };
+
+static uint64_t
+sim_now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static void
+put16(uint8_t *p, uint16_t v)
+{
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+}
+
+static void
+put32(uint8_t *p, uint32_t v)
+{
+  put16(p, (uint16_t)v);
+  put16(p + 2, (uint16_t)(v >> 16));
+}
+
+static uint16_t
+get16(const uint8_t *p)
+{
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t
+get32(const uint8_t *p)
+{
+  return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static uint32_t
+sim_ntb_in_limit(void)
+{
+  return sim.config.ntb_in_max ? sim.config.ntb_in_max : NCM_NTB_MAX_SIZE;
+}
+
+/* NTB header field accessors for the selected format */
+static void
+put_field(uint8_t *p, uint32_t v)
+{
+  if (sim.ntb32) {
+    put32(p, v);
+  } else {
+    put16(p, (uint16_t)v);
+  }
+}
+
+static size_t
+align_up(size_t offset)
+{
+  return (offset + NCM_ALIGN - 1) & ~(size_t)(NCM_ALIGN - 1);
+}
+
+/*-----------------------------------------------------------------------------------*/
+/* Descriptors */
+
+static size_t
+sim_put_interface(uint8_t *p, uint8_t num, uint8_t alt, uint8_t endpoints,
+                  uint8_t cls, uint8_t subclass)
+{
+  const uint8_t desc[] = {9, USB_INTERFACE_DESCRIPTOR, num, alt, endpoints, cls, subclass, 0, 0};
+  memcpy(p, desc, sizeof(desc));
+  return sizeof(desc);
+}
+
+static size_t
+sim_put_endpoint(uint8_t *p, uint8_t address, uint8_t attributes, uint16_t max_packet, uint8_t interval)
+{
+  const uint8_t desc[] = {7, USB_ENDPOINT_DESCRIPTOR, address, attributes,
+                          (uint8_t)max_packet, (uint8_t)(max_packet >> 8), interval};
+  memcpy(p, desc, sizeof(desc));
+  return sizeof(desc);
+}
+
+static void
+sim_build_descriptors(void)
+{
+  uint8_t *p = sim.config_desc;
+  size_t n = 9;
+  const uint8_t header[] = {5, 0x24, 0x00, 0x10, 0x01};
+  const uint8_t cdc_union[] = {5, 0x24, 0x06, 0, 1};
+  const uint8_t ethernet[] = {13, 0x24, 0x0F, 1, 0, 0, 0, 0,
+                              (uint8_t)SIM_FRAME_MAX - 4, (SIM_FRAME_MAX - 4) >> 8,
+                              (uint8_t)sim.config.mc_filters, (uint8_t)(sim.config.mc_filters >> 8), 0};
+  /* packet filter and 8-byte SetNtbInputSize supported */
+  const uint8_t ncm[] = {6, 0x24, 0x1A, 0x00, 0x01, 0x21};
+
+  n += sim_put_interface(p + n, 0, 0, 1, USB_COMM_CLASS, (uint8_t)sim.config.cls);
+  memcpy(p + n, header, sizeof(header));
+  n += sizeof(header);
+  memcpy(p + n, cdc_union, sizeof(cdc_union));
+  n += sizeof(cdc_union);
+  memcpy(p + n, ethernet, sizeof(ethernet));
+  n += sizeof(ethernet);
+  if (sim.config.cls == USBSIM_NCM) {
+    memcpy(p + n, ncm, sizeof(ncm));
+    n += sizeof(ncm);
+  }
+  n += sim_put_endpoint(p + n, SIM_EP_INTERRUPT, USB_INTERRUPT_TRANSFER, 16, 8);
+  /* data interface: no endpoints until the alternate setting is selected */
+  n += sim_put_interface(p + n, 1, 0, 0, USB_CDC_DATA_CLASS, 0);
+  n += sim_put_interface(p + n, 1, 1, 2, USB_CDC_DATA_CLASS, 0);
+  n += sim_put_endpoint(p + n, SIM_EP_BULK_IN, USB_BULK_TRANSFER, SIM_MAX_PACKET, 0);
+  n += sim_put_endpoint(p + n, SIM_EP_BULK_OUT, USB_BULK_TRANSFER, SIM_MAX_PACKET, 0);
+
+  p[0] = 9;
+  p[1] = USB_CONFIGURATION_DESCRIPTOR;
+  put16(p + 2, (uint16_t)n);
+  p[4] = 2;     /* bNumInterfaces */
+  p[5] = 1;     /* bConfigurationValue */
+  p[6] = 0;
+  p[7] = 0x80;
+  p[8] = 50;
+  sim.config_len = n;
+}
+
+/*-----------------------------------------------------------------------------------*/
+/* Tap peer */
+
+static void
+sim_tap_open(const char *name)
+{
+#ifdef __linux__
+  struct ifreq ifr;
+  int fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    fprintf(stderr, "usbdrvce_sim: cannot open /dev/net/tun: %s\n", strerror(errno));
+    return;
+  }
+  memset(&ifr, 0, sizeof(ifr));
+  ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+  strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+  if (ioctl(fd, TUNSETIFF, (void *)&ifr) < 0) {
+    fprintf(stderr, "usbdrvce_sim: TUNSETIFF %s: %s\n", name, strerror(errno));
+    close(fd);
+    return;
+  }
+  sim.tap_fd = fd;
+#else
+  (void)name;
+  fprintf(stderr, "usbdrvce_sim: tap peers are only supported on Linux\n");
+#endif
+}
+
+static void
+sim_tap_poll(void)
+{
+  uint8_t frame[SIM_FRAME_MAX];
+  ssize_t len;
+  if (sim.tap_fd < 0) {
+    return;
+  }
+  while ((sim.rxq_count < SIM_RXQ_LEN) &&
+         ((len = read(sim.tap_fd, frame, sizeof(frame))) > 0)) {
+    usbsim_peer_send(frame, (size_t)len);
+  }
+}
+
+static void
+sim_peer_deliver(const uint8_t *frame, size_t len)
+{
+  sim.stats.frames_out++;
+  sim.stats.bytes_out += len;
+  if (sim.peer_recv != NULL) {
+    sim.peer_recv(frame, len, sim.peer_arg);
+  }
+  if ((sim.tap_fd >= 0) && (write(sim.tap_fd, frame, len) < 0)) {
+    sim.stats.peer_drops++;
+  }
+}
+
+/*-----------------------------------------------------------------------------------*/
+/* Class requests */
+
+static void
+sim_notify_link(void)
+{
+  usb_control_setup_t *n;
+  if (sim.notify_count == SIM_NOTIFY_MAX) {
+    return;
+  }
+  n = &sim.notify[sim.notify_count++];
+  n->bmRequestType = 0xA1;
+  n->bRequest = CDC_NOTIFY_NETWORK_CONNECTION;
+  n->wValue = sim.link_up;
+  n->wIndex = 0;
+  n->wLength = 0;
+}
+
+/* returns a transfer status, sets *transferred */
+static usb_transfer_status_t
+sim_control(const usb_control_setup_t *setup, uint8_t *buf, size_t *transferred)
+{
+  bool ncm = (sim.config.cls == USBSIM_NCM);
+  *transferred = 0;
+  sim.stats.control++;
+  switch (setup->bRequest) {
+    case CDC_GET_NTB_PARAMETERS:
+      if (!ncm || (setup->wLength < 28)) {
+        return USB_TRANSFER_STALLED;
+      }
+      memset(buf, 0, 28);
+      put16(buf + 0, 28);                   /* wLength */
+      put16(buf + 2, sim.config.ntb32 ? 0x0003 : 0x0001);   /* bmNtbFormatsSupported */
+      put32(buf + 4, sim_ntb_in_limit());   /* dwNtbInMaxSize */
+      put16(buf + 8, NCM_ALIGN);            /* wNdpInDivisor */
+      put16(buf + 12, NCM_ALIGN);           /* wNdpInAlignment */
+      put32(buf + 16, NCM_NTB_OUT_SIZE);    /* dwNtbOutMaxSize */
+      put16(buf + 20, NCM_ALIGN);           /* wNdpOutDivisor */
+      put16(buf + 24, NCM_ALIGN);           /* wNdpOutAlignment */
+      put16(buf + 26, NCM_TX_MAX_DG);       /* wNtbOutMaxDatagrams */
+      *transferred = 28;
+      return USB_TRANSFER_COMPLETED;
+    case CDC_SET_NTB_INPUT_SIZE:
+      if (!ncm || (setup->wLength < 4)) {
+        return USB_TRANSFER_STALLED;
+      }
+      sim.ntb_in_max = get32(buf);
+      if ((sim.ntb_in_max < 2048) || (sim.ntb_in_max > sim_ntb_in_limit())) {
+        sim.ntb_in_max = sim_ntb_in_limit();
+        return USB_TRANSFER_STALLED;
+      }
+      sim.ntb_in_max_datagrams = (setup->wLength >= 8) ? get16(buf + 4) : 0;
+      sim.stats.ntb_in_size = sim.ntb_in_max;
+      sim.stats.ntb_in_datagrams = sim.ntb_in_max_datagrams;
+      *transferred = setup->wLength;
+      return USB_TRANSFER_COMPLETED;
+    case CDC_SET_NTB_FORMAT:
+      /* only valid while the data interface is in alternate setting 0 */
+      if (!ncm || sim.device.data_active || (setup->wValue > (sim.config.ntb32 ? 1 : 0))) {
+        return USB_TRANSFER_STALLED;
+      }
+      sim.ntb32 = sim.stats.ntb32 = (setup->wValue == 1);
+      return USB_TRANSFER_COMPLETED;
+    case CDC_GET_NET_ADDRESS:
+      if (!ncm || (setup->wLength < 6)) {
+        return USB_TRANSFER_STALLED;
+      }
+      memcpy(buf, sim.config.hwaddr, 6);
+      *transferred = 6;
+      return USB_TRANSFER_COMPLETED;
+    case CDC_SET_NET_ADDRESS:
+      if (!ncm || (setup->wLength < 6)) {
+        return USB_TRANSFER_STALLED;
+      }
+      memcpy(sim.config.hwaddr, buf, 6);
+      *transferred = 6;
+      return USB_TRANSFER_COMPLETED;
+    case CDC_SET_ETHERNET_PACKET_FILTER:
+      sim.stats.packet_filter = setup->wValue;
+      return USB_TRANSFER_COMPLETED;
+    case CDC_SET_ETHERNET_MULTICAST_FILTERS:
+      if ((setup->wValue > sim.config.mc_filters) || (setup->wLength != setup->wValue * 6)) {
+        return USB_TRANSFER_STALLED;
+      }
+      sim.stats.mc_count = setup->wValue;
+      *transferred = setup->wLength;
+      return USB_TRANSFER_COMPLETED;
+    default:
+      return USB_TRANSFER_STALLED;
+  }
+}
+
+/*-----------------------------------------------------------------------------------*/
+/* Bulk pipes */
+
+/* driver -> peer */
+static void
+sim_bulk_out(const uint8_t *buf, size_t len)
+{
+  size_t ndp;
+  bool ntb32;
+  sim.stats.bulk_out++;
+  if (sim.config.cls == USBSIM_ECM) {
+    sim_peer_deliver(buf, len);
+    return;
+  }
+  if ((len >= NCM_NTH16_LEN) && (get32(buf) == NCM_NTH16_SIG) && (get16(buf + 8) <= len)) {
+    ntb32 = false;
+    len = get16(buf + 8);
+    ndp = get16(buf + 10);
+  } else if ((len >= NCM_NTH32_LEN) && (get32(buf) == NCM_NTH32_SIG) && (get32(buf + 8) <= len)) {
+    ntb32 = true;
+    len = get32(buf + 8);
+    ndp = get32(buf + 12);
+  } else {
+    fprintf(stderr, "usbdrvce_sim: bad NTB header\n");
+    return;
+  }
+  if (ntb32 != sim.ntb32) {
+    fprintf(stderr, "usbdrvce_sim: NTB-%d received, NTB-%d selected\n", ntb32 ? 32 : 16, sim.ntb32 ? 32 : 16);
+    return;
+  }
+  while (ndp && (ndp + (ntb32 ? NCM_NDP32_LEN(0) : NCM_NDP16_LEN(0)) <= len)) {
+    size_t entry = ntb32 ? 8 : 4;
+    const uint8_t *idx = buf + ndp + (ntb32 ? 16 : 8);
+    if (get32(buf + ndp) != (ntb32 ? NCM_NDP32_SIG0 : NCM_NDP16_SIG0)) {
+      fprintf(stderr, "usbdrvce_sim: bad NDP signature\n");
+      return;
+    }
+    for (; idx + entry <= buf + len; idx += entry) {
+      size_t dg_index = ntb32 ? get32(idx) : get16(idx);
+      size_t dg_len = ntb32 ? get32(idx + 4) : get16(idx + 2);
+      if (!dg_index || !dg_len) {
+        break;
+      }
+      if (dg_index + dg_len > len) {
+        fprintf(stderr, "usbdrvce_sim: datagram out of bounds\n");
+        return;
+      }
+      sim_peer_deliver(buf + dg_index, dg_len);
+    }
+    ndp = ntb32 ? get32(buf + ndp + 8) : get16(buf + ndp + 6);
+  }
+}
+
+static void
+sim_rxq_pop(uint8_t *dst)
+{
+  struct sim_frame *f = &sim.rxq[sim.rxq_head];
+  memcpy(dst, f->data, f->len);
+  sim.stats.frames_in++;
+  sim.stats.bytes_in += f->len;
+  sim.rxq_head = (sim.rxq_head + 1) % SIM_RXQ_LEN;
+  sim.rxq_count--;
+}
+
+static void
+sim_rxq_drop(void)
+{
+  sim.stats.peer_drops++;
+  sim.rxq_head = (sim.rxq_head + 1) % SIM_RXQ_LEN;
+  sim.rxq_count--;
+}
+
+/* peer -> driver, returns bytes placed in buf */
+static size_t
+sim_bulk_in(uint8_t *buf, size_t len)
+{
+  size_t size, offset, nth_len, ndp_len;
+  unsigned int n = 0, i;
+  sim.stats.bulk_in++;
+  if ((sim.config.cls == USBSIM_ECM) || sim.rxq[sim.rxq_head].raw) {
+    size = sim.rxq[sim.rxq_head].len;
+    if (size > len) {
+      sim_rxq_drop();
+      return 0;
+    }
+    sim_rxq_pop(buf);
+    return size;
+  }
+  /* pack as many frames as fit: NTH, NDP, then the datagrams */
+  if (len > sim.ntb_in_max) {
+    len = sim.ntb_in_max;
+  }
+  nth_len = sim.ntb32 ? NCM_NTH32_LEN : NCM_NTH16_LEN;
+  size = align_up(nth_len + (sim.ntb32 ? NCM_NDP32_LEN(0) : NCM_NDP16_LEN(0)));
+  while ((n < sim.rxq_count) && !sim.rxq[(sim.rxq_head + n) % SIM_RXQ_LEN].raw &&
+         (!sim.ntb_in_max_datagrams || (n < sim.ntb_in_max_datagrams))) {
+    size_t need = align_up(nth_len + (sim.ntb32 ? NCM_NDP32_LEN(n + 1) : NCM_NDP16_LEN(n + 1)));
+    for (i = 0; i <= n; i++) {
+      need = align_up(need) + sim.rxq[(sim.rxq_head + i) % SIM_RXQ_LEN].len;
+    }
+    if (need > len) {
+      break;
+    }
+    size = need;
+    n++;
+  }
+  if (n == 0) {
+    /* does not fit the NTB the driver asked for */
+    sim_rxq_drop();
+    return 0;
+  }
+  ndp_len = sim.ntb32 ? NCM_NDP32_LEN(n) : NCM_NDP16_LEN(n);
+  offset = align_up(nth_len + ndp_len);
+  memset(buf, 0, nth_len + ndp_len);
+  put32(buf, sim.ntb32 ? NCM_NTH32_SIG : NCM_NTH16_SIG);
+  put16(buf + 4, (uint16_t)nth_len);
+  put16(buf + 6, sim.ntb_sequence++);
+  put_field(buf + 8, (uint32_t)size);
+  put_field(buf + (sim.ntb32 ? 12 : 10), (uint32_t)nth_len);
+  put32(buf + nth_len, sim.ntb32 ? NCM_NDP32_SIG0 : NCM_NDP16_SIG0);
+  put16(buf + nth_len + 4, (uint16_t)ndp_len);
+  /* next NDP index stays 0, the terminating null entry is already zeroed */
+  for (i = 0; i < n; i++) {
+    uint8_t *idx = buf + nth_len + (sim.ntb32 ? 16 + 8 * i : 8 + 4 * i);
+    uint16_t dg_len = sim.rxq[sim.rxq_head].len;
+    offset = align_up(offset);
+    put_field(idx, (uint32_t)offset);
+    put_field(idx + (sim.ntb32 ? 4 : 2), dg_len);
+    sim_rxq_pop(buf + offset);
+    offset += dg_len;
+  }
+  return size;
+}
+
+/*-----------------------------------------------------------------------------------*/
+/* Transfer queues */
+
+static usb_error_t
+sim_enqueue(struct usb_endpoint *ep, void *buffer, size_t length,
+            usb_transfer_callback_t handler, usb_transfer_data_t *data,
+            const usb_control_setup_t *setup)
+{
+  struct sim_xfer *x;
+  if (!sim.device.present || !sim.device.enabled) {
+    return USB_ERROR_NO_DEVICE;
+  }
+  if (ep->count == SIM_XFER_QUEUE) {
+    return USB_ERROR_SCHEDULE_FULL;
+  }
+  x = &ep->queue[(ep->head + ep->count++) % SIM_XFER_QUEUE];
+  x->buf = (uint8_t *)buffer;
+  x->len = length;
+  x->handler = handler;
+  x->data = data;
+  x->due = sim_now_us() + sim.config.latency_us;
+  if (setup != NULL) {
+    x->setup = *setup;
+  }
+  return USB_SUCCESS;
+}
+
+static void
+sim_complete(struct usb_endpoint *ep, usb_transfer_status_t status, size_t transferred)
+{
+  struct sim_xfer x = ep->queue[ep->head];
+  ep->head = (ep->head + 1) % SIM_XFER_QUEUE;
+  ep->count--;
+  if (x.handler != NULL) {
+    x.handler(ep, status, transferred, x.data);
+  }
+}
+
+/* completes the transfers that are due and have data, in order */
+static void
+sim_service(struct usb_endpoint *ep, uint64_t now)
+{
+  /* transfers scheduled from callbacks wait for the next pass */
+  unsigned int budget = ep->count;
+  while (budget-- && ep->count && (ep->queue[ep->head].due <= now)) {
+    struct sim_xfer *x = &ep->queue[ep->head];
+    usb_transfer_status_t status = USB_TRANSFER_COMPLETED;
+    size_t transferred = x->len;
+    switch (ep->address) {
+      case SIM_EP_CONTROL:
+        status = sim_control(&x->setup, x->buf, &transferred);
+        break;
+      case SIM_EP_BULK_OUT:
+        sim_bulk_out(x->buf, x->len);
+        break;
+      case SIM_EP_BULK_IN:
+        if (!sim.rxq_count) {
+          return;
+        }
+        transferred = sim_bulk_in(x->buf, x->len);
+        break;
+      case SIM_EP_INTERRUPT:
+        if (!sim.notify_count || (x->len < sizeof(usb_control_setup_t))) {
+          return;
+        }
+        memcpy(x->buf, &sim.notify[0], sizeof(usb_control_setup_t));
+        memmove(&sim.notify[0], &sim.notify[1], --sim.notify_count * sizeof(usb_control_setup_t));
+        transferred = sizeof(usb_control_setup_t);
+        break;
+      default:
+        break;
+    }
+    sim_complete(ep, status, transferred);
+  }
+}
+
+static void
+sim_cancel_all(usb_transfer_status_t status)
+{
+  struct usb_endpoint *eps[] = {&sim.device.control, &sim.device.interrupt,
+                                &sim.device.bulk_in, &sim.device.bulk_out};
+  unsigned int i;
+  for (i = 0; i < sizeof(eps) / sizeof(eps[0]); i++) {
+    while (eps[i]->count) {
+      sim_complete(eps[i], status, 0);
+    }
+    eps[i]->stale = 0;
+  }
+}
+
+/* cancels the transfers config.cancel_after_reset held back, the oldest on each endpoint */
+static void
+sim_cancel_stale(void)
+{
+  struct usb_endpoint *eps[] = {&sim.device.control, &sim.device.interrupt,
+                                &sim.device.bulk_in, &sim.device.bulk_out};
+  unsigned int i;
+  for (i = 0; i < sizeof(eps) / sizeof(eps[0]); i++) {
+    while (eps[i]->stale && eps[i]->count) {
+      eps[i]->stale--;
+      sim_complete(eps[i], USB_TRANSFER_CANCELLED, 0);
+    }
+    eps[i]->stale = 0;
+  }
+}
+
+static void
+sim_init_endpoint(struct usb_endpoint *ep, uint8_t address, usb_transfer_type_t type)
+{
+  memset(ep, 0, sizeof(*ep));
+  ep->address = address;
+  ep->type = type;
+}
+
+/*-----------------------------------------------------------------------------------*/
+/* Simulator control */
+
+bool
+usbsim_attach(const struct usbsim_config *config)
+{
+  if (sim.device.present) {
+    return false;
+  }
+  sim.config = *config;
+  sim_build_descriptors();
+  memset(&sim.device, 0, sizeof(sim.device));
+  sim_init_endpoint(&sim.device.control, SIM_EP_CONTROL, USB_CONTROL_TRANSFER);
+  sim_init_endpoint(&sim.device.interrupt, SIM_EP_INTERRUPT, USB_INTERRUPT_TRANSFER);
+  sim_init_endpoint(&sim.device.bulk_in, SIM_EP_BULK_IN, USB_BULK_TRANSFER);
+  sim_init_endpoint(&sim.device.bulk_out, SIM_EP_BULK_OUT, USB_BULK_TRANSFER);
+  sim.device.present = true;
+  sim.pending_connect = true;
+  sim.link_up = true;
+  sim.ntb_in_max = sim_ntb_in_limit();
+  sim.ntb_in_max_datagrams = 0;
+  sim.ntb32 = false;
+  sim.rxq_head = sim.rxq_count = 0;
+  sim.notify_count = 0;
+  if ((config->tap != NULL) && (sim.tap_fd < 0)) {
+    sim_tap_open(config->tap);
+  }
+  return true;
+}
+
+void
+usbsim_detach(void)
+{
+  if (!sim.device.present) {
+    return;
+  }
+  sim.device.present = false;
+  sim.device.enabled = false;
+  sim.device.data_active = false;
+  if (!sim.config.cancel_after_disconnect) {
+    sim_cancel_all(USB_TRANSFER_CANCELLED | USB_TRANSFER_NO_DEVICE);
+  }
+  sim.pending_connect = sim.pending_enable = false;
+  sim.pending_disconnect = true;
+}
+
+void
+usbsim_set_link(bool up)
+{
+  sim.link_up = up;
+  if (sim.device.data_active) {
+    sim_notify_link();
+  }
+}
+
+static bool
+sim_rxq_push(const uint8_t *data, size_t len, bool raw)
+{
+  struct sim_frame *f;
+  if ((len > SIM_FRAME_MAX) || (sim.rxq_count == SIM_RXQ_LEN)) {
+    sim.stats.peer_drops++;
+    return false;
+  }
+  f = &sim.rxq[(sim.rxq_head + sim.rxq_count++) % SIM_RXQ_LEN];
+  memcpy(f->data, data, len);
+  f->len = (uint16_t)len;
+  f->raw = raw;
+  return true;
+}
+
+bool
+usbsim_peer_send(const uint8_t *frame, size_t len)
+{
+  return sim_rxq_push(frame, len, false);
+}
+
+bool
+usbsim_peer_send_ntb(const uint8_t *ntb, size_t len)
+{
+  return sim_rxq_push(ntb, len, true);
+}
+
+size_t
+usbsim_peer_pending(void)
+{
+  return sim.rxq_count;
+}
+
+void
+usbsim_set_peer_recv(usbsim_peer_recv_fn fn, void *arg)
+{
+  sim.peer_recv = fn;
+  sim.peer_arg = arg;
+}
+
+void
+usbsim_get_stats(struct usbsim_stats *stats)
+{
+  *stats = sim.stats;
+}
+
+void
+usbsim_reset_stats(void)
+{
+  /* keep the settings, clear the counters */
+  struct usbsim_stats st = sim.stats;
+  memset(&sim.stats, 0, sizeof(sim.stats));
+  sim.stats.packet_filter = st.packet_filter;
+  sim.stats.mc_count = st.mc_count;
+  sim.stats.ntb_in_size = st.ntb_in_size;
+  sim.stats.ntb_in_datagrams = st.ntb_in_datagrams;
+  sim.stats.ntb32 = st.ntb32;
+}
+
+/*-----------------------------------------------------------------------------------*/
+/* usbdrvce API */
+
+usb_error_t
+usb_Init(usb_event_callback_t handler, usb_callback_data_t *data,
+         const void *device_descriptors, unsigned int flags)
+{
+  (void)device_descriptors;
+  (void)flags;
+  sim.handler = handler;
+  sim.handler_data = data;
+  return USB_SUCCESS;
+}
+
+void
+usb_Cleanup(void)
+{
+  usbsim_detach();
+  sim_cancel_all(USB_TRANSFER_CANCELLED | USB_TRANSFER_NO_DEVICE);
+  sim.handler = NULL;
+  if (sim.tap_fd >= 0) {
+    close(sim.tap_fd);
+    sim.tap_fd = -1;
+  }
+}
+
+usb_error_t
+usb_HandleEvents(void)
+{
+  struct usb_device *dev = &sim.device;
+  uint64_t now;
+  if (sim.pending_disconnect) {
+    sim.pending_disconnect = false;
+    if (sim.handler != NULL) {
+      sim.handler(USB_DEVICE_DISCONNECTED_EVENT, dev, sim.handler_data);
+    }
+    /* no-op unless config.cancel_after_disconnect held them back */
+    sim_cancel_all(USB_TRANSFER_CANCELLED | USB_TRANSFER_NO_DEVICE);
+  }
+  if (sim.pending_connect) {
+    sim.pending_connect = false;
+    if (sim.handler != NULL) {
+      sim.handler(USB_DEVICE_CONNECTED_EVENT, dev, sim.handler_data);
+    }
+  }
+  if (sim.pending_enable) {
+    sim.pending_enable = false;
+    dev->enabled = true;
+    if (sim.handler != NULL) {
+      sim.handler(USB_DEVICE_ENABLED_EVENT, dev, sim.handler_data);
+    }
+    /* no-op unless config.cancel_after_reset held them back */
+    sim_cancel_stale();
+  }
+  if (!dev->present || !dev->enabled) {
+    return USB_SUCCESS;
+  }
+  sim_tap_poll();
+  now = sim_now_us();
+  sim_service(&dev->control, now);
+  sim_service(&dev->bulk_out, now);
+  sim_service(&dev->bulk_in, now);
+  sim_service(&dev->interrupt, now);
+  return USB_SUCCESS;
+}
+
+usb_role_t
+usb_GetRole(void)
+{
+  return USB_ROLE_HOST;
+}
+
+usb_device_t
+usb_RefDevice(usb_device_t device)
+{
+  if (device != NULL) {
+    device->refs++;
+  }
+  return device;
+}
+
+usb_device_t
+usb_UnrefDevice(usb_device_t device)
+{
+  if ((device != NULL) && device->refs) {
+    device->refs--;
+  }
+  return NULL;
+}
+
+usb_error_t
+usb_ResetDevice(usb_device_t device)
+{
+  if ((device == NULL) || !device->present) {
+    return USB_ERROR_NO_DEVICE;
+  }
+  /* a reset drops the configuration and everything in flight */
+  device->enabled = false;
+  device->data_active = false;
+  if (sim.config.cancel_after_reset) {
+    device->control.stale = device->control.count;
+    device->interrupt.stale = device->interrupt.count;
+    device->bulk_in.stale = device->bulk_in.count;
+    device->bulk_out.stale = device->bulk_out.count;
+  } else {
+    sim_cancel_all(USB_TRANSFER_CANCELLED);
+  }
+  /* NCM functions return to NTB-16 and their default input size */
+  sim.ntb32 = false;
+  sim.ntb_in_max = sim_ntb_in_limit();
+  sim.ntb_in_max_datagrams = 0;
+  sim.pending_enable = true;
+  return USB_SUCCESS;
+}
+
+usb_error_t
+usb_DisableDevice(usb_device_t device)
+{
+  if ((device == NULL) || !device->present) {
+    return USB_ERROR_NO_DEVICE;
+  }
+  device->enabled = false;
+  sim_cancel_all(USB_TRANSFER_CANCELLED);
+  if (sim.handler != NULL) {
+    sim.handler(USB_DEVICE_DISABLED_EVENT, device, sim.handler_data);
+  }
+  return USB_SUCCESS;
+}
+
+usb_device_flags_t
+usb_GetDeviceFlags(usb_device_t device)
+{
+  if ((device == NULL) || !device->present) {
+    return USB_IS_DISABLED;
+  }
+  return device->enabled ? USB_IS_ENABLED : USB_IS_DISABLED;
+}
+
+void
+usb_SetDeviceData(usb_device_t device, usb_device_data_t *data)
+{
+  if (device != NULL) {
+    device->data = data;
+  }
+}
+
+usb_device_data_t *
+usb_GetDeviceData(usb_device_t device)
+{
+  return (device != NULL) ? device->data : NULL;
+}
+
+usb_error_t
+usb_GetDeviceDescriptor(usb_device_t device, usb_device_descriptor_t *descriptor,
+                        size_t length, size_t *transferred)
+{
+  const uint8_t desc[18] = {18, USB_DEVICE_DESCRIPTOR, 0x00, 0x02, 0, 0, 0, 64,
+                            0x6b, 0x1d, 0x04, 0x01, 0x00, 0x01, 0, 0, 0, 1};
+  if ((device == NULL) || !device->present) {
+    return USB_ERROR_NO_DEVICE;
+  }
+  *transferred = (length < sizeof(desc)) ? length : sizeof(desc);
+  memcpy(descriptor, desc, *transferred);
+  return USB_SUCCESS;
+}
+
+size_t
+usb_GetConfigurationDescriptorTotalLength(usb_device_t device, uint8_t index)
+{
+  if ((device == NULL) || !device->present || index) {
+    return 0;
+  }
+  return sim.config_len;
+}
+
+usb_error_t
+usb_GetConfigurationDescriptor(usb_device_t device, uint8_t index,
+                               usb_configuration_descriptor_t *descriptor,
+                               size_t length, size_t *transferred)
+{
+  if ((device == NULL) || !device->present) {
+    return USB_ERROR_NO_DEVICE;
+  }
+  if (index) {
+    return USB_ERROR_INVALID_PARAM;
+  }
+  *transferred = (length < sim.config_len) ? length : sim.config_len;
+  memcpy(descriptor, sim.config_desc, *transferred);
+  return USB_SUCCESS;
+}
+
+usb_error_t
+usb_SetConfiguration(usb_device_t device, const usb_configuration_descriptor_t *descriptor,
+                     size_t length)
+{
+  (void)descriptor;
+  (void)length;
+  if ((device == NULL) || !device->present || !device->enabled) {
+    return USB_ERROR_NO_DEVICE;
+  }
+  device->data_active = false;
+  return USB_SUCCESS;
+}
+
+usb_error_t
+usb_SetInterface(usb_device_t device, const usb_interface_descriptor_t *descriptor,
+                 size_t length)
+{
+  (void)length;
+  if ((device == NULL) || !device->present || !device->enabled) {
+    return USB_ERROR_NO_DEVICE;
+  }
+  device->data_active = (descriptor->bInterfaceNumber == 1) && (descriptor->bAlternateSetting == 1);
+  /* like real adapters, report the link as soon as the data interface is up */
+  if (device->data_active) {
+    sim_notify_link();
+  }
+  return USB_SUCCESS;
+}
+
+usb_error_t
+usb_GetStringDescriptor(usb_device_t device, uint8_t index, uint16_t langid,
+                        usb_string_descriptor_t *descriptor, size_t length,
+                        size_t *transferred)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  uint8_t desc[2 + 2 * 12];
+  unsigned int i;
+  (void)langid;
+  if ((device == NULL) || !device->present) {
+    return USB_ERROR_NO_DEVICE;
+  }
+  if (index != 1) {
+    return USB_ERROR_FAILED;
+  }
+  desc[0] = sizeof(desc);
+  desc[1] = USB_STRING_DESCRIPTOR;
+  for (i = 0; i < 12; i++) {
+    uint8_t nibble = (uint8_t)((sim.config.hwaddr[i / 2] >> ((i & 1) ? 0 : 4)) & 0x0F);
+    put16(desc + 2 + 2 * i, (uint8_t)hex[nibble]);
+  }
+  *transferred = (length < sizeof(desc)) ? length : sizeof(desc);
+  memcpy(descriptor, desc, *transferred);
+  return USB_SUCCESS;
+}
+
+usb_endpoint_t
+usb_GetDeviceEndpoint(usb_device_t device, uint8_t address)
+{
+  if ((device == NULL) || !device->present) {
+    return NULL;
+  }
+  switch (address) {
+    case SIM_EP_CONTROL:
+      return &device->control;
+    case SIM_EP_INTERRUPT:
+      return &device->interrupt;
+    case SIM_EP_BULK_IN:
+      return &device->bulk_in;
+    case SIM_EP_BULK_OUT:
+      return &device->bulk_out;
+    default:
+      return NULL;
+  }
+}
+
+size_t
+usb_GetEndpointMaxPacketSize(usb_endpoint_t endpoint)
+{
+  if (endpoint == NULL) {
+    return 0;
+  }
+  return (endpoint->type == USB_BULK_TRANSFER) ? SIM_MAX_PACKET : SIM_INT_MAX_PACKET;
+}
+
+void
+usb_SetEndpointFlags(usb_endpoint_t endpoint, usb_endpoint_flag_t flags)
+{
+  if (endpoint != NULL) {
+    endpoint->flags = flags;
+  }
+}
+
+usb_error_t
+usb_DefaultControlTransfer(usb_device_t device, const usb_control_setup_t *setup,
+                           void *buffer, unsigned int retries, size_t *transferred)
+{
+  size_t xferd;
+  (void)retries;
+  if ((device == NULL) || !device->present || !device->enabled) {
+    return USB_ERROR_NO_DEVICE;
+  }
+  if (sim_control(setup, (uint8_t *)buffer, &xferd) != USB_TRANSFER_COMPLETED) {
+    return USB_ERROR_FAILED;
+  }
+  if (transferred != NULL) {
+    *transferred = xferd;
+  }
+  return USB_SUCCESS;
+}
+
+usb_error_t
+usb_ScheduleDefaultControlTransfer(usb_device_t device, const usb_control_setup_t *setup,
+                                   void *buffer, usb_transfer_callback_t handler,
+                                   usb_transfer_data_t *data)
+{
+  if (device == NULL) {
+    return USB_ERROR_INVALID_PARAM;
+  }
+  return sim_enqueue(&device->control, buffer, setup->wLength, handler, data, setup);
+}
+
+usb_error_t
+usb_ScheduleBulkTransfer(usb_endpoint_t endpoint, void *buffer, size_t length,
+                         usb_transfer_callback_t handler, usb_transfer_data_t *data)
+{
+  if ((endpoint == NULL) || (endpoint->type != USB_BULK_TRANSFER)) {
+    return USB_ERROR_INVALID_PARAM;
+  }
+  if (!sim.device.data_active) {
+    return USB_ERROR_NO_DEVICE;
+  }
+  return sim_enqueue(endpoint, buffer, length, handler, data, NULL);
+}
+
+usb_error_t
+usb_ScheduleInterruptTransfer(usb_endpoint_t endpoint, void *buffer, size_t length,
+                              usb_transfer_callback_t handler, usb_transfer_data_t *data)
+{
+  if ((endpoint == NULL) || (endpoint->type != USB_INTERRUPT_TRANSFER)) {
+    return USB_ERROR_INVALID_PARAM;
+  }
+  return sim_enqueue(endpoint, buffer, length, handler, data, NULL);
+}
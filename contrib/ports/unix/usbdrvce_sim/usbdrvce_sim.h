@@ -0,0 +1,84 @@
+/**
+ * @file
+ * Emulated CDC-ECM / CDC-NCM adapter behind the host usbdrvce stand-in.
+ *
+ * The adapter shows up as a single USB device. Its "wire" side is a peer:
+ * frames sent by the driver are handed to a callback and/or written to a tap
+ * device, frames queued with usbsim_peer_send() or read from the tap device
+ * are delivered on the bulk IN endpoint (one per transfer for ECM, packed
+ * into NTB-16s for NCM). Every transfer completes no earlier than the
+ * configured latency after it was scheduled, and only from usb_HandleEvents().
+ */
+
+#ifndef USBDRVCE_SIM_H
+#define USBDRVCE_SIM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Adapter class, the CDC subclass codes */
+enum usbsim_class {
+    USBSIM_ECM = 0x06,
+    USBSIM_NCM = 0x0D
+};
+
+struct usbsim_config {
+    enum usbsim_class cls;
+    uint8_t hwaddr[6];          /**< adapter MAC, reported through iMacAddress */
+    uint32_t latency_us;        /**< time from scheduling a transfer to its completion */
+    uint16_t mc_filters;        /**< wNumberMCFilters */
+    uint32_t ntb_in_max;        /**< dwNtbInMaxSize, 0 for 16384 */
+    bool ntb32;                 /**< offer NTB-32 as well as NTB-16 */
+    const char *tap;            /**< tap interface to bridge, NULL for none */
+    bool cancel_after_disconnect; /**< unplugging reports the disconnect before cancelling transfers */
+    bool cancel_after_reset;    /**< a reset reports the device enabled before cancelling transfers */
+};
+
+struct usbsim_stats {
+    uint32_t bulk_in;           /**< completed bulk IN transfers (NTBs for NCM) */
+    uint32_t bulk_out;          /**< completed bulk OUT transfers (NTBs for NCM) */
+    uint32_t frames_in;         /**< frames delivered to the driver */
+    uint32_t frames_out;        /**< frames received from the driver */
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint32_t peer_drops;        /**< frames refused because the rx queue was full */
+    uint32_t control;           /**< control requests handled */
+    uint16_t packet_filter;     /**< last SetEthernetPacketFilter value */
+    uint16_t mc_count;          /**< entries in the last SetEthernetMulticastFilters list */
+    uint32_t ntb_in_size;       /**< last SetNtbInputSize value */
+    uint16_t ntb_in_datagrams;  /**< last SetNtbInputSize datagram limit, 0 for none */
+    bool ntb32;                 /**< NTB-32 selected with SetNtbFormat */
+};
+
+typedef void (*usbsim_peer_recv_fn)(const uint8_t *frame, size_t len, void *arg);
+
+/** Plugs the adapter in, the connect event fires on the next usb_HandleEvents() */
+bool usbsim_attach(const struct usbsim_config *config);
+/** Cancels outstanding transfers and unplugs the adapter
+ * (with config.cancel_after_disconnect, they are cancelled by the next
+ * usb_HandleEvents() once the disconnect event has been handled) */
+void usbsim_detach(void);
+/** Reports the link state through a NetworkConnection notification */
+void usbsim_set_link(bool up);
+/** Queues a frame from the peer towards the driver, false if the queue is full */
+bool usbsim_peer_send(const uint8_t *frame, size_t len);
+/** Queues a raw NTB from the peer, delivered as is in one bulk IN transfer (NCM),
+ * false if the queue is full. It counts as one frame in the stats. */
+bool usbsim_peer_send_ntb(const uint8_t *ntb, size_t len);
+/** Number of peer frames not yet delivered to the driver */
+size_t usbsim_peer_pending(void);
+/** Sets the callback receiving frames sent by the driver */
+void usbsim_set_peer_recv(usbsim_peer_recv_fn fn, void *arg);
+void usbsim_get_stats(struct usbsim_stats *stats);
+void usbsim_reset_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* USBDRVCE_SIM_H */
@@ -76,6 +76,9 @@ declare -a excluded_functions=(
     "udp_sendto_if_chksum"
     "udp_sendto_if_src_chksum"
     "ip_reass_init"     # for whatever reason this prototype doesn't have a C func
+    "mem_profile_alloc"     # MEM_PROFILE hooks for memp.c and pbuf.c
+    "mem_profile_fail"
+    "mem_profile_free"
 )
 
 # output_functable keeps a running list of functions we have already put into the table
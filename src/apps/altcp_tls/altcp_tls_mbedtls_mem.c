@@ -64,6 +64,13 @@
 
 #include <string.h>
 
+#if MEM_CUSTOM_ALLOCATOR
+/* TLS state is charged to the application's heap quota */
+#define ALTCP_MBEDTLS_MEM_CATEGORY() (mem_category = MEM_CAT_APP)
+#else
+#define ALTCP_MBEDTLS_MEM_CATEGORY()
+#endif
+
 #ifndef ALTCP_MBEDTLS_MEM_DEBUG
 #define ALTCP_MBEDTLS_MEM_DEBUG   LWIP_DBG_OFF
 #endif
@@ -118,6 +125,7 @@ tls_malloc(size_t c, size_t len)
                                           (int)c, (int)len, (int)MEM_SIZE));
     return NULL;
   }
+  ALTCP_MBEDTLS_MEM_CATEGORY();
   hlpr = (altcp_mbedtls_malloc_helper_t *)mem_malloc((mem_size_t)alloc_size);
   if (hlpr == NULL) {
     LWIP_DEBUGF(ALTCP_MBEDTLS_MEM_DEBUG, ("mbedtls alloc callback failed for %c * %d bytes\n", (int)c, (int)len));
@@ -171,7 +179,9 @@ altcp_mbedtls_mem_init(void)
 altcp_mbedtls_state_t *
 altcp_mbedtls_alloc(void *conf)
 {
-  altcp_mbedtls_state_t *ret = (altcp_mbedtls_state_t *)mem_calloc(1, sizeof(altcp_mbedtls_state_t));
+  altcp_mbedtls_state_t *ret;
+  ALTCP_MBEDTLS_MEM_CATEGORY();
+  ret = (altcp_mbedtls_state_t *)mem_calloc(1, sizeof(altcp_mbedtls_state_t));
   if (ret != NULL) {
     ret->conf = conf;
   }
@@ -195,6 +205,7 @@ altcp_mbedtls_alloc_config(size_t size)
     /* allocation too big (mem_size_t overflow) */
     return NULL;
   }
+  ALTCP_MBEDTLS_MEM_CATEGORY();
   ret = (altcp_mbedtls_state_t *)mem_calloc(1, (mem_size_t)size);
   return ret;
 }
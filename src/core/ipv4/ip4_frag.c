@@ -151,6 +151,19 @@ ip_reass_tmr(void)
   }
 }
 
+/**
+ * Free all datagrams waiting for fragments, to give their pbufs back when
+ * memory runs low.
+ */
+void
+ip_reass_drop_all(void)
+{
+  while (reassdatagrams != NULL) {
+    LWIP_DEBUGF(IP_REASS_DEBUG, ("ip_reass_drop_all: dropping datagram\n"));
+    ip_reass_free_complete_datagram(reassdatagrams, NULL);
+  }
+}
+
 /**
  * Free a datagram (struct ip_reassdata) and all its pbufs.
  * Updates the total count of enqueued pbufs (ip_reass_pbufcount),
@@ -137,6 +137,18 @@ ip6_reass_tmr(void)
    }
 }
 
+/**
+ * Free all datagrams waiting for fragments, to give their pbufs back when
+ * memory runs low.
+ */
+void
+ip6_reass_drop_all(void)
+{
+  while (reassdatagrams != NULL) {
+    ip6_reass_free_complete_datagram(reassdatagrams);
+  }
+}
+
 /**
  * Free a datagram (struct ip6_reassdata) and all its pbufs.
  * Updates the total count of enqueued pbufs (ip6_reass_pbufcount),
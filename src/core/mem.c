@@ -59,6 +59,12 @@
 #include "lwip/sys.h"
 #include "lwip/stats.h"
 #include "lwip/err.h"
+#include "lwip/priv/memp_priv.h"
+#include "lwip/memp.h"
+#include "lwip/pbuf.h"
+#include "lwip/priv/tcp_priv.h"
+#include "lwip/ip4_frag.h"
+#include "lwip/ip6_frag.h"
 
 #include <stdio.h>  /* snprintf */
 #include <string.h>
@@ -87,7 +93,16 @@
 #if MEM_CUSTOM_ALLOCATOR==1
 
 #define LWIP_HEAP_MAX_DEFAULT   (1024*16)
-#define MEM_MALLOC_HELPER_SIZE  2
+/* each allocation is preceded by its size (with this header) and category */
+#define MEM_MALLOC_HELPER_SIZE  3
+#define mem_header_size(hdr)        (*(uint16_t *)(hdr))
+#define mem_header_category(hdr)    (((uint8_t *)(hdr))[2])
+
+#if LWIP_STATS && MEM_STATS
+#define MEM_LIBC_STATSHELPER_SIZE LWIP_MEM_ALIGN_SIZE(sizeof(mem_size_t))
+#else
+#define MEM_LIBC_STATSHELPER_SIZE 0
+#endif
 
 bool mem_inited = false;
 
@@ -100,30 +115,382 @@ struct mem_configurator mem_conf = {
     sizeof(struct mem_configurator),
     function_unset,
     function_unset,
-    LWIP_HEAP_MAX_DEFAULT
+    LWIP_HEAP_MAX_DEFAULT,
+    NULL,
+    0,
+    {0},
+    0,
+    LWIP_HEAP_MAX_DEFAULT / 4 * 3,
+    LWIP_HEAP_MAX_DEFAULT / 8 * 7,
+    NULL
 };
 size_t lwip_heap_usage = 0;
 
-void *custom_malloc(size_t size) {
-    if(lwip_heap_usage >= mem_conf.heap_max) {
-        LWIP_DEBUGF(MEM_DEBUG | LWIP_DBG_LEVEL_SERIOUS, ("mem_malloc: did not allocate %"SZT_F" bytes, %"SZT_F"/%"SZT_F" of user-defined heap limit used.\n", size, lwip_heap_usage, mem_conf.heap_max));
-        return NULL;
+/*
+ * Quotas and memory pressure: every allocation is charged to the category in
+ * mem_category, and fails if that would take the category past its quota, or
+ * the heap past heap_max. Slab objects are charged their stride, while their
+ * chunks count against heap_max.
+ * Heap usage crossing low_water or high_water (with some hysteresis on the way
+ * down) changes the pressure level. The level is reported from
+ * sys_check_timeouts() rather than from inside an allocation, and reaching
+ * MEM_PRESSURE_HIGH, or any failed allocation, makes lwIP shed what it only
+ * holds on to: out-of-sequence TCP data, pending reassemblies, recycled memp
+ * objects and empty slab chunks. Under high pressure no new out-of-sequence
+ * data is queued either.
+ */
+uint8_t mem_category = MEM_CAT_OTHER;
+volatile bool mem_pressure_pending = false;
+static size_t mem_usage[MEM_CATEGORIES];
+static uint8_t mem_level = MEM_PRESSURE_NONE;       // level heap usage is at
+static uint8_t mem_level_told = MEM_PRESSURE_NONE;  // level last passed to the callback
+static bool mem_shed = false;                       // shedding due at the next check
+
+size_t mem_category_usage(uint8_t category) {
+    return (category < MEM_CATEGORIES) ? mem_usage[category] : 0;
+}
+
+enum mem_pressure mem_pressure_level(void) {
+    return mem_level;
+}
+
+/* recomputes the pressure level after heap usage changed */
+static void mem_pressure_update(void) {
+    size_t slack = (mem_conf.high_water > mem_conf.low_water) ? (mem_conf.high_water - mem_conf.low_water) / 2 : 0;
+    uint8_t level;
+    if ((lwip_heap_usage >= mem_conf.high_water) ||
+        ((mem_level == MEM_PRESSURE_HIGH) && (lwip_heap_usage + slack >= mem_conf.high_water)))
+        level = MEM_PRESSURE_HIGH;
+    else if ((lwip_heap_usage >= mem_conf.low_water) ||
+             ((mem_level != MEM_PRESSURE_NONE) && (lwip_heap_usage + slack >= mem_conf.low_water)))
+        level = MEM_PRESSURE_LOW;
+    else
+        level = MEM_PRESSURE_NONE;
+    if (level == mem_level)
+        return;
+    if (level == MEM_PRESSURE_HIGH)
+        mem_shed = true;
+    mem_level = level;
+    mem_pressure_pending = true;
+}
+
+/* an allocation failed, shed at the next check whatever the level */
+static void mem_pressure_raise(void) {
+    mem_shed = true;
+    mem_pressure_pending = true;
+}
+
+/* whether the program's heap may grow by size bytes */
+static bool mem_heap_admit(size_t size) {
+    if (lwip_heap_usage + size <= mem_conf.heap_max)
+        return true;
+    LWIP_DEBUGF(MEM_DEBUG | LWIP_DBG_LEVEL_SERIOUS, ("mem_malloc: did not allocate %"SZT_F" bytes, %"SZT_F"/%"SZT_F" of user-defined heap limit used.\n", size, lwip_heap_usage, mem_conf.heap_max));
+    mem_pressure_raise();
+    return false;
+}
+
+/* whether a category may be charged size more bytes */
+static bool mem_quota_admit(uint8_t category, size_t size) {
+    if (!mem_conf.quota[category] || (mem_usage[category] + size <= mem_conf.quota[category]))
+        return true;
+    LWIP_DEBUGF(MEM_DEBUG | LWIP_DBG_LEVEL_WARNING, ("mem_malloc: did not allocate %"SZT_F" bytes, %"SZT_F"/%"SZT_F" of category %u quota used.\n", size, mem_usage[category], mem_conf.quota[category], category));
+    mem_pressure_raise();
+    return false;
+}
+
+u32_t mem_ooseq_limit(void) {
+    if (mem_level == MEM_PRESSURE_HIGH)
+        return 0;
+    return mem_conf.ooseq_max ? (u32_t)mem_conf.ooseq_max : 0xffffffffUL;
+}
+
+#if MEM_SLAB
+/*
+ * Slab layer: every memp object (pcbs, segments, timeouts, pbuf pool buffers...)
+ * has one of a handful of fixed sizes, so those sizes are served from per-size
+ * free lists instead of the program's malloc. Objects are carved from chunks of
+ * MEM_SLAB_CHUNK_SIZE bytes, and allocating or freeing one is a pointer pop or
+ * push. A chunk goes back to the program's heap once it is empty, unless it is
+ * the only one of its size with room left.
+ * Slab objects keep the helper header, holding MEM_SLAB_OBJECT plus the
+ * header's offset in its chunk instead of a size.
+ * With an arena configured (mem_configurator V2), mem_init() reserves chunks for
+ * each pool's MEMP_NUM_* objects in it, and later chunks come from what is left
+ * of it before the program's heap. Arena chunks stay with their slab for good.
+ */
+#define MEM_SLAB_OBJECT     0x8000
+
+struct mem_slab;
+
+struct mem_slab_chunk {
+    struct mem_slab_chunk *next;    // chunks of the slab with a free object
+    struct mem_slab_chunk *prev;
+    struct mem_slab *slab;          // owning slab
+    void *free;                     // free objects (headers), linked through their bodies
+    uint8_t live;                   // objects handed out
+};
+
+struct mem_slab {
+    size_t size;                    // allocation size served
+    uint8_t per_chunk;              // objects per chunk
+    struct mem_slab_chunk *partial; // chunks with a free object
+};
+
+static struct mem_slab mem_slabs[MEMP_MAX];
+static uint8_t mem_slab_count = 0;
+static uint8_t *mem_arena_next = NULL;  // unused part of the arena
+static size_t mem_arena_left = 0;
+
+#define mem_slab_stride(slab) (MEM_MALLOC_HELPER_SIZE + LWIP_MAX((slab)->size, sizeof(void *)))
+#define mem_slab_chunk_size(slab) (sizeof(struct mem_slab_chunk) + (slab)->per_chunk * mem_slab_stride(slab))
+#define mem_in_arena(ptr) (((uint8_t *)(ptr) >= (uint8_t *)mem_conf.arena) && \
+                           ((uint8_t *)(ptr) < (uint8_t *)mem_conf.arena + mem_conf.arena_size))
+
+static struct mem_slab_chunk *mem_slab_grow(struct mem_slab *slab, bool arena_only);
+
+/* what memp_malloc() asks mem_malloc() for */
+#define mem_slab_memp_size(type) (MEMP_SIZE + MEMP_ALIGN_SIZE(memp_pools[type]->size) + MEM_LIBC_STATSHELPER_SIZE)
+
+static struct mem_slab *mem_slab_find(size_t size);
+
+/* sets up a slab for each distinct memp object size, reserving the pools in the arena if there is one */
+static void mem_slab_init(void) {
+    // sizes are fixed at build time, a second lwip_init() keeps the slabs
+    if (mem_slab_count)
+        return;
+    for (uint8_t i = 0; i < MEMP_MAX; i++) {
+        size_t size = mem_slab_memp_size(i);
+        uint8_t j;
+        for (j = 0; j < mem_slab_count; j++)
+            if (mem_slabs[j].size == size)
+                break;
+        if (j < mem_slab_count)
+            continue;
+        struct mem_slab *slab = &mem_slabs[mem_slab_count++];
+        slab->size = size;
+        slab->per_chunk = LWIP_MIN(LWIP_MAX((MEM_SLAB_CHUNK_SIZE - sizeof(struct mem_slab_chunk)) / mem_slab_stride(slab), 1), 255);
+        slab->partial = NULL;
+        LWIP_DEBUGF(MEM_DEBUG | LWIP_DBG_TRACE, ("mem_slab_init: %"SZT_F" bytes, %u per chunk\n", size, slab->per_chunk));
     }
-    void *ptr = mem_conf.in_malloc(size + MEM_MALLOC_HELPER_SIZE);
-    if (ptr) {
-        *(uint16_t*)ptr = size + MEM_MALLOC_HELPER_SIZE;
-        lwip_heap_usage += size + MEM_MALLOC_HELPER_SIZE;
-        return ptr + MEM_MALLOC_HELPER_SIZE;
+    if (mem_conf.arena == NULL)
+        return;
+    mem_arena_next = mem_conf.arena;
+    mem_arena_left = mem_conf.arena_size;
+    for (uint8_t i = 0; i < MEMP_MAX; i++) {
+        struct mem_slab *slab = mem_slab_find(mem_slab_memp_size(i));
+        for (uint16_t n = 0; n < memp_pools[i]->num; n += slab->per_chunk)
+            if (mem_slab_grow(slab, true) == NULL) {
+                LWIP_DEBUGF(MEM_DEBUG | LWIP_DBG_LEVEL_WARNING, ("mem_slab_init: arena full, %"SZT_F" bytes\n", mem_conf.arena_size));
+                return;
+            }
     }
+}
+
+static struct mem_slab *mem_slab_find(size_t size) {
+    for (uint8_t i = 0; i < mem_slab_count; i++)
+        if (mem_slabs[i].size == size)
+            return &mem_slabs[i];
     return NULL;
 }
 
+static void mem_slab_unlink(struct mem_slab_chunk *chunk) {
+    if (chunk->prev)
+        chunk->prev->next = chunk->next;
+    else
+        chunk->slab->partial = chunk->next;
+    if (chunk->next)
+        chunk->next->prev = chunk->prev;
+}
+
+static void mem_slab_release(struct mem_slab_chunk *chunk) {
+    size_t size = mem_slab_chunk_size(chunk->slab);
+    mem_slab_unlink(chunk);
+    mem_conf.in_free(chunk);
+    lwip_heap_usage -= size;
+}
+
+/* returns the empty chunks slabs keep for reuse to the program's heap */
+static bool mem_slab_trim(void) {
+    bool released = false;
+    for (uint8_t i = 0; i < mem_slab_count; i++) {
+        struct mem_slab_chunk *chunk = mem_slabs[i].partial;
+        while (chunk) {
+            struct mem_slab_chunk *next = chunk->next;
+            if ((chunk->live == 0) && !mem_in_arena(chunk)) {
+                mem_slab_release(chunk);
+                released = true;
+            }
+            chunk = next;
+        }
+    }
+    return released;
+}
+
+/* adds a chunk to a slab, from the arena if it has room, else from the program's heap */
+static struct mem_slab_chunk *mem_slab_grow(struct mem_slab *slab, bool arena_only) {
+    size_t stride = mem_slab_stride(slab);
+    size_t size = mem_slab_chunk_size(slab);
+    struct mem_slab_chunk *chunk;
+    if (size <= mem_arena_left) {
+        chunk = (struct mem_slab_chunk *)mem_arena_next;
+        mem_arena_next += size;
+        mem_arena_left -= size;
+    } else {
+        if (arena_only || !mem_heap_admit(size))
+            return NULL;
+        if ((chunk = mem_conf.in_malloc(size)) == NULL) {
+            mem_pressure_raise();
+            return NULL;
+        }
+        lwip_heap_usage += size;
+    }
+    chunk->slab = slab;
+    chunk->live = 0;
+    chunk->free = NULL;
+    // headers are written once, free objects link through their bodies
+    for (uint8_t i = slab->per_chunk; i > 0; i--) {
+        uint8_t *obj = (uint8_t *)(chunk + 1) + (i - 1) * stride;
+        mem_header_size(obj) = MEM_SLAB_OBJECT | (uint16_t)(obj - (uint8_t *)chunk);
+        *(void **)(obj + MEM_MALLOC_HELPER_SIZE) = chunk->free;
+        chunk->free = obj;
+    }
+    chunk->prev = NULL;
+    chunk->next = slab->partial;
+    if (chunk->next)
+        chunk->next->prev = chunk;
+    slab->partial = chunk;
+    return chunk;
+}
+
+static void *mem_slab_alloc(struct mem_slab *slab, uint8_t category) {
+    struct mem_slab_chunk *chunk = slab->partial;
+    if (!mem_quota_admit(category, mem_slab_stride(slab)))
+        return NULL;
+    if ((chunk == NULL) && ((chunk = mem_slab_grow(slab, false)) == NULL))
+        return NULL;
+    uint8_t *obj = chunk->free;
+    chunk->free = *(void **)(obj + MEM_MALLOC_HELPER_SIZE);
+    chunk->live++;
+    mem_header_category(obj) = category;
+    mem_usage[category] += mem_slab_stride(slab);
+    if (chunk->free == NULL)
+        mem_slab_unlink(chunk);
+    return obj + MEM_MALLOC_HELPER_SIZE;
+}
+
+static void mem_slab_free(uint8_t *obj) {
+    struct mem_slab_chunk *chunk = (struct mem_slab_chunk *)(obj - (mem_header_size(obj) & ~MEM_SLAB_OBJECT));
+    struct mem_slab *slab = chunk->slab;
+    LWIP_ASSERT("mem_free: slab object freed twice", chunk->live);
+    mem_usage[mem_header_category(obj)] -= mem_slab_stride(slab);
+    if (chunk->free == NULL) {
+        // full until now, back on the partial list
+        chunk->prev = NULL;
+        chunk->next = slab->partial;
+        if (chunk->next)
+            chunk->next->prev = chunk;
+        slab->partial = chunk;
+    }
+    *(void **)(obj + MEM_MALLOC_HELPER_SIZE) = chunk->free;
+    chunk->free = obj;
+    chunk->live--;
+    // keep an empty chunk only if the slab has no other room
+    if ((chunk->live == 0) && ((chunk->prev != NULL) || (chunk->next != NULL)) && !mem_in_arena(chunk))
+        mem_slab_release(chunk);
+}
+#endif /* MEM_SLAB */
+
+void *custom_malloc(size_t size) {
+    uint8_t category = mem_category;
+    void *ptr;
+    mem_category = MEM_CAT_OTHER;
+#if MEM_SLAB
+    struct mem_slab *slab = mem_slab_find(size);
+    if (slab) {
+        ptr = mem_slab_alloc(slab, category);
+        mem_pressure_update();
+        return ptr;
+    }
+#endif
+    size += MEM_MALLOC_HELPER_SIZE;
+#if MEM_SLAB
+    // larger sizes would read as slab objects
+    if (size >= MEM_SLAB_OBJECT)
+        return NULL;
+#endif
+    if (!mem_quota_admit(category, size) || !mem_heap_admit(size))
+        return NULL;
+    if ((ptr = mem_conf.in_malloc(size)) == NULL) {
+        mem_pressure_raise();
+        return NULL;
+    }
+    mem_header_size(ptr) = size;
+    mem_header_category(ptr) = category;
+    mem_usage[category] += size;
+    lwip_heap_usage += size;
+    mem_pressure_update();
+    return ptr + MEM_MALLOC_HELPER_SIZE;
+}
+
 void custom_free(void *ptr){
     if(ptr){
-        uint16_t size = *(uint16_t*)(ptr - MEM_MALLOC_HELPER_SIZE);
+        ptr -= MEM_MALLOC_HELPER_SIZE;
+        uint16_t size = mem_header_size(ptr);
+#if MEM_SLAB
+        if (size & MEM_SLAB_OBJECT) {
+            mem_slab_free(ptr);
+            mem_pressure_update();
+            return;
+        }
+#endif
         LWIP_ASSERT("mem_free: heap underflow occurred", size <= lwip_heap_usage);
-        mem_conf.in_free(ptr - MEM_MALLOC_HELPER_SIZE);
+        mem_usage[mem_header_category(ptr)] -= size;
+        mem_conf.in_free(ptr);
         lwip_heap_usage -= size;
+        mem_pressure_update();
+    }
+}
+
+/* frees what lwIP holds without needing it */
+static void mem_pressure_shed(void) {
+#if LWIP_TCP && TCP_QUEUE_OOSEQ
+    for (struct tcp_pcb *pcb = tcp_active_pcbs; pcb != NULL; pcb = pcb->next)
+        if (pcb->ooseq != NULL)
+            tcp_free_ooseq(pcb);
+#endif
+#if LWIP_IPV4 && IP_REASSEMBLY
+    ip_reass_drop_all();
+#endif
+#if LWIP_IPV6 && LWIP_IPV6_REASS
+    ip6_reass_drop_all();
+#endif
+#if MEMP_RECYCLING
+    memp_recycle_flush();
+#endif
+#if MEM_SLAB
+    mem_slab_trim();
+#endif
+    mem_pressure_update();
+}
+
+void mem_pressure_check(void) {
+    bool shed = mem_shed;
+    if (!mem_pressure_pending)
+        return;
+    mem_pressure_pending = false;
+    mem_shed = false;
+    if (shed) {
+        LWIP_DEBUGF(MEM_DEBUG | LWIP_DBG_TRACE, ("mem_pressure_check: shedding, %"SZT_F"/%"SZT_F" used\n", lwip_heap_usage, mem_conf.heap_max));
+        // the program may have its own buffers to give back first
+        mem_level_told = MEM_PRESSURE_HIGH;
+        if (mem_conf.pressure)
+            mem_conf.pressure(MEM_PRESSURE_HIGH);
+        mem_pressure_shed();
+    }
+    if (mem_level != mem_level_told) {
+        mem_level_told = mem_level;
+        if (mem_conf.pressure)
+            mem_conf.pressure(mem_level);
     }
 }
 
@@ -155,12 +522,88 @@ bool mem_configure(struct mem_configurator *conf){
     memcpy(&mem_conf, conf, LWIP_MIN(conf->version, sizeof(struct mem_configurator)));
     if(mem_conf.heap_max < LWIP_HEAP_MAX_DEFAULT)
         mem_conf.heap_max = LWIP_HEAP_MAX_DEFAULT;
+    if(conf->version < MEM_CONFIGURATOR_V3)
+        memset((uint8_t *)&mem_conf + conf->version, 0, sizeof(struct mem_configurator) - conf->version);
+    if(!mem_conf.low_water)
+        mem_conf.low_water = mem_conf.heap_max / 4 * 3;
+    if(!mem_conf.high_water)
+        mem_conf.high_water = mem_conf.heap_max / 8 * 7;
     mem_inited = true;
     return true;
 }
 
 #endif
 
+#if MEM_PROFILE
+/*
+ * Allocation profiler: memp_malloc() and pbuf_alloc() count into a struct
+ * mem_profile per memp type (memp_profile) and per pbuf layer/type
+ * (pbuf_profile). A pbuf_alloc() is counted once, however many pbufs its
+ * chain takes, and is freed along with the pbuf heading it.
+ */
+void mem_profile_alloc(struct mem_profile *prof, size_t size) {
+    uint8_t bucket = 0;
+    for (size_t s = size >> 5; s && (bucket < MEM_PROFILE_BUCKETS - 1); s >>= 1)
+        bucket++;
+    prof->allocs++;
+    prof->bytes += size;
+    prof->sizes[bucket]++;
+    if (++prof->live > prof->peak)
+        prof->peak = prof->live;
+}
+
+void mem_profile_fail(struct mem_profile *prof) {
+    prof->fails++;
+}
+
+void mem_profile_free(struct mem_profile *prof) {
+    LWIP_ASSERT("mem_profile_free: more frees than allocations", prof->live);
+    prof->frees++;
+    prof->live--;
+}
+
+static void mem_profile_clear(struct mem_profile *prof) {
+    u32_t live = prof->live;
+    memset(prof, 0, sizeof(struct mem_profile));
+    prof->live = prof->peak = live;
+}
+
+#if LWIP_STATS_DISPLAY
+static void mem_profile_display_one(const struct mem_profile *prof, const char *name, const char *type) {
+    const u32_t *n = prof->sizes;
+    if (!prof->allocs && !prof->fails && !prof->live)
+        return;
+    LWIP_PLATFORM_DIAG(("%s%s: allocs %"U32_F" fails %"U32_F" frees %"U32_F" bytes %"U32_F" live %"U32_F" peak %"U32_F
+                        ", sizes <32:%"U32_F" <64:%"U32_F" <128:%"U32_F" <256:%"U32_F" <512:%"U32_F" <1024:%"U32_F
+                        " <2048:%"U32_F" >=2048:%"U32_F, name, type, prof->allocs, prof->fails, prof->frees, prof->bytes,
+                        prof->live, prof->peak, n[0], n[1], n[2], n[3], n[4], n[5], n[6], n[7]));
+}
+
+#endif /* LWIP_STATS_DISPLAY */
+#endif /* MEM_PROFILE */
+
+/* both are in the function table, so they exist whether profiling is built in or not */
+void mem_profile_reset(void) {
+#if MEM_PROFILE
+    for (uint8_t i = 0; i < MEMP_MAX; i++)
+        mem_profile_clear(&memp_profile[i]);
+    for (uint8_t i = 0; i < PBUF_PROFILE_LAYERS * PBUF_PROFILE_TYPES; i++)
+        mem_profile_clear(&pbuf_profile[i]);
+#endif /* MEM_PROFILE */
+}
+
+void mem_profile_display(void) {
+#if MEM_PROFILE && LWIP_STATS_DISPLAY
+    static const char *const layers[PBUF_PROFILE_LAYERS] = {"RAW", "LINK", "IP", "TRANSPORT"};
+    static const char *const types[PBUF_PROFILE_TYPES] = {"_RAM", "_ROM", "_REF", "_POOL"};
+    LWIP_PLATFORM_DIAG(("\nMEM PROFILE"));
+    for (uint8_t i = 0; i < MEMP_MAX; i++)
+        mem_profile_display_one(&memp_profile[i], memp_pools[i]->desc, "");
+    for (uint8_t i = 0; i < PBUF_PROFILE_LAYERS * PBUF_PROFILE_TYPES; i++)
+        mem_profile_display_one(&pbuf_profile[i], layers[i / PBUF_PROFILE_TYPES], types[i % PBUF_PROFILE_TYPES]);
+#endif /* MEM_PROFILE && LWIP_STATS_DISPLAY */
+}
+
 #if MEM_OVERFLOW_CHECK || MEMP_OVERFLOW_CHECK
 /**
  * Check if a mep element was victim of an overflow or underflow
@@ -237,6 +680,10 @@ mem_overflow_init_raw(void *p, size_t size)
 bool
 mem_init(void)
 {
+#if MEM_SLAB
+    if (mem_inited)
+        mem_slab_init();
+#endif
     return mem_inited;
 }
 
@@ -254,12 +701,6 @@ mem_trim(void *mem, mem_size_t size)
 
 #if MEM_CUSTOM_ALLOCATOR
 
-#if LWIP_STATS && MEM_STATS
-#define MEM_LIBC_STATSHELPER_SIZE LWIP_MEM_ALIGN_SIZE(sizeof(mem_size_t))
-#else
-#define MEM_LIBC_STATSHELPER_SIZE 0
-#endif
-
 /**
  * Allocate a block of memory with a minimum of 'size' bytes.
  *
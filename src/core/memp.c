@@ -83,6 +83,13 @@ const struct memp_desc *const memp_pools[MEMP_MAX] = {
 #include "lwip/priv/memp_std.h"
 };
 
+#if MEMP_RECYCLING
+/** Freed elements kept per pool for reuse, linked through their first bytes */
+static void *memp_recycled[MEMP_MAX];
+static u16_t memp_recycled_num[MEMP_MAX];
+static u16_t memp_recycle_max[MEMP_MAX];
+#endif /* MEMP_RECYCLING */
+
 #ifdef LWIP_HOOK_FILENAME
 #include LWIP_HOOK_FILENAME
 #endif
@@ -228,6 +235,9 @@ memp_init(void)
   /* for every pool: */
   for (i = 0; i < LWIP_ARRAYSIZE(memp_pools); i++) {
     memp_init_pool(memp_pools[i]);
+#if MEMP_RECYCLING
+    memp_recycle_max[i] = MEMP_RECYCLE_MAX(i);
+#endif /* MEMP_RECYCLING */
 
 #if LWIP_STATS && MEMP_STATS
     lwip_stats.memp[i] = memp_pools[i]->stats;
@@ -325,6 +335,194 @@ memp_malloc_pool_fn(const struct memp_desc *desc, const char *file, const int li
 #endif
 }
 
+#if MEM_PROFILE
+struct mem_profile memp_profile[MEMP_MAX];
+#endif /* MEM_PROFILE */
+
+/**
+ * Copy the allocation profile of a pool, see MEM_PROFILE.
+ *
+ * @param type the pool
+ * @param prof where to copy the profile to
+ * @return 1 if copied, 0 if MEM_PROFILE is off or type is not a pool
+ */
+u8_t
+memp_profile_get(memp_t type, struct mem_profile *prof)
+{
+  LWIP_ERROR("memp_profile_get: invalid prof", prof != NULL, return 0;);
+  if (type >= MEMP_MAX) {
+    return 0;
+  }
+#if MEM_PROFILE
+  MEMCPY(prof, &memp_profile[type], sizeof(struct mem_profile));
+  return 1;
+#else /* MEM_PROFILE */
+  return 0;
+#endif /* MEM_PROFILE */
+}
+
+#if MEMP_MEM_MALLOC && MEM_CUSTOM_ALLOCATOR
+/**
+ * The heap quota (enum mem_category) objects of a pool are charged to.
+ */
+static u8_t
+memp_category(memp_t type)
+{
+  switch (type) {
+    case MEMP_PBUF_POOL:
+      return MEM_CAT_RX;
+    case MEMP_PBUF:
+#if LWIP_TCP
+    case MEMP_TCP_SEG:
+#endif /* LWIP_TCP */
+#if (IP_FRAG && !LWIP_NETIF_TX_SINGLE_PBUF) || (LWIP_IPV6 && LWIP_IPV6_FRAG)
+    case MEMP_FRAG_PBUF:
+#endif /* IP_FRAG && !LWIP_NETIF_TX_SINGLE_PBUF || (LWIP_IPV6 && LWIP_IPV6_FRAG) */
+      return MEM_CAT_TX;
+#if LWIP_IPV4 && IP_REASSEMBLY
+    case MEMP_REASSDATA:
+#endif /* LWIP_IPV4 && IP_REASSEMBLY */
+#if LWIP_IPV6 && LWIP_IPV6_REASS
+    case MEMP_IP6_REASSDATA:
+#endif /* LWIP_IPV6 && LWIP_IPV6_REASS */
+      return MEM_CAT_REASS;
+#if LWIP_ALTCP && LWIP_TCP
+    case MEMP_ALTCP_PCB:
+      return MEM_CAT_APP;
+#endif /* LWIP_ALTCP && LWIP_TCP */
+    default:
+      return MEM_CAT_OTHER;
+  }
+}
+#endif /* MEMP_MEM_MALLOC && MEM_CUSTOM_ALLOCATOR */
+
+#if MEMP_RECYCLING
+/**
+ * Take an element from the heap, charged to its pool's category.
+ */
+static void *
+memp_malloc_heap(memp_t type)
+{
+#if MEM_CUSTOM_ALLOCATOR
+  mem_category = memp_category(type);
+#endif /* MEM_CUSTOM_ALLOCATOR */
+  return do_memp_malloc_pool(memp_pools[type]);
+}
+
+/**
+ * Take an element freed earlier from a pool's recycle list.
+ *
+ * @return the element or NULL if none is kept
+ */
+static void *
+memp_recycle_get(memp_t type)
+{
+  void *memp;
+  SYS_ARCH_DECL_PROTECT(old_level);
+
+  SYS_ARCH_PROTECT(old_level);
+  memp = memp_recycled[type];
+  if (memp != NULL) {
+    memp_recycled[type] = *(void **)memp;
+    memp_recycled_num[type]--;
+#if MEMP_STATS
+    memp_pools[type]->stats->used++;
+    if (memp_pools[type]->stats->used > memp_pools[type]->stats->max) {
+      memp_pools[type]->stats->max = memp_pools[type]->stats->used;
+    }
+#endif /* MEMP_STATS */
+  }
+  SYS_ARCH_UNPROTECT(old_level);
+  return memp;
+}
+
+/**
+ * Keep a freed element on its pool's recycle list, unless the list is full
+ * or the heap is under pressure.
+ *
+ * @return 1 if the element was kept, 0 if it is to be freed
+ */
+static u8_t
+memp_recycle_put(memp_t type, void *mem)
+{
+  SYS_ARCH_DECL_PROTECT(old_level);
+
+#if MEM_CUSTOM_ALLOCATOR
+  if (mem_pressure_level() != MEM_PRESSURE_NONE) {
+    return 0;
+  }
+#endif /* MEM_CUSTOM_ALLOCATOR */
+  SYS_ARCH_PROTECT(old_level);
+  if (memp_recycled_num[type] >= memp_recycle_max[type]) {
+    SYS_ARCH_UNPROTECT(old_level);
+    return 0;
+  }
+  *(void **)mem = memp_recycled[type];
+  memp_recycled[type] = mem;
+  memp_recycled_num[type]++;
+#if MEMP_STATS
+  memp_pools[type]->stats->used--;
+#endif /* MEMP_STATS */
+  SYS_ARCH_UNPROTECT(old_level);
+  return 1;
+}
+
+/**
+ * Give a pool's recycled elements above max back to the heap.
+ */
+static u8_t
+memp_recycle_trim(memp_t type, u16_t max)
+{
+  u8_t freed = 0;
+  SYS_ARCH_DECL_PROTECT(old_level);
+
+  SYS_ARCH_PROTECT(old_level);
+  while (memp_recycled_num[type] > max) {
+    void *memp = memp_recycled[type];
+    memp_recycled[type] = *(void **)memp;
+    memp_recycled_num[type]--;
+    SYS_ARCH_UNPROTECT(old_level);
+    mem_free(memp);
+    freed = 1;
+    SYS_ARCH_PROTECT(old_level);
+  }
+  SYS_ARCH_UNPROTECT(old_level);
+  return freed;
+}
+
+/**
+ * Set how many freed elements of a pool are kept for reuse, overriding
+ * MEMP_RECYCLE_MAX(type). Call after lwip_init().
+ *
+ * @param type the pool
+ * @param max elements to keep, 0 to free them right away
+ */
+void
+memp_recycle_limit(memp_t type, u16_t max)
+{
+  LWIP_ERROR("memp_recycle_limit: type < MEMP_MAX", (type < MEMP_MAX), return;);
+  memp_recycle_max[type] = max;
+  memp_recycle_trim(type, max);
+}
+
+/**
+ * Give all recycled elements back to the heap.
+ *
+ * @return 1 if any were freed
+ */
+u8_t
+memp_recycle_flush(void)
+{
+  u8_t freed = 0;
+  memp_t i;
+
+  for (i = (memp_t)0; i < MEMP_MAX; i = (memp_t)(i + 1)) {
+    freed |= memp_recycle_trim(i, 0);
+  }
+  return freed;
+}
+#endif /* MEMP_RECYCLING */
+
 /**
  * Get an element from a specific pool.
  *
@@ -346,11 +544,34 @@ memp_malloc_fn(memp_t type, const char *file, const int line)
   memp_overflow_check_all();
 #endif /* MEMP_OVERFLOW_CHECK >= 2 */
 
+#if MEMP_RECYCLING
+  memp = memp_recycle_get(type);
+  if (memp == NULL) {
+    memp = memp_malloc_heap(type);
+    /* what other pools kept is the heap's again, try once more */
+    if ((memp == NULL) && memp_recycle_flush()) {
+      memp = memp_malloc_heap(type);
+    }
+  }
+#else /* MEMP_RECYCLING */
+#if MEMP_MEM_MALLOC && MEM_CUSTOM_ALLOCATOR
+  mem_category = memp_category(type);
+#endif /* MEMP_MEM_MALLOC && MEM_CUSTOM_ALLOCATOR */
+
 #if !MEMP_OVERFLOW_CHECK
   memp = do_memp_malloc_pool(memp_pools[type]);
 #else
   memp = do_memp_malloc_pool_fn(memp_pools[type], file, line);
 #endif
+#endif /* MEMP_RECYCLING */
+
+#if MEM_PROFILE
+  if (memp != NULL) {
+    mem_profile_alloc(&memp_profile[type], memp_pools[type]->size);
+  } else {
+    mem_profile_fail(&memp_profile[type]);
+  }
+#endif /* MEM_PROFILE */
 
   return memp;
 }
@@ -437,7 +658,15 @@ memp_free(memp_t type, void *mem)
   old_first = *memp_pools[type]->tab;
 #endif
 
-  do_memp_free_pool(memp_pools[type], mem);
+#if MEMP_RECYCLING
+  if (!memp_recycle_put(type, mem))
+#endif /* MEMP_RECYCLING */
+  {
+    do_memp_free_pool(memp_pools[type], mem);
+  }
+#if MEM_PROFILE
+  mem_profile_free(&memp_profile[type]);
+#endif /* MEM_PROFILE */
 
 #ifdef LWIP_HOOK_MEMP_AVAILABLE
   if (old_first == NULL) {
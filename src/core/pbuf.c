@@ -186,10 +186,87 @@ pbuf_init_alloced_pbuf(struct pbuf *p, void *payload, u16_t tot_len, u16_t len,
   p->flags = flags;
   p->ref = 1;
   p->if_idx = NETIF_NO_INDEX;
+#if MEM_PROFILE
+  p->profile = 0;
+#endif /* MEM_PROFILE */
 
   LWIP_PBUF_CUSTOM_DATA_INIT(p);
 }
 
+#if MEM_PROFILE
+struct mem_profile pbuf_profile[PBUF_PROFILE_LAYERS * PBUF_PROFILE_TYPES];
+
+/**
+ * Index in pbuf_profile of a pbuf_alloc() layer and type. Layers are told
+ * apart by their header room, so PBUF_RAW_TX counts as PBUF_RAW (or as
+ * PBUF_LINK if it reserves as much).
+ */
+static u8_t
+pbuf_profile_site(pbuf_layer layer, pbuf_type type)
+{
+  u8_t site;
+  if (layer >= PBUF_TRANSPORT) {
+    site = 3;
+  } else if (layer >= PBUF_IP) {
+    site = 2;
+  } else if (layer >= PBUF_LINK) {
+    site = 1;
+  } else {
+    site = 0;
+  }
+  site = (u8_t)(site * PBUF_PROFILE_TYPES);
+  switch (type) {
+    case PBUF_ROM:
+      return (u8_t)(site + 1);
+    case PBUF_REF:
+      return (u8_t)(site + 2);
+    case PBUF_POOL:
+      return (u8_t)(site + 3);
+    default:
+      return site;
+  }
+}
+
+static void
+pbuf_profile_alloc(struct pbuf *p, pbuf_layer layer, u16_t length, pbuf_type type)
+{
+  u8_t site = pbuf_profile_site(layer, type);
+  if (p == NULL) {
+    mem_profile_fail(&pbuf_profile[site]);
+    return;
+  }
+  mem_profile_alloc(&pbuf_profile[site], length);
+  p->profile = (u8_t)(site + 1);
+}
+#define PBUF_PROFILE_ALLOC(p, layer, length, type) pbuf_profile_alloc(p, layer, length, type)
+#else /* MEM_PROFILE */
+#define PBUF_PROFILE_ALLOC(p, layer, length, type)
+#endif /* MEM_PROFILE */
+
+/**
+ * @ingroup pbuf
+ * Copy the allocation profile of pbuf_alloc() calls for a layer and type.
+ * PBUF_RAW_TX counts as PBUF_RAW, see MEM_PROFILE.
+ *
+ * @param layer header room asked for
+ * @param type pbuf type asked for
+ * @param prof where to copy the profile to
+ * @return 1 if copied, 0 if MEM_PROFILE is off
+ */
+u8_t
+pbuf_profile_get(pbuf_layer layer, pbuf_type type, struct mem_profile *prof)
+{
+  LWIP_ERROR("pbuf_profile_get: invalid prof", prof != NULL, return 0;);
+#if MEM_PROFILE
+  MEMCPY(prof, &pbuf_profile[pbuf_profile_site(layer, type)], sizeof(struct mem_profile));
+  return 1;
+#else /* MEM_PROFILE */
+  LWIP_UNUSED_ARG(layer);
+  LWIP_UNUSED_ARG(type);
+  return 0;
+#endif /* MEM_PROFILE */
+}
+
 /**
  * @ingroup pbuf
  * Allocates a pbuf of the given type (possibly a chain for PBUF_POOL type).
@@ -249,6 +326,7 @@ pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type)
           if (p) {
             pbuf_free(p);
           }
+          PBUF_PROFILE_ALLOC(NULL, layer, length, type);
           /* bail out unsuccessfully */
           return NULL;
         }
@@ -279,12 +357,20 @@ pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type)
       /* bug #50040: Check for integer overflow when calculating alloc_len */
       if ((payload_len < LWIP_MEM_ALIGN_SIZE(length)) ||
           (alloc_len < LWIP_MEM_ALIGN_SIZE(length))) {
+        PBUF_PROFILE_ALLOC(NULL, layer, length, type);
         return NULL;
       }
 
+#if MEM_CUSTOM_ALLOCATOR
+      /* room for protocol headers: built for sending, unless the caller said otherwise */
+      if ((offset > 0) && (mem_category == MEM_CAT_OTHER)) {
+        mem_category = MEM_CAT_TX;
+      }
+#endif /* MEM_CUSTOM_ALLOCATOR */
       /* If pbuf is to be allocated in RAM, allocate memory for it. */
       p = (struct pbuf *)mem_malloc(alloc_len);
       if (p == NULL) {
+        PBUF_PROFILE_ALLOC(NULL, layer, length, type);
         return NULL;
       }
       pbuf_init_alloced_pbuf(p, LWIP_MEM_ALIGN((void *)((u8_t *)p + SIZEOF_STRUCT_PBUF + offset)),
@@ -297,6 +383,7 @@ pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type)
       LWIP_ASSERT("pbuf_alloc: erroneous type", 0);
       return NULL;
   }
+  PBUF_PROFILE_ALLOC(p, layer, length, type);
   LWIP_DEBUGF(PBUF_DEBUG | LWIP_DBG_TRACE, ("pbuf_alloc(length=%"U16_F") == %p\n", length, (void *)p));
   return p;
 }
@@ -764,6 +851,11 @@ pbuf_free(struct pbuf *p)
       q = p->next;
       LWIP_DEBUGF( PBUF_DEBUG | LWIP_DBG_TRACE, ("pbuf_free: deallocating %p\n", (void *)p));
       alloc_src = pbuf_get_allocsrc(p);
+#if MEM_PROFILE
+      if (p->profile) {
+        mem_profile_free(&pbuf_profile[p->profile - 1]);
+      }
+#endif /* MEM_PROFILE */
 #if LWIP_SUPPORT_CUSTOM_PBUF
       /* is this a custom pbuf? */
       if ((p->flags & PBUF_FLAG_IS_CUSTOM) != 0) {
@@ -162,6 +162,9 @@ stats_display(void)
     MEMP_STATS_DISPLAY(i);
   }
   SYS_STATS_DISPLAY();
+#if MEM_PROFILE
+  mem_profile_display();
+#endif /* MEM_PROFILE */
 }
 #endif /* LWIP_STATS_DISPLAY */
 
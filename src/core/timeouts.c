@@ -364,6 +364,9 @@ sys_check_timeouts(void)
     void *arg;
 
     PBUF_CHECK_FREE_OOSEQ();
+#if MEM_CUSTOM_ALLOCATOR
+    MEM_CHECK_PRESSURE();
+#endif
 
     tmptimeout = next_timeout;
     if (tmptimeout == NULL) {
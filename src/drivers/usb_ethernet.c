@@ -26,24 +26,39 @@
 #include "lwip/netif.h"
 #include "lwip/ethip6.h"
 #include "lwip/etharp.h"
+#include "netif/ethernet.h"
 #include "lwip/stats.h"
 #include "lwip/snmp.h"
 #include "lwip/pbuf.h"
+#include "lwip/mem.h"
 #include "lwip/dhcp.h"
+#include "lwip/sys.h"
+#include "lwip/timeouts.h"
+#include "lwip/inet_chksum.h"
+#include "lwip/priv/tcp_priv.h"
 #include "usb_ethernet.h" /* Communications Data Class header file */
 
-#define NETIFS_MAX_ALLOWED 8
+#define NETIFS_MAX_ALLOWED ETH_INTERFACES_MAX
 #define CHECK_BIT(var, pos) ((var) & (1 << (pos)))
 
 /// Define Default Hostname for NETIFs
 const char hostname[] = "ti84plusce";
 static uint8_t ifnums_used = 0;
+static eth_device_t *eth_devices[NETIFS_MAX_ALLOWED] = {0};
+static uint8_t eth_standby[NETIFS_MAX_ALLOWED];     // ifnums in failover order, see eth_set_standby()
+static uint8_t eth_standby_count = 0;
 
 struct eth_configurator eth_conf = {
-    ETH_CONFIGURATOR_V1,
+    ETH_CONFIGURATOR_V6,
     USB_CDC_MAX_RETRIES,
     true,
-    true
+    true,
+    ETH_RX_BUFFERS_DEFAULT,
+    ETH_TX_QUEUE_DEFAULT,
+    false,
+    ETH_LINK_HOLDDOWN_DEFAULT,
+    false,
+    {1, 1, 1, 1, 1, 1, 1, 1}
 };
 
 
@@ -63,11 +78,92 @@ nibble(uint16_t c)
     return 0xff;
 }
 
+/* Transfers cancelled by a reset or unplug are released, not retried */
+#define eth_xfer_cancelled(status) ((status) & (USB_TRANSFER_CANCELLED | USB_TRANSFER_NO_DEVICE))
+
+#if MEM_CUSTOM_ALLOCATOR
+/* charges the next lwIP heap allocation to a quota category */
+#define eth_mem_category(cat) (mem_category = (cat))
+/* lwIP heap rx buffers may take: a quarter of the heap limit, and at most half the MEM_CAT_RX quota */
+#define eth_rx_budget() LWIP_MIN(mem_conf.heap_max / 4, \
+                                 mem_conf.quota[MEM_CAT_RX] ? mem_conf.quota[MEM_CAT_RX] / 2 : SIZE_MAX)
+#else
+#define eth_mem_category(cat)
+#define eth_rx_budget() ((size_t)MEM_SIZE / 4)
+#endif
+
+/* IPv4 header is a fragment: MF set or a nonzero offset (IP_MF | IP_OFFMASK of the flags/offset field) */
+#define eth_ip4_fragment(ip) (((ip)[6] & 0x3f) | (ip)[7])
+
+void ncm_tx_discard(eth_device_t *dev);
+void eth_tx_discard(eth_device_t *dev);
+bool ncm_tx_flush(eth_device_t *dev);
+void eth_rx_detach(eth_device_t *dev);
+void eth_bond_detach(eth_device_t *dev);
+void eth_standby_remove(uint8_t ifnum);
+void eth_link_up(struct netif *netif);
+void eth_link_down(struct netif *netif);
+void eth_failover_timeout(void *arg);
+void eth_failover_repoint(struct netif *netif);
+
+///---------------------------------------------------
+/// @brief allocates the class and transfer state of a device in one block
+/// Holds the NCM instance data (NCM only), the tx slots, the eth_poll() queue
+/// (deferred input only), the adapter's multicast filter list and the interrupt
+/// buffer, so each device only pays for what its class and configuration use.
+/// @note @b dev->ncm may point at temporary NCM data, which is copied into the block.
+bool eth_state_alloc(eth_device_t *dev)
+{
+    size_t ncm_size = (dev->type == USB_NCM_SUBCLASS) ? sizeof(struct _ncm) : 0;
+    size_t slots_size = (dev->tx.depth + ETH_TX_URGENT_SLOTS) * sizeof(struct eth_tx_slot);
+    size_t queue_size = eth_conf.do_deferred_input ? ETH_RX_QUEUE_LEN * sizeof(struct pbuf *) : 0;
+    size_t list_size = LWIP_MIN(dev->filter.slots, ETH_MCAST_FILTERS_MAX + 1) * ETH_HWADDR_LEN;
+    // pointer-aligned parts first, byte arrays last
+    uint8_t *block = malloc(ncm_size + slots_size + queue_size + list_size + dev->interrupt.size);
+    if (block == NULL)
+        return false;
+    dev->state = block;
+    dev->ncm = ncm_size ? memcpy(block, dev->ncm, ncm_size) : NULL;
+    block += ncm_size;
+    dev->tx.slots = memset(block, 0, slots_size);
+    block += slots_size;
+    dev->rx.queue = queue_size ? (struct pbuf **)block : NULL;
+    block += queue_size;
+    dev->filter.list = list_size ? (uint8_t (*)[ETH_HWADDR_LEN])block : NULL;
+    block += list_size;
+    dev->interrupt.buf = block;
+    return true;
+}
+
+///---------------------------------------------------
+/// @brief frees a torn down device once no transfer on the host controller refers to it
+/// TX slots, the filter request and the interrupt buffer live in the state block,
+/// so it stays until the callbacks of those transfers have run.
+void eth_device_free(eth_device_t *dev)
+{
+    if (dev->tx.busy || dev->filter.busy || dev->interrupt.busy)
+        return;
+    free(dev->state);
+    free(dev);
+}
+
 void eth_device_teardown(eth_device_t *dev){
+    // groups left by netif_remove() below have no adapter to update
+    dev->filter.enabled = false;
+    if (dev->type == USB_NCM_SUBCLASS)
+        ncm_tx_discard(dev);
+    eth_tx_discard(dev);
+    eth_rx_detach(dev);
+    if (dev->bond)
+        eth_bond_detach(dev);
+    eth_standby_remove(dev->iface.num);
+    sys_untimeout(eth_failover_timeout, &dev->iface);
     usb_SetDeviceData(dev->device, NULL);
+    eth_devices[dev->iface.num] = NULL;
     ifnums_used &= ~(1 << dev->iface.num);
     netif_remove(&dev->iface);
-    free(dev);
+    dev->detached = true;
+    eth_device_free(dev);
 }
 
 bool eth_xmit_fatal_error(eth_device_t *dev, uint8_t retries){
@@ -75,12 +171,13 @@ bool eth_xmit_fatal_error(eth_device_t *dev, uint8_t retries){
         LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_LEVEL_SEVERE,
                     ("ERROR: device ptr=%p: fatal error", dev->device));
         if(eth_conf.do_reset_on_error){
+            dev->stats.resets++;
             LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_LEVEL_SEVERE,
                         ("INFO: device ptr=%p: resetting", dev->device));
             if(usb_ResetDevice(dev->device)){
-                eth_device_teardown(dev);
                 LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_LEVEL_SEVERE,
                             ("ERROR: device ptr=%p: reset fail, teardown", dev->device));
+                eth_device_teardown(dev);
             }
         }
         return true;
@@ -88,34 +185,6 @@ bool eth_xmit_fatal_error(eth_device_t *dev, uint8_t retries){
     return false;
 }
 
-void timeout_change_default_netif(void *arg){
-    // if link is stale for 5000ms, disable device, unregister interface
-    eth_device_t *dev = (eth_device_t *)arg;
-    if(netif_is_link_up(&dev->iface)) return;
-    if(netif_default != &dev->iface) return;
-    
-    // if this is the default interface
-    uint8_t ifname[] = "en0";       // try to set a new one
-    uint8_t ifnum_check = 0;
-    for (ifnum_check = 0; ifnum_check < NETIFS_MAX_ALLOWED; ifnum_check++){
-        if(dev->iface.num == ifnum_check) continue;     // skip netif now offline
-        if (CHECK_BIT(ifnums_used, ifnum_check)){       // if netif is registered
-            ifname[2] = ifnum_check;
-            struct netif *new_default = netif_find(ifname);
-            if(netif_is_link_up(new_default)) {         // if link is up
-                netif_set_default(new_default);         // set new default
-                LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_STATE,
-                            ("INFO: setting new default, netif=%c%c%u", new_default->name[0], new_default->name[1], new_default->num));
-                return;
-            }
-        }
-    }
-    netif_set_default(NULL);
-    LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_STATE,
-                ("INFO: setting new default, netif=NULL"));
-}
-
-
 ///---------------------------------------------------
 /// @brief interrupt transfer callback function
 usb_error_t
@@ -126,16 +195,24 @@ interrupt_receive_callback(__attribute__((unused)) usb_endpoint_t endpoint,
 {
     eth_device_t *dev = (eth_device_t *)data;
     uint8_t *ibuf = dev->interrupt.buf;
-    static uint8_t int_retries = 0;
+    dev->interrupt.busy = false;
+    if (dev->detached)
+    {
+        eth_device_free(dev);
+        return USB_SUCCESS;
+    }
+    if (eth_xfer_cancelled(status))
+        return USB_SUCCESS;
     if (status)
     {
         // much like RX, we will retry a INT USB_CDC_MAX_RETRIES times
-        if(eth_xmit_fatal_error(dev, int_retries))
+        if(eth_xmit_fatal_error(dev, dev->retries.interrupt))
             return USB_ERROR_FAILED;
         LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_LEVEL_SERIOUS,
-                    ("ERROR: int endpoint failure, retry=%u", int_retries));
-        // increment TX retry counter and queue the transfer again
-        int_retries++;
+                    ("ERROR: int endpoint failure, retry=%u", dev->retries.interrupt));
+        // increment INT retry counter and queue the transfer again
+        dev->retries.interrupt++;
+        dev->stats.retries++;
     } else if ((status == USB_TRANSFER_COMPLETED) && transferred)
     {
         usb_control_setup_t *notify;
@@ -152,19 +229,19 @@ interrupt_receive_callback(__attribute__((unused)) usb_endpoint_t endpoint,
                             netif_set_link_up(&dev->iface);
                             LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_STATE,
                                         ("INFO: netif=%c%c%u, link up", dev->iface.name[0], dev->iface.name[1], dev->iface.num));
+                            // bond ports report to the bond through their link callback
+                            if(dev->bond)
+                                break;
                             if(eth_conf.do_dhcp_auto)
                                 dhcp_start(&dev->iface);
-                            if(!netif_default){
-                                LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_STATE,
-                                            ("INFO: setting new default, netif=%c%c%u", dev->iface.name[0], dev->iface.name[1], dev->iface.num));
-                                netif_set_default(&dev->iface);
-                            }
+                            eth_link_up(&dev->iface);
                         }
                         else if((!notify->wValue) && netif_is_link_up(&dev->iface)){
                             netif_set_link_down(&dev->iface);
                             LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_STATE,
                                         ("INFO: netif=%c%c%u, link down", dev->iface.name[0], dev->iface.name[1], dev->iface.num));
-                            sys_timeout(5000, timeout_change_default_netif, dev);
+                            if(!dev->bond)
+                                eth_link_down(&dev->iface);
                         }
                         break;
                     case NOTIFY_CONNECTION_SPEED_CHANGE:
@@ -174,12 +251,256 @@ interrupt_receive_callback(__attribute__((unused)) usb_endpoint_t endpoint,
             }
             bytes_parsed += sizeof(usb_control_setup_t) + notify->wLength;
         } while (bytes_parsed < transferred);
-        int_retries = 0;
+        dev->retries.interrupt = 0;
     }
-    usb_ScheduleInterruptTransfer(dev->interrupt.endpoint, dev->interrupt.buf, INTERRUPT_RX_MAX, interrupt_receive_callback, data);
+    dev->interrupt.busy = (usb_ScheduleInterruptTransfer(dev->interrupt.endpoint, dev->interrupt.buf, dev->interrupt.size,
+                                                         interrupt_receive_callback, data) == USB_SUCCESS);
     return USB_SUCCESS;
 }
 
+/****************************************************************************
+ * TX queue
+ * Each device queues up to tx.depth transfers in a ring of slots. When the
+ * ring is full, linkoutput returns ERR_MEM, and TCP output is restarted once
+ * a slot is free again.
+ * Frames that something is waiting on (ARP, ICMP, DNS and pure TCP ACKs) are
+ * urgent: they go ahead of queued bulk transfers, and ETH_TX_URGENT_SLOTS
+ * more slots are kept for them, so a bulk upload does not hold them back.
+ * Only ETH_TX_BULK_INFLIGHT bulk transfers per device are handed to the host
+ * controller at a time, the rest wait in the ring where urgent ones can pass.
+ * Queued transfers go to the host controller through a deficit round-robin
+ * scheduler, at most ETH_TX_INFLIGHT_MAX at a time over all devices. Each
+ * device in turn may dispatch tx_weights[ifnum] * ETH_TX_QUANTUM bytes, so a
+ * busy adapter cannot take every transfer the controller has room for.
+ */
+
+static uint8_t eth_tx_turn = 0;         // ifnum whose turn it is to dispatch
+static bool eth_tx_topped = false;      // that device got its quantum for this turn
+
+///---------------------------------------------------
+/// @brief returns true for a frame sent ahead of bulk data
+/// ARP, ICMP/ICMPv6, UDP to or from port 53 and pure TCP ACKs (no payload and none
+/// of SYN, FIN or RST); IPv4 fragments are bulk - the headers must be in the first pbuf
+bool eth_tx_urgent(struct pbuf *p)
+{
+    const uint8_t *frame = (const uint8_t *)p->payload;
+    const uint8_t *ip = frame + SIZEOF_ETH_HDR;
+    const uint8_t *l4;
+    uint16_t l4_len;
+    uint8_t proto;
+    if (p->len < SIZEOF_ETH_HDR)
+        return false;
+    uint16_t type = (frame[12] << 8) | frame[13];
+    if (type == ETHTYPE_ARP)
+        return true;
+    if ((type == ETHTYPE_IP) && (p->len >= SIZEOF_ETH_HDR + IP_HLEN))
+    {
+        // fragments are bulk, later ones carry no transport header
+        if (eth_ip4_fragment(ip))
+            return false;
+        l4 = ip + (ip[0] & 0x0f) * 4;
+        l4_len = ((ip[2] << 8) | ip[3]) - (l4 - ip);
+        proto = ip[9];
+    }
+    else if ((type == ETHTYPE_IPV6) && (p->len >= SIZEOF_ETH_HDR + IP6_HLEN))
+    {
+        // extension headers are not followed, those frames are bulk
+        l4 = ip + IP6_HLEN;
+        l4_len = (ip[4] << 8) | ip[5];
+        proto = ip[6];
+    }
+    else
+        return false;
+    if ((proto == IP_PROTO_ICMP) || (proto == IP6_NEXTH_ICMP6))
+        return true;
+    if ((proto == IP_PROTO_UDP) && (l4 + UDP_HLEN <= frame + p->len))
+        return (l4[0] == 0 && l4[1] == 53) || (l4[2] == 0 && l4[3] == 53);
+    if ((proto == IP_PROTO_TCP) && (l4 + TCP_HLEN <= frame + p->len))
+        return ((l4[13] & (TCP_SYN | TCP_FIN | TCP_RST)) == 0) && (l4_len == (l4[12] >> 4) * 4);
+    return false;
+}
+
+///---------------------------------------------------
+/// @brief returns true if no tx slot is free for a transfer, and marks tx as blocked
+bool eth_tx_full(eth_device_t *dev, bool urgent)
+{
+    if (dev->tx.pending < dev->tx.depth + (urgent ? ETH_TX_URGENT_SLOTS : 0))
+        return false;
+    dev->tx.blocked = true;
+    dev->stats.tx_full++;
+    return true;
+}
+
+///---------------------------------------------------
+/// @brief bulk out callback function
+usb_error_t bulk_transmit_callback(__attribute__((unused)) usb_endpoint_t endpoint,
+                                   usb_transfer_status_t status,
+                                   __attribute__((unused)) size_t transferred,
+                                   usb_transfer_data_t *data);
+
+///---------------------------------------------------
+/// @brief returns the i-th slot in use, counting from the oldest
+#define eth_tx_slot(dev, i) (&(dev)->tx.slots[((dev)->tx.head + (i)) % ((dev)->tx.depth + ETH_TX_URGENT_SLOTS)])
+
+///---------------------------------------------------
+/// @brief drops the oldest queued transfer of a device, the ones behind it move up
+void eth_tx_drop(eth_device_t *dev)
+{
+    struct eth_tx_slot *slot = eth_tx_slot(dev, dev->tx.scheduled);
+    if (dev->tx.urgent)
+        dev->tx.urgent--;
+    pbuf_remove_header(slot->p, slot->hlen);
+    pbuf_free(slot->p);
+    for (uint8_t i = dev->tx.scheduled + 1; i < dev->tx.pending; i++)
+        *eth_tx_slot(dev, i - 1) = *eth_tx_slot(dev, i);
+    dev->tx.pending--;
+    eth_tx_slot(dev, dev->tx.pending)->p = NULL;
+    LINK_STATS_INC(link.drop);
+}
+
+///---------------------------------------------------
+/// @brief drops every queued transfer of a device, for teardown and resume
+/// @note Transfers on the host controller are released by their cancelled callbacks.
+void eth_tx_discard(eth_device_t *dev)
+{
+    while (dev->tx.pending > dev->tx.scheduled)
+        eth_tx_drop(dev);
+}
+
+///---------------------------------------------------
+/// @brief hands queued transfers to the host controller, deficit round-robin over the devices
+void eth_tx_dispatch(void)
+{
+    uint8_t busy = 0;
+    for (uint8_t i = 0; i < NETIFS_MAX_ALLOWED; i++)
+        if (eth_devices[i])
+            busy += eth_devices[i]->tx.busy;
+    // stop after a round in which no device could dispatch
+    for (uint8_t idle = 0; (busy < ETH_TX_INFLIGHT_MAX) && (idle <= NETIFS_MAX_ALLOWED);)
+    {
+        eth_device_t *dev = eth_devices[eth_tx_turn];
+        struct eth_tx_slot *slot = NULL;
+        // an urgent transfer is next whenever any is queued, bulk ones wait for the endpoint
+        if (dev && (dev->tx.pending > dev->tx.scheduled) &&
+            (dev->tx.urgent || (dev->tx.busy < ETH_TX_BULK_INFLIGHT)))
+        {
+            slot = eth_tx_slot(dev, dev->tx.scheduled);
+            if (!eth_tx_topped)
+            {
+                uint8_t weight = eth_conf.tx_weights[eth_tx_turn];
+                dev->tx.deficit += (uint32_t)(weight ? weight : 1) * ETH_TX_QUANTUM;
+                eth_tx_topped = true;
+            }
+        }
+        if (slot && (slot->p->tot_len <= dev->tx.deficit))
+        {
+            dev->tx.deficit -= slot->p->tot_len;
+            if (usb_ScheduleBulkTransfer(dev->tx.endpoint, slot->p->payload, slot->p->tot_len, bulk_transmit_callback, slot))
+                eth_tx_drop(dev);
+            else
+            {
+                if (dev->tx.urgent)
+                    dev->tx.urgent--;
+                dev->tx.scheduled++;
+                dev->tx.busy++;
+                dev->stats.bytes_out += slot->p->tot_len;
+                busy++;
+            }
+            idle = 0;
+            continue;
+        }
+        // turn over, a device with nothing queued keeps no credit
+        if (dev && (dev->tx.pending == dev->tx.scheduled))
+            dev->tx.deficit = 0;
+        eth_tx_topped = false;
+        eth_tx_turn = (eth_tx_turn + 1) % NETIFS_MAX_ALLOWED;
+        idle++;
+    }
+}
+
+///---------------------------------------------------
+/// @brief queues a contiguous buffer for TX, takes ownership of @b p
+/// @param hlen link headers added to @b p in place, removed again when the transfer completes
+/// @param urgent queue ahead of bulk transfers, may take the slots kept for urgent frames
+err_t eth_tx_enqueue(eth_device_t *dev, struct pbuf *p, uint16_t hlen, bool urgent)
+{
+    uint8_t at = dev->tx.pending;
+    // a bulk frame must not take the slots kept for urgent ones
+    if (eth_tx_full(dev, urgent))
+    {
+        pbuf_remove_header(p, hlen);
+        pbuf_free(p);
+        return ERR_MEM;
+    }
+    if (urgent)
+    {
+        // behind the urgent transfers already queued, bulk ones move back
+        at = dev->tx.scheduled + dev->tx.urgent;
+        for (uint8_t i = dev->tx.pending; i > at; i--)
+            *eth_tx_slot(dev, i) = *eth_tx_slot(dev, i - 1);
+        dev->tx.urgent++;
+    }
+    struct eth_tx_slot *slot = eth_tx_slot(dev, at);
+    slot->dev = dev;
+    slot->p = p;
+    slot->hlen = hlen;
+    slot->queued = sys_now();
+    dev->tx.pending++;
+    eth_tx_dispatch();
+    return ERR_OK;
+}
+
+///---------------------------------------------------
+/// @brief frees a tx slot, restarts output if tx was blocked
+/// A torn down device is freed with its last transfer.
+void eth_tx_complete(struct eth_tx_slot *slot)
+{
+    eth_device_t *dev = slot->dev;
+    pbuf_remove_header(slot->p, slot->hlen);
+    pbuf_free(slot->p);
+    slot->p = NULL;
+    dev->tx.busy--;
+    if (dev->detached)
+    {
+        // the freed transfer may go to another device
+        eth_tx_dispatch();
+        eth_device_free(dev);
+        return;
+    }
+    // transfers on one endpoint complete in order, but release a gap left by one that did not
+    while (dev->tx.scheduled && (dev->tx.slots[dev->tx.head].p == NULL))
+    {
+        dev->tx.head = (dev->tx.head + 1) % (dev->tx.depth + ETH_TX_URGENT_SLOTS);
+        dev->tx.scheduled--;
+        dev->tx.pending--;
+    }
+    // send NCM datagrams that were waiting for a slot
+    if ((dev->type == USB_NCM_SUBCLASS) && dev->ncm->tx.count)
+        ncm_tx_flush(dev);
+    // the freed transfer may go to another device
+    eth_tx_dispatch();
+    if (dev->tx.blocked)
+    {
+        dev->tx.blocked = false;
+#if LWIP_TCP
+        tcp_txnow();
+#endif
+    }
+}
+
+///---------------------------------------------------
+/// @brief counts a completed tx transfer in the latency histogram
+void eth_tx_latency(eth_device_t *dev, uint32_t ms)
+{
+    uint8_t bucket = 0;
+    while (ms && (bucket < ETH_TX_LATENCY_BUCKETS - 1))
+    {
+        ms >>= 1;
+        bucket++;
+    }
+    dev->stats.tx_latency[bucket]++;
+}
+
 ///---------------------------------------------------
 /// @brief bulk out callback function
 usb_error_t bulk_transmit_callback(__attribute__((unused)) usb_endpoint_t endpoint,
@@ -188,318 +509,1690 @@ usb_error_t bulk_transmit_callback(__attribute__((unused)) usb_endpoint_t endpoi
                                    usb_transfer_data_t *data)
 {
     // Handle completion or error of the transfer, if needed
-    eth_device_t *dev = (eth_device_t *)data;
-    static uint8_t tx_retries = 0;
+    struct eth_tx_slot *slot = (struct eth_tx_slot *)data;
+    eth_device_t *dev = slot->dev;
+    if (eth_xfer_cancelled(status) || dev->detached)
+    {
+        eth_tx_complete(slot);
+        return USB_SUCCESS;
+    }
     if (status)
     {
         // much like RX, we will retry a TX USB_CDC_MAX_RETRIES times
-        struct pbuf *tbuf = (struct pbuf*)data;
-        if(eth_xmit_fatal_error(dev, tx_retries)){
-            pbuf_free(data);
+        if(dev->retries.tx == eth_conf.max_retries){
+            eth_tx_complete(slot);
+            eth_xmit_fatal_error(dev, dev->retries.tx);
             return USB_ERROR_FAILED;
         }
         LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_LEVEL_SERIOUS,
-                    ("INFO: tx endpoint failure, retry=%u", tx_retries));
+                    ("INFO: tx endpoint failure, retry=%u", dev->retries.tx));
         // increment TX retry counter and queue the transfer again
-        tx_retries++;
-        usb_ScheduleBulkTransfer(dev->tx.endpoint, tbuf->payload, tbuf->tot_len, bulk_transmit_callback, tbuf);
+        dev->retries.tx++;
+        dev->stats.retries++;
+        if (usb_ScheduleBulkTransfer(dev->tx.endpoint, slot->p->payload, slot->p->tot_len, bulk_transmit_callback, slot))
+            eth_tx_complete(slot);
         return USB_SUCCESS;
     }
-    if (data)
-        pbuf_free(data);
-    
+    dev->retries.tx = 0;
+    eth_tx_latency(dev, sys_now() - slot->queued);
+    eth_tx_complete(slot);
+    return USB_SUCCESS;
+}
+
+/****************************************************************************
+ * Zero-copy RX buffers
+ * USB transfers land directly in these, and each datagram in a buffer is
+ * handed to lwIP as a custom pbuf pointing into it. When lwIP frees the last
+ * datagram pbuf of a buffer, the buffer returns to the device and is queued
+ * again, so every buffer not held by lwIP stays queued on the bulk IN pipe.
+ * lwIP may hold a frame for long (out-of-sequence TCP data, refused data,
+ * reassembly, an application yet to read it), so a buffer whose transfer
+ * completes with no other buffer queued is copied from instead, and queued
+ * again at once. Receive keeps going however many frames lwIP holds.
+ * The buffers come from the lwIP heap, charged to MEM_CAT_RX.
+ */
+
+///------------------------------------------------------------------------
+/// @brief queues every free rx buffer
+void eth_rx_schedule(eth_device_t *dev)
+{
+    struct eth_rx_buf *buf;
+    while ((buf = dev->rx.free))
+    {
+        if (usb_ScheduleBulkTransfer(dev->rx.endpoint, buf->data, dev->rx.size, dev->rx.callback, buf))
+            return;
+        dev->rx.free = buf->next;
+        dev->rx.queued++;
+    }
+}
+
+///------------------------------------------------------------------------
+/// @brief returns an rx buffer with no datagrams in use to its device
+void eth_rx_release(struct eth_rx_buf *buf)
+{
+    eth_device_t *dev = buf->dev;
+    if (dev == NULL)
+    {
+        // device went away while lwIP held this buffer
+        mem_free(buf);
+        return;
+    }
+    buf->next = dev->rx.free;
+    dev->rx.free = buf;
+    eth_rx_schedule(dev);
+}
+
+///------------------------------------------------------------------------
+/// @brief custom pbuf free function, drops a reference to the rx buffer
+void eth_rx_dg_free(struct pbuf *p)
+{
+    struct eth_rx_buf *buf = ((struct eth_rx_dg *)p)->buf;
+    if (--buf->refs == 0)
+        eth_rx_release(buf);
+}
+
+///------------------------------------------------------------------------
+/// @brief wraps a datagram in an rx buffer in a pbuf, NULL if none is left
+struct pbuf *eth_rx_dg_alloc(struct eth_rx_buf *buf, uint8_t dg_num, uint8_t *payload, uint16_t len)
+{
+    if (dg_num >= buf->dev->rx.datagrams)
+        return NULL;
+    struct eth_rx_dg *dg = &buf->dg[dg_num];
+    buf->refs++;
+    return pbuf_alloced_custom(PBUF_RAW, len, PBUF_REF, &dg->pc, payload, len);
+}
+
+/* Number of rx buffers per device, from eth_conf */
+#define eth_rx_buffers() LWIP_MIN(LWIP_MAX(eth_conf.rx_buffers, ETH_RX_BUFFERS_MIN), ETH_RX_BUFFERS_MAX)
+
+///------------------------------------------------------------------------
+/// @brief allocates the rx buffers for a device
+bool eth_rx_alloc(eth_device_t *dev)
+{
+    size_t dg_size = dev->rx.datagrams * sizeof(struct eth_rx_dg);
+    uint8_t count = eth_rx_buffers();
+    dev->rx.free = NULL;
+    dev->rx.queued = 0;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        eth_mem_category(MEM_CAT_RX);
+        struct eth_rx_buf *buf = mem_malloc(sizeof(struct eth_rx_buf) + dg_size + dev->rx.size);
+        dev->rx.bufs[i] = buf;
+        if (buf == NULL)
+            return false;
+        buf->dev = dev;
+        buf->data = (uint8_t *)&buf->dg[dev->rx.datagrams];
+        buf->refs = 0;
+        for (uint8_t j = 0; j < dev->rx.datagrams; j++)
+        {
+            buf->dg[j].pc.custom_free_function = eth_rx_dg_free;
+            buf->dg[j].buf = buf;
+        }
+        buf->next = dev->rx.free;
+        dev->rx.free = buf;
+    }
+    return true;
+}
+
+///------------------------------------------------------------------------
+/// @brief releases the rx buffers of a device
+/// Buffers held by lwIP or by a pending transfer are freed when they come back.
+void eth_rx_detach(eth_device_t *dev)
+{
+    struct eth_rx_buf *buf;
+    // frames still awaiting eth_poll() are dropped
+    while (dev->rx.queue_count)
+    {
+        pbuf_free(dev->rx.queue[dev->rx.queue_head]);
+        dev->rx.queue_head = (dev->rx.queue_head + 1) % ETH_RX_QUEUE_LEN;
+        dev->rx.queue_count--;
+    }
+    for (uint8_t i = 0; i < ETH_RX_BUFFERS_MAX; i++)
+    {
+        if (dev->rx.bufs[i])
+            dev->rx.bufs[i]->dev = NULL;
+        dev->rx.bufs[i] = NULL;
+    }
+    while ((buf = dev->rx.free))
+    {
+        dev->rx.free = buf->next;
+        mem_free(buf);
+    }
+    dev->rx.queued = 0;
+}
+
+/****************************************************************************
+ * Receive filter
+ * Frames not addressed to us are dropped before any pbuf is wrapped around
+ * them. Accepted are our hwaddr, broadcast, IPv6 all-nodes and the multicast
+ * addresses lwIP subscribes through igmp_mac_filter/mld_mac_filter.
+ */
+
+static const uint8_t eth_mcast_allnodes[ETH_HWADDR_LEN] = {0x33, 0x33, 0x00, 0x00, 0x00, 0x01};
+
+/* SetEthernetPacketFilter is mandatory for ECM, NCM reports it in bit 0 of bmNetworkCapabilities */
+#define eth_has_packet_filter(dev) (((dev)->type == USB_ECM_SUBCLASS) || \
+                                    ((dev)->ncm->bm_capabilities & 1))
+
+usb_error_t eth_filter_callback(usb_endpoint_t endpoint, usb_transfer_status_t status,
+                                size_t transferred, usb_transfer_data_t *data);
+
+///------------------------------------------------------------------------
+/// @brief programs the adapter's multicast and packet filters from the multicast table
+/// @note requests are asynchronous, changes made while one is in flight are sent after it
+void eth_filter_sync(eth_device_t *dev)
+{
+    struct eth_hw_filter *f = &dev->filter;
+    usb_error_t error;
+    if (!f->enabled)
+        return;
+    if (f->busy)
+    {
+        f->dirty = true;
+        return;
+    }
+    f->dirty = false;
+    // all-nodes is never reported through mld_mac_filter, so it always takes the first slot
+    bool all_multicast = dev->mcast.overflow || (dev->mcast.count + 1u > f->slots);
+    f->packet_filter = PACKET_TYPE_DIRECTED | PACKET_TYPE_BROADCAST |
+                       (all_multicast ? PACKET_TYPE_ALL_MULTICAST : PACKET_TYPE_MULTICAST);
+    // a bond port receives for the bond's address rather than its own, eth_rx_accept() filters instead
+    if (memcmp(dev->iface.hwaddr, dev->hwaddr, ETH_HWADDR_LEN))
+        f->packet_filter |= PACKET_TYPE_PROMISCUOUS;
+    if (!all_multicast)
+    {
+        uint8_t n = dev->mcast.count + 1;
+        memcpy(f->list[0], eth_mcast_allnodes, ETH_HWADDR_LEN);
+        memcpy(f->list[1], dev->mcast.addr, dev->mcast.count * ETH_HWADDR_LEN);
+        f->setup = (usb_control_setup_t){0b00100001, REQUEST_SET_ETHERNET_MULTICAST_FILTERS, n, 0, n * ETH_HWADDR_LEN};
+        error = usb_ScheduleDefaultControlTransfer(dev->device, &f->setup, f->list, eth_filter_callback, dev);
+    }
+    else if (eth_has_packet_filter(dev))
+    {
+        f->setup = (usb_control_setup_t){0b00100001, REQUEST_SET_ETHERNET_PACKET_FILTER, f->packet_filter, 0, 0};
+        error = usb_ScheduleDefaultControlTransfer(dev->device, &f->setup, NULL, eth_filter_callback, dev);
+    }
+    else
+        return;     // nothing the adapter can filter, rely on eth_rx_accept()
+    f->busy = (error == USB_SUCCESS);
+    if (error)
+        LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_LEVEL_WARNING,
+                    ("INFO: device=%p, filter request failed, error=%u", dev->device, error));
+}
+
+///------------------------------------------------------------------------
+/// @brief completion callback for filter requests, sends the packet filter after the multicast list
+usb_error_t eth_filter_callback(__attribute__((unused)) usb_endpoint_t endpoint,
+                                usb_transfer_status_t status,
+                                __attribute__((unused)) size_t transferred,
+                                usb_transfer_data_t *data)
+{
+    eth_device_t *dev = (eth_device_t *)data;
+    struct eth_hw_filter *f = &dev->filter;
+    bool sent_list = (f->setup.bRequest == REQUEST_SET_ETHERNET_MULTICAST_FILTERS);
+    if (eth_xfer_cancelled(status) || dev->detached)
+    {
+        // reset or unplug, resume reprograms the filters
+        f->busy = false;
+        if (dev->detached)
+            eth_device_free(dev);
+        return USB_SUCCESS;
+    }
+    if (status)
+    {
+        LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_LEVEL_WARNING,
+                    ("INFO: device=%p, filter request %u failed, status=%u", dev->device, f->setup.bRequest, status));
+        // the adapter did not take the list, accept all multicast instead
+        if (sent_list)
+            f->packet_filter = (f->packet_filter & ~PACKET_TYPE_MULTICAST) | PACKET_TYPE_ALL_MULTICAST;
+    }
+    if (sent_list && eth_has_packet_filter(dev))
+    {
+        f->setup = (usb_control_setup_t){0b00100001, REQUEST_SET_ETHERNET_PACKET_FILTER, f->packet_filter, 0, 0};
+        if (usb_ScheduleDefaultControlTransfer(dev->device, &f->setup, NULL, eth_filter_callback, dev) == USB_SUCCESS)
+            return USB_SUCCESS;
+    }
+    f->busy = false;
+    if (f->dirty)
+        eth_filter_sync(dev);
     return USB_SUCCESS;
 }
 
 ///------------------------------------------------------------------------
-/// @brief linkinput callback function for @b Ethernet_Control_Model (ECM)
-usb_error_t ecm_receive_callback(__attribute__((unused)) usb_endpoint_t endpoint,
-                                 usb_transfer_status_t status,
-                                 size_t transferred,
-                                 usb_transfer_data_t *data)
+/// @brief returns the multicast table slot holding addr, or -1
+int eth_mcast_find(const struct eth_mcast *mc, const uint8_t *addr)
+{
+    for (uint8_t i = 0; i < mc->count; i++)
+        if (memcmp(mc->addr[i], addr, ETH_HWADDR_LEN) == 0)
+            return i;
+    return -1;
+}
+
+///------------------------------------------------------------------------
+/// @brief adds or removes a user of a multicast address in a multicast table
+/// @return true if the addresses to accept changed
+bool eth_mcast_apply(struct eth_mcast *mc, const uint8_t *addr, enum netif_mac_filter_action action)
+{
+    int slot = eth_mcast_find(mc, addr);
+    if (action == NETIF_ADD_MAC_FILTER)
+    {
+        if (slot >= 0)
+        {
+            mc->users[slot]++;
+            return false;       // address already programmed
+        }
+        if (mc->count < ETH_MCAST_FILTERS_MAX)
+        {
+            memcpy(mc->addr[mc->count], addr, ETH_HWADDR_LEN);
+            mc->users[mc->count++] = 1;
+        }
+        else
+            mc->overflow++;     // table full, fall back to accepting all multicast
+    }
+    else if (slot < 0)
+    {
+        if (mc->overflow)
+            mc->overflow--;
+    }
+    else if (--mc->users[slot] == 0)
+    {
+        // move the last address into the freed slot
+        mc->count--;
+        memcpy(mc->addr[slot], mc->addr[mc->count], ETH_HWADDR_LEN);
+        mc->users[slot] = mc->users[mc->count];
+    }
+    else
+        return false;           // address still in use
+    return true;
+}
+
+///------------------------------------------------------------------------
+/// @brief adds or removes a user of a multicast address on a device
+err_t eth_mcast_update(eth_device_t *dev, const uint8_t *addr, enum netif_mac_filter_action action)
+{
+    if (eth_mcast_apply(&dev->mcast, addr, action))
+        eth_filter_sync(dev);
+    return ERR_OK;
+}
+
+err_t eth_bond_mcast_update(struct netif *netif, const uint8_t *addr, enum netif_mac_filter_action action);
+err_t eth_bond_linkoutput(struct netif *netif, struct pbuf *p);
+
+/* igmp/mld filters of the bond go to all of its ports */
+#define eth_netif_mcast_update(netif, addr, action) \
+    (((netif)->linkoutput == eth_bond_linkoutput) ? eth_bond_mcast_update((netif), (addr), (action)) \
+                                                  : eth_mcast_update((eth_device_t *)(netif)->state, (addr), (action)))
+
+#if LWIP_IPV4 && LWIP_IGMP
+///------------------------------------------------------------------------
+/// @brief igmp_mac_filter callback, maps the group to 01:00:5e plus its low 23 bits
+err_t eth_igmp_mac_filter(struct netif *netif, const ip4_addr_t *group, enum netif_mac_filter_action action)
+{
+    uint8_t addr[ETH_HWADDR_LEN] = {0x01, 0x00, 0x5e, ip4_addr2(group) & 0x7f, ip4_addr3(group), ip4_addr4(group)};
+    return eth_netif_mcast_update(netif, addr, action);
+}
+#endif
+
+#if LWIP_IPV6 && LWIP_IPV6_MLD
+///------------------------------------------------------------------------
+/// @brief mld_mac_filter callback, maps the group to 33:33 plus its low 32 bits
+err_t eth_mld_mac_filter(struct netif *netif, const ip6_addr_t *group, enum netif_mac_filter_action action)
+{
+    const uint8_t *ip = (const uint8_t *)&group->addr[3];
+    uint8_t addr[ETH_HWADDR_LEN] = {0x33, 0x33, ip[0], ip[1], ip[2], ip[3]};
+    return eth_netif_mcast_update(netif, addr, action);
+}
+#endif
+
+///------------------------------------------------------------------------
+/// @brief checks the destination of a received frame, counts a drop if it is not for us
+bool eth_rx_accept(eth_device_t *dev, const uint8_t *frame, size_t len)
+{
+    bool accept;
+    if (len < SIZEOF_ETH_HDR)
+        accept = false;
+    else if (!(frame[0] & 0x01))
+        accept = (memcmp(frame, dev->iface.hwaddr, ETH_HWADDR_LEN) == 0);
+    else
+        accept = dev->mcast.overflow ||
+                 (memcmp(frame, ethbroadcast.addr, ETH_HWADDR_LEN) == 0) ||
+                 (memcmp(frame, eth_mcast_allnodes, ETH_HWADDR_LEN) == 0) ||
+                 (eth_mcast_find(&dev->mcast, frame) >= 0);
+    if (!accept)
+    {
+        dev->stats.filtered++;
+        LINK_STATS_INC(link.drop);
+        MIB2_STATS_NETIF_INC(&dev->iface, ifindiscards);
+    }
+    return accept;
+}
+
+/****************************************************************************
+ * Deferred input
+ * With do_deferred_input set, received frames are queued per device instead
+ * of running the stack from inside usb_HandleEvents(). eth_poll() hands them
+ * to lwIP round-robin across devices, at most budget frames per call.
+ */
+
+///------------------------------------------------------------------------
+/// @brief hands a received frame to lwIP, or queues it for eth_poll()
+void eth_input(eth_device_t *dev, struct pbuf *p)
+{
+    // devices attached before deferred input was enabled have no queue
+    if (eth_conf.do_deferred_input && dev->rx.queue)
+    {
+        if (dev->rx.queue_count < ETH_RX_QUEUE_LEN)
+        {
+            dev->rx.queue[(dev->rx.queue_head + dev->rx.queue_count) % ETH_RX_QUEUE_LEN] = p;
+            dev->rx.queue_count++;
+            dev->stats.frames_in++;
+            return;
+        }
+        // queue full, eth_poll() is not keeping up
+        dev->stats.queue_drops++;
+        LINK_STATS_INC(link.drop);
+        pbuf_free(p);
+        return;
+    }
+    dev->stats.frames_in++;
+    if (dev->iface.input(p, &dev->iface) != ERR_OK)
+        pbuf_free(p);
+}
+
+static uint8_t eth_poll_next = 0;
+
+unsigned int eth_poll(unsigned int budget)
+{
+    unsigned int done = 0;
+    bool queued = true;
+    // one frame per device per pass, until the budget is spent or all queues are empty
+    while (queued && (done < budget))
+    {
+        queued = false;
+        for (uint8_t i = 0; (i < NETIFS_MAX_ALLOWED) && (done < budget); i++)
+        {
+            eth_device_t *dev = eth_devices[(eth_poll_next + i) % NETIFS_MAX_ALLOWED];
+            if ((dev == NULL) || (dev->rx.queue_count == 0))
+                continue;
+            struct pbuf *p = dev->rx.queue[dev->rx.queue_head];
+            dev->rx.queue_head = (dev->rx.queue_head + 1) % ETH_RX_QUEUE_LEN;
+            queued |= (--dev->rx.queue_count != 0);
+            if (dev->iface.input(p, &dev->iface) != ERR_OK)
+                pbuf_free(p);
+            done++;
+        }
+    }
+    // start with the next device next time
+    eth_poll_next = (eth_poll_next + 1) % NETIFS_MAX_ALLOWED;
+    return done;
+}
+
+///------------------------------------------------------------------------
+/// @brief linkinput callback function for @b Ethernet_Control_Model (ECM)
+usb_error_t ecm_receive_callback(__attribute__((unused)) usb_endpoint_t endpoint,
+                                 usb_transfer_status_t status,
+                                 size_t transferred,
+                                 usb_transfer_data_t *data)
+{
+    struct eth_rx_buf *buf = (struct eth_rx_buf *)data;
+    eth_device_t *dev = buf->dev;
+    if (dev == NULL)
+    {
+        // device went away while this transfer was pending
+        mem_free(buf);
+        return USB_SUCCESS;
+    }
+    dev->rx.queued--;
+    if (eth_xfer_cancelled(status))
+    {
+        // back to the free list, requeued on resume or freed on teardown
+        eth_rx_release(buf);
+        return USB_SUCCESS;
+    }
+    if (status)
+    {
+        // on the free list whatever the error leads to: requeued by the retry or on resume,
+        // freed on teardown
+        buf->next = dev->rx.free;
+        dev->rx.free = buf;
+        if(eth_xmit_fatal_error(dev, dev->retries.rx))
+            return USB_ERROR_FAILED;
+        
+        LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_LEVEL_SERIOUS,
+                    ("INFO: rx endpoint failure, retry=%u", dev->retries.rx));
+        dev->retries.rx++;
+        dev->stats.retries++;
+        eth_rx_schedule(dev);
+        return USB_SUCCESS;
+    } else if (transferred)
+    {
+        dev->retries.rx = 0;
+        dev->stats.bytes_in += transferred;
+        LINK_STATS_INC(link.recv);
+        MIB2_STATS_NETIF_ADD(&dev->iface, ifinoctets, transferred);
+        if (!eth_rx_accept(dev, buf->data, transferred))
+        {
+            // not for us, requeue the buffer without touching the heap
+            eth_rx_release(buf);
+            return USB_SUCCESS;
+        }
+        struct pbuf *p;
+        if (dev->rx.queued)
+        {
+            // wrap the buffer in a pbuf, no copy
+            // the other rx buffers are still queued, this one requeues when lwIP frees it
+            p = eth_rx_dg_alloc(buf, 0, buf->data, transferred);
+        }
+        else
+        {
+            // the last buffer is not handed to lwIP, copy the frame and requeue it
+            if ((p = pbuf_alloc(PBUF_RAW, (u16_t)transferred, PBUF_POOL)))
+                pbuf_take(p, buf->data, (u16_t)transferred);
+            else
+            {
+                LINK_STATS_INC(link.memerr);
+                dev->stats.alloc_fails++;
+            }
+            eth_rx_release(buf);
+            if (p == NULL)
+                return USB_SUCCESS;
+        }
+        eth_input(dev, p);
+    } else
+    {
+        // empty transfer, requeue the buffer
+        eth_rx_release(buf);
+    }
+    return USB_SUCCESS;
+}
+
+///----------------------------------------------------------------
+/// @brief linkoutput function for @b Ethernet_Control_Model (ECM)
+err_t ecm_bulk_transmit(struct netif *netif, struct pbuf *p)
+{
+    eth_device_t *dev = (eth_device_t *)netif->state;
+    bool urgent = eth_tx_urgent(p);
+    if (p->tot_len > ETHERNET_MTU)
+        return ERR_MEM;
+    if (eth_tx_full(dev, urgent))
+        return ERR_MEM;
+    dev->stats.frames_out++;
+    if (urgent)
+        dev->stats.urgent++;
+    LINK_STATS_INC(link.xmit);
+    // Update SNMP stats(only if you use SNMP)
+    MIB2_STATS_NETIF_ADD(netif, ifoutoctets, p->tot_len);
+    
+    // a contiguous frame is sent as is, held by reference until the transfer completes
+    // volatile payloads (PBUF_REF) may change after we return, so those are copied
+    if ((p->len == p->tot_len) && (!PBUF_NEEDS_COPY(p)))
+    {
+        pbuf_ref(p);
+        return eth_tx_enqueue(dev, p, 0, urgent);
+    }
+    
+    // else linearize the chain into a new buffer
+    eth_mem_category(MEM_CAT_TX);
+    struct pbuf *tbuf = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_RAM);
+    if (tbuf == NULL)
+    {
+        LINK_STATS_INC(link.memerr);
+        dev->stats.alloc_fails++;
+        return ERR_MEM;
+    }
+    if (pbuf_copy(tbuf, p))
+    {
+        pbuf_free(tbuf);
+        return ERR_MEM;
+    }
+    return eth_tx_enqueue(dev, tbuf, 0, urgent);
+}
+
+/****************************************************************************
+ * Code for Network Control Model (NCM)
+ * for USB-Ethernet devices
+ */
+
+/* Flag Values for NCM Network Capabilities. */
+enum _cdc_ncm_bm_networkcapabilities
+{
+    CAPABLE_ETHERNET_PACKET_FILTER,
+    CAPABLE_NET_ADDRESS,
+    CAPABLE_ENCAPSULATED_RESPONSE,
+    CAPABLE_MAX_DATAGRAM,
+    CAPABLE_CRC_MODE,
+    CAPABLE_NTB_INPUT_SIZE_8BYTE
+};
+/* Helper Macro for Returning State of Network Capabilities Flag. */
+#define ncm_device_supports(dev, bm) (((dev)->ncm->bm_capabilities >> (bm)) & 1)
+
+/* Data Structure for NTB Config control request. */
+struct _ntb_config_data
+{
+    uint32_t dwNtbInMaxSize;
+    uint16_t wNtbInMaxDatagrams;
+    uint16_t reserved;
+};
+
+/* NTB formats (bmNtbFormatsSupported bits, SetNtbFormat wValue) */
+#define NCM_NTB_FORMATS_32 (1 << 1)
+enum _ncm_ntb_format
+{
+    NTB_FORMAT_16,
+    NTB_FORMAT_32
+};
+
+/* NCM Transfer Header (NTH) Defintion */
+#define NCM_NTH_SIG 0x484D434E
+struct ncm_nth
+{
+    uint32_t dwSignature;   // "NCMH"
+    uint16_t wHeaderLength; // size of this header structure (should be 12 for NTB-16)
+    uint16_t wSequence;     // counter for NTB's sent
+    uint16_t wBlockLength;  // size of the NTB
+    uint16_t wNdpIndex;     // offset to first NDP
+};
+
+/* NTB-32 Transfer Header */
+#define NCM_NTH32_SIG 0x686D636E
+struct ncm_nth32
+{
+    uint32_t dwSignature;   // "ncmh"
+    uint16_t wHeaderLength; // size of this header structure (16 for NTB-32)
+    uint16_t wSequence;     // counter for NTB's sent
+    uint32_t dwBlockLength; // size of the NTB
+    uint32_t dwNdpIndex;    // offset to first NDP
+};
+
+/* NCM Datagram Pointers (NDP) Definition */
+struct ncm_ndp_idx
+{
+    uint16_t wDatagramIndex; // offset of datagram, if 0, then is end of datagram list
+    uint16_t wDatagramLen;   // length of datagram, if 0, then is end of datagram list
+};
+#define NCM_NDP_SIG0 0x304D434E
+#define NCM_NDP_SIG1 0x314D434E
+struct ncm_ndp
+{
+    uint32_t dwSignature;               // "NCM0"
+    uint16_t wLength;                   // size of NDP16
+    uint16_t wNextNdpIndex;             // offset to next NDP16
+    struct ncm_ndp_idx wDatagramIdx[1]; // pointer to end of NDP
+};
+
+/* NTB-32 Datagram Pointers */
+struct ncm_ndp32_idx
+{
+    uint32_t dwDatagramIndex; // offset of datagram, if 0, then is end of datagram list
+    uint32_t dwDatagramLen;   // length of datagram, if 0, then is end of datagram list
+};
+#define NCM_NDP32_SIG0 0x306D636E
+struct ncm_ndp32
+{
+    uint32_t dwSignature;                   // "ncm0"
+    uint16_t wLength;                       // size of NDP32
+    uint16_t wReserved6;
+    uint32_t dwNextNdpIndex;                // offset to next NDP32
+    uint32_t dwReserved12;
+    struct ncm_ndp32_idx dwDatagramIdx[1];  // pointer to end of NDP
+};
+
+#define NCM_NTH_LEN sizeof(struct ncm_nth)
+#define NCM_NDP_LEN sizeof(struct ncm_ndp)
+#define NCM_NTH32_LEN sizeof(struct ncm_nth32)
+#define NCM_NDP32_LEN sizeof(struct ncm_ndp32)
+
+/* Header sizes for the NTB format in use */
+#define ncm_nth_len(dev) ((dev)->ncm->ntb32 ? NCM_NTH32_LEN : NCM_NTH_LEN)
+#define ncm_ndp_len_for(dev, count) ((dev)->ncm->ntb32 \
+    ? (NCM_NDP32_LEN + ((count) * sizeof(struct ncm_ndp32_idx))) \
+    : (NCM_NDP_LEN + ((count) * sizeof(struct ncm_ndp_idx))))
+
+///------------------------------------------------------------
+/// @brief picks the NTB input size from the adapter's limit and the heap budget
+/// The rx buffers come from the lwIP heap and may take eth_rx_budget() of it, within
+/// NCM_RX_NTB_MIN_SIZE to NCM_RX_NTB_MAX_SIZE. An adapter that cannot send NTBs
+/// that big gets exactly its own limit.
+size_t ncm_rx_ntb_size(uint32_t dev_max)
+{
+    size_t size = LWIP_MIN(eth_rx_budget() / eth_rx_buffers(), NCM_RX_NTB_MAX_SIZE);
+    size = LWIP_MAX(size & ~(size_t)(NCM_RX_NTB_GRANULE - 1), NCM_RX_NTB_MIN_SIZE);
+    if (dev_max && (dev_max < size))
+        size = dev_max;
+    return size;
+}
+
+///------------------------------------------------------------
+/// @brief control setup for @b Network_Control_Model (NCM)
+usb_error_t ncm_control_setup(eth_device_t *eth)
+{
+    if (eth->type != USB_NCM_SUBCLASS)
+        return USB_SUCCESS;
+    size_t transferred;
+    usb_error_t error = 0;
+    struct _ncm *ncm = eth->ncm;
+    struct _ntb_params *params = &ncm->ntb_params;
+    usb_control_setup_t get_ntb_params = {0b10100001, REQUEST_GET_NTB_PARAMETERS, 0, 0, 0x1c};
+    
+    /* Query NTB Parameters for device (NCM devices) */
+    error |= usb_DefaultControlTransfer(eth->device, &get_ntb_params, params, USB_CDC_MAX_RETRIES, &transferred);
+    
+    /* Derive TX aggregation limits from NTB Parameters */
+    if (!params->wNdpOutDivisor)
+        params->wNdpOutDivisor = 1;
+    if (!params->wNdpOutAlignment)
+        params->wNdpOutAlignment = 4;
+    ncm->tx.max_size = LWIP_MIN(params->dwNtbOutMaxSize, NCM_TX_NTB_MAX_SIZE);
+    ncm->tx.max_datagrams = (params->wNtbOutMaxDatagrams && (params->wNtbOutMaxDatagrams < NCM_TX_MAX_DATAGRAMS))
+    ? params->wNtbOutMaxDatagrams
+    : NCM_TX_MAX_DATAGRAMS;
+    
+    /* Select the NTB format - NTB-16 is mandatory, NTB-32 only if configured and offered */
+    /* SetNtbFormat is only valid while the data interface is in alternate setting 0, which it is until init_success */
+    ncm->ntb32 = NCM_RX_NTB32 && (params->bmNtbFormatsSupported & NCM_NTB_FORMATS_32);
+    if (params->bmNtbFormatsSupported & NCM_NTB_FORMATS_32)
+    {
+        usb_control_setup_t set_ntb_format = {0b00100001, REQUEST_SET_NTB_FORMAT, ncm->ntb32 ? NTB_FORMAT_32 : NTB_FORMAT_16, 0, 0};
+        error |= usb_DefaultControlTransfer(eth->device, &set_ntb_format, NULL, USB_CDC_MAX_RETRIES, &transferred);
+    }
+    
+    /* Set NTB Max Input Size and datagrams from the adapter's limit and the heap budget */
+    eth->rx.size = ncm_rx_ntb_size(params->dwNtbInMaxSize);
+    eth->rx.datagrams = LWIP_MAX(LWIP_MIN(eth->rx.size / NCM_RX_BYTES_PER_DATAGRAM, NCM_RX_MAX_DATAGRAMS), 1);
+    usb_control_setup_t ntb_config_request = {0b00100001, REQUEST_SET_NTB_INPUT_SIZE, 0, 0, ncm_device_supports(eth, CAPABLE_NTB_INPUT_SIZE_8BYTE) ? 8 : 4};
+    struct _ntb_config_data ntb_config_data = {eth->rx.size, eth->rx.datagrams, 0};
+    error |= usb_DefaultControlTransfer(eth->device, &ntb_config_request, &ntb_config_data, USB_CDC_MAX_RETRIES, &transferred);
+    LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_STATE,
+                ("INFO: device=%p, NTB-%u input, %u bytes, %u datagrams", eth->device,
+                 ncm->ntb32 ? 32 : 16, (unsigned int)eth->rx.size, eth->rx.datagrams));
+    
+    /* Packet and multicast filters are programmed by eth_filter_sync() once the device is up */
+    
+    return error;
+}
+
+/****************************************************************************
+ * Receive coalescing
+ * Consecutive in-order segments of one TCP/IPv4 flow in an NTB are chained
+ * behind the first segment's headers and handed to lwIP as one segment, so
+ * ip4_input() and tcp_input() run, and lwIP ACKs, once per batch instead of
+ * once per segment. Only pure data segments (ACK, optionally PSH) without IP
+ * options merge, and only with the same ack, window and TCP options
+ * (timestamp values aside).
+ * The merged TCP checksum is derived from the segments' own checksums, so it
+ * still fails in tcp_input() if any of the merged segments was corrupted.
+ */
+
+/* Defines a TCP segment held for coalescing */
+struct eth_gro
+{
+    struct pbuf *p;                 // held segment, later segments' payloads chained behind it
+    uint16_t hlen;                  // Ethernet + IP + TCP header length of the held segment
+    uint16_t payload;               // TCP payload held, all segments
+    uint32_t next_seq;              // sequence number continuing the held payload
+    uint32_t sum;                   // ones' complement sum of the held payload, unfolded
+    uint8_t segments;               // segments held
+};
+
+#if NCM_RX_GRO
+
+#define gro_ip(frame) ((frame) + SIZEOF_ETH_HDR)
+#define gro_tcp(frame) ((frame) + SIZEOF_ETH_HDR + IP_HLEN)
+#define gro_get32(b) (((uint32_t)(b)[0] << 24) | ((uint32_t)(b)[1] << 16) | ((uint32_t)(b)[2] << 8) | (b)[3])
+
+///------------------------------------------------------------
+/// @brief checks whether a frame is a TCP segment that can be coalesced
+/// @return header length (Ethernet + IP + TCP), 0 if the frame is passed on as is
+uint16_t eth_gro_segment(const uint8_t *frame, uint16_t len, uint16_t *payload)
+{
+    const uint8_t *ip = gro_ip(frame);
+    const uint8_t *tcp = gro_tcp(frame);
+    if ((len < SIZEOF_ETH_HDR + IP_HLEN + TCP_HLEN) ||
+        (frame[12] != 0x08) || (frame[13] != 0x00) ||
+        (ip[0] != 0x45) || eth_ip4_fragment(ip) || (ip[9] != IP_PROTO_TCP) ||
+        ((tcp[13] & ~TCP_PSH) != TCP_ACK))
+        return 0;
+    uint16_t ip_len = (ip[2] << 8) | ip[3];
+    uint16_t tcp_hlen = (tcp[12] >> 4) * 4;
+    if ((ip_len > len - SIZEOF_ETH_HDR) || (tcp_hlen < TCP_HLEN) || (IP_HLEN + tcp_hlen >= ip_len))
+        return 0;
+    // a bad IP header would be dropped by ip4_input(), but not once it is merged away
+    if (inet_chksum(ip, IP_HLEN))
+        return 0;
+    *payload = ip_len - IP_HLEN - tcp_hlen;
+    return SIZEOF_ETH_HDR + IP_HLEN + tcp_hlen;
+}
+
+///------------------------------------------------------------
+/// @brief ones' complement sum of the TCP pseudo header of a segment, unfolded
+uint32_t eth_gro_pseudo_sum(const uint8_t *frame, uint16_t tcp_len)
+{
+    return (uint16_t)~inet_chksum(gro_ip(frame) + 12, 8) + PP_HTONS(IP_PROTO_TCP) + lwip_htons(tcp_len);
+}
+
+///------------------------------------------------------------
+/// @brief ones' complement sum of a segment's payload, taken from its checksum
+/// The pseudo header, TCP header (checksum included) and payload of a valid segment sum to 0xffff.
+uint16_t eth_gro_payload_sum(const uint8_t *frame, uint16_t hlen, uint16_t payload)
+{
+    uint16_t tcp_hlen = hlen - SIZEOF_ETH_HDR - IP_HLEN;
+    uint32_t acc = eth_gro_pseudo_sum(frame, tcp_hlen + payload);
+    acc += (uint16_t)~inet_chksum(gro_tcp(frame), tcp_hlen);
+    acc = FOLD_U32T(acc);
+    acc = FOLD_U32T(acc);
+    return (uint16_t)~acc;
+}
+
+///------------------------------------------------------------
+/// @brief checks whether a segment continues the held one
+bool eth_gro_match(struct eth_gro *gro, const uint8_t *frame, uint16_t hlen)
+{
+    const uint8_t *held = (const uint8_t *)gro->p->payload;
+    const uint8_t *tcp = gro_tcp(frame);
+    const uint8_t *held_tcp = gro_tcp(held);
+    size_t opt_len = hlen - SIZEOF_ETH_HDR - IP_HLEN - TCP_HLEN;
+    if ((hlen != gro->hlen) ||
+        memcmp(gro_ip(frame) + 12, gro_ip(held) + 12, 8) ||     // addresses
+        memcmp(tcp, held_tcp, 4) ||                             // ports
+        (gro_get32(tcp + 4) != gro->next_seq) ||
+        memcmp(tcp + 8, held_tcp + 8, 4) ||                     // ack
+        memcmp(tcp + 14, held_tcp + 14, 2))                     // window
+        return false;
+    // NOP, NOP, timestamp is the usual option block, the timestamp values may differ
+    if ((opt_len == 12) && (tcp[TCP_HLEN] == 1) && (tcp[TCP_HLEN + 1] == 1) && (tcp[TCP_HLEN + 2] == 8))
+        opt_len = 4;
+    return memcmp(tcp + TCP_HLEN, held_tcp + TCP_HLEN, opt_len) == 0;
+}
+
+///------------------------------------------------------------
+/// @brief hands the held segment to lwIP, with its headers rewritten if segments were merged
+void eth_gro_flush(eth_device_t *dev, struct eth_gro *gro)
+{
+    struct pbuf *p = gro->p;
+    if (p == NULL)
+        return;
+    gro->p = NULL;
+    if (gro->segments > 1)
+    {
+        uint8_t *frame = (uint8_t *)p->payload;
+        uint8_t *ip = gro_ip(frame);
+        uint8_t *tcp = gro_tcp(frame);
+        uint16_t tcp_hlen = gro->hlen - SIZEOF_ETH_HDR - IP_HLEN;
+        uint16_t ip_len = IP_HLEN + tcp_hlen + gro->payload;
+        uint16_t chksum;
+        ip[2] = ip_len >> 8;
+        ip[3] = ip_len & 0xff;
+        ip[10] = ip[11] = 0;
+        chksum = inet_chksum(ip, IP_HLEN);
+        memcpy(&ip[10], &chksum, 2);
+        // pseudo header and TCP header as rewritten, plus the payloads' sums
+        tcp[16] = tcp[17] = 0;
+        uint32_t acc = eth_gro_pseudo_sum(frame, tcp_hlen + gro->payload) + gro->sum;
+        acc += (uint16_t)~inet_chksum(tcp, tcp_hlen);
+        acc = FOLD_U32T(acc);
+        acc = FOLD_U32T(acc);
+        chksum = (uint16_t)~acc;
+        memcpy(&tcp[16], &chksum, 2);
+    }
+    eth_input(dev, p);
+}
+
+///------------------------------------------------------------
+/// @brief merges a received frame into the held segment, holds it, or hands it to lwIP
+void eth_gro_input(eth_device_t *dev, struct eth_gro *gro, struct pbuf *p, const uint8_t *frame, uint16_t len)
+{
+    uint16_t payload;
+    uint16_t hlen = eth_gro_segment(frame, len, &payload);
+    if (hlen && (p->len >= hlen))
+    {
+        // drop Ethernet padding, it would end up in the middle of the merged payload
+        if (hlen + payload < len)
+            pbuf_realloc(p, hlen + payload);
+        uint16_t sum = eth_gro_payload_sum(frame, hlen, payload);
+        if (gro->p && eth_gro_match(gro, frame, hlen) && (gro->payload + payload <= 0xffff - hlen))
+        {
+            // the held header takes PSH from the segments behind it
+            gro_tcp((uint8_t *)gro->p->payload)[13] |= gro_tcp(frame)[13] & TCP_PSH;
+            // a payload starting at an odd offset adds its sum byte swapped
+            gro->sum += (gro->payload & 1) ? (uint16_t)SWAP_BYTES_IN_WORD(sum) : sum;
+            gro->payload += payload;
+            gro->next_seq += payload;
+            gro->segments++;
+            pbuf_remove_header(p, hlen);
+            pbuf_cat(gro->p, p);
+            dev->stats.coalesced++;
+            return;
+        }
+        eth_gro_flush(dev, gro);
+        *gro = (struct eth_gro){p, hlen, payload, gro_get32(gro_tcp(frame) + 4) + payload, sum, 1};
+        return;
+    }
+    eth_gro_flush(dev, gro);
+    eth_input(dev, p);
+}
+#endif
+
+///------------------------------------------------------------
+/// @brief hands a received datagram to lwIP, in place while datagram pbufs are left and another
+/// rx buffer is queued, else copied
+/// @return false if it could not be allocated
+bool ncm_rx_datagram(eth_device_t *dev, struct eth_rx_buf *buf, uint8_t *wrapped, struct eth_gro *gro,
+                     uint8_t *frame, uint16_t len)
+{
+    // skip datagrams not for us before allocating anything
+    if (!eth_rx_accept(dev, frame, len))
+        return true;
+    // point a pbuf at the datagram in place
+    // if out of datagram pbufs for this buffer, or if no other buffer is queued (lwIP holding
+    // this one could stall receive), fall back to copying it
+    struct pbuf *p = dev->rx.queued ? eth_rx_dg_alloc(buf, *wrapped, frame, len) : NULL;
+    if (p != NULL)
+        (*wrapped)++;
+    else if ((p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL)))
+        pbuf_take(p, frame, len);
+    else
+    {
+        LINK_STATS_INC(link.memerr);
+        dev->stats.alloc_fails++;
+        return false;
+    }
+#if NCM_RX_GRO
+    eth_gro_input(dev, gro, p, frame, len);
+#else
+    eth_input(dev, p);
+#endif
+    return true;
+}
+
+///------------------------------------------------------------
+/// @brief hands the datagrams of a received NTB-16 or NTB-32 to lwIP
+/// The format follows from the NTH signature. Parsing stops at the first
+/// malformed header or entry, the datagrams before it are kept.
+/// @note with NCM_RX_GRO the last TCP segment may still be held in gro
+void ncm_rx_parse(eth_device_t *dev, struct eth_rx_buf *buf, size_t len, struct eth_gro *gro)
+{
+    uint8_t *ntb = buf->data;
+    uint8_t wrapped = 0;
+    uint32_t ndp_index;
+    bool ntb32;
+    
+    // validate NTH signature field. If invalid, skip NTB
+    if ((len >= NCM_NTH_LEN) && (((struct ncm_nth *)ntb)->dwSignature == NCM_NTH_SIG))
+    {
+        ntb32 = false;
+        ndp_index = ((struct ncm_nth *)ntb)->wNdpIndex;
+    }
+    else if ((len >= NCM_NTH32_LEN) && (((struct ncm_nth32 *)ntb)->dwSignature == NCM_NTH32_SIG))
+    {
+        ntb32 = true;
+        ndp_index = ((struct ncm_nth32 *)ntb)->dwNdpIndex;
+    }
+    else
+        return;
+    
+    size_t ndp_len = ntb32 ? NCM_NDP32_LEN : NCM_NDP_LEN;
+    size_t entry_len = ntb32 ? sizeof(struct ncm_ndp32_idx) : sizeof(struct ncm_ndp_idx);
+    while (ndp_index && (ndp_index <= len - ndp_len))
+    {
+        uint8_t *entry;
+        uint32_t next;
+        // validate NDP signature field, if invalid, fail out
+        if (ntb32)
+        {
+            struct ncm_ndp32 *ndp = (struct ncm_ndp32 *)&ntb[ndp_index];
+            if (ndp->dwSignature != NCM_NDP32_SIG0)
+                return;
+            entry = (uint8_t *)ndp->dwDatagramIdx;
+            next = ndp->dwNextNdpIndex;
+        }
+        else
+        {
+            struct ncm_ndp *ndp = (struct ncm_ndp *)&ntb[ndp_index];
+            if (ndp->dwSignature != NCM_NDP_SIG0)
+                return;
+            entry = (uint8_t *)ndp->wDatagramIdx;
+            next = ndp->wNextNdpIndex;
+        }
+        
+        // a null datagram index structure indicates end of NDP
+        for (; entry + entry_len <= &ntb[len]; entry += entry_len)
+        {
+            uint32_t dg_index = ntb32 ? ((struct ncm_ndp32_idx *)entry)->dwDatagramIndex
+                                      : ((struct ncm_ndp_idx *)entry)->wDatagramIndex;
+            uint32_t dg_len = ntb32 ? ((struct ncm_ndp32_idx *)entry)->dwDatagramLen
+                                    : ((struct ncm_ndp_idx *)entry)->wDatagramLen;
+            if ((dg_index == 0) || (dg_len == 0))
+                break;
+            if ((dg_index > len) || (dg_len > len - dg_index))
+                return;
+            if (!ncm_rx_datagram(dev, buf, &wrapped, gro, &ntb[dg_index], dg_len))
+                return;
+        }
+        // NDPs are only followed forward, so a looping chain ends here
+        if (next <= ndp_index)
+            break;
+        ndp_index = next;
+    }
+}
+
+///------------------------------------------------------------
+/// @brief linkinput function for @b Network_Control_Model (NCM)
+usb_error_t ncm_receive_callback(__attribute__((unused)) usb_endpoint_t endpoint,
+                                 usb_transfer_status_t status,
+                                 size_t transferred,
+                                 usb_transfer_data_t *data)
+{
+    struct eth_rx_buf *buf = (struct eth_rx_buf *)data;
+    eth_device_t *dev = buf->dev;
+    if (dev == NULL)
+    {
+        // device went away while this transfer was pending
+        mem_free(buf);
+        return USB_SUCCESS;
+    }
+    dev->rx.queued--;
+    if (eth_xfer_cancelled(status))
+    {
+        // back to the free list, requeued on resume or freed on teardown
+        eth_rx_release(buf);
+        return USB_SUCCESS;
+    }
+    if (status)
+    {
+        // on the free list whatever the error leads to: requeued by the retry or on resume,
+        // freed on teardown
+        buf->next = dev->rx.free;
+        dev->rx.free = buf;
+        if(eth_xmit_fatal_error(dev, dev->retries.rx))
+            return USB_ERROR_FAILED;
+        LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_LEVEL_SERIOUS,
+                        ("INFO: rx endpoint failure, retry=%u", dev->retries.rx));
+        dev->retries.rx++;
+        dev->stats.retries++;
+        eth_rx_schedule(dev);
+        return USB_SUCCESS;
+    }
+    if (transferred)
+    {
+        dev->retries.rx = 0;
+        dev->stats.ntbs_in++;
+        dev->stats.bytes_in += transferred;
+        LINK_STATS_INC(link.recv);
+        MIB2_STATS_NETIF_ADD(&dev->iface, ifinoctets, transferred);
+        
+        // hold the buffer while parsing, so lwIP freeing a datagram early cannot requeue it
+        struct eth_gro gro = {0};
+        buf->refs++;
+        ncm_rx_parse(dev, buf, transferred, &gro);
+#if NCM_RX_GRO
+        eth_gro_flush(dev, &gro);
+#endif
+        buf->refs--;
+    }
+    
+    // if no datagram points into the buffer, it can be requeued right away
+    // else the other rx buffers are still queued, this one requeues when lwIP frees it
+    if (buf->refs == 0)
+        eth_rx_release(buf);
+    return USB_SUCCESS;
+}
+
+/* This code packs queued TX Ethernet frames into a single NCM transfer. */
+#if PBUF_LINK_ENCAPSULATION_HLEN < NCM_TX_HEADROOM
+#warning "PBUF_LINK_ENCAPSULATION_HLEN < NCM_TX_HEADROOM, NCM TX will copy every datagram"
+#endif
+#define ncm_align(offset, divisor, remainder) \
+((offset) + (((remainder) + (divisor) - ((offset) % (divisor))) % (divisor)))
+
+void ncm_tx_flush_timeout(void *arg);
+
+///---------------------------------------------------------------
+/// @brief returns the size of the NTH and NDP (with alignment) for an NTB of @b count datagrams
+size_t ncm_tx_headers_len(eth_device_t *dev, uint8_t count)
+{
+    return ncm_align(ncm_nth_len(dev), dev->ncm->ntb_params.wNdpOutAlignment, 0) + ncm_ndp_len_for(dev, count);
+}
+
+///---------------------------------------------------------------
+/// @brief returns size of the NTB for the queued datagrams, plus @b next if not NULL
+size_t ncm_tx_ntb_size(eth_device_t *dev, struct pbuf *next)
+{
+    struct _ncm *ncm = dev->ncm;
+    struct _ntb_params *params = &ncm->ntb_params;
+    uint8_t count = ncm->tx.count + (next != NULL);
+    size_t offset = ncm_tx_headers_len(dev, count);
+    for (uint8_t i = 0; i < count; i++)
+    {
+        struct pbuf *p = (i < ncm->tx.count) ? ncm->tx.dg[i] : next;
+        offset = ncm_align(offset, params->wNdpOutDivisor, params->wNdpOutPayloadRemainder) + p->tot_len;
+    }
+    return offset;
+}
+
+///---------------------------------------------------------------
+/// @brief frees the queued datagrams without sending them
+void ncm_tx_discard(eth_device_t *dev)
+{
+    struct _ncm *ncm = dev->ncm;
+    sys_untimeout(ncm_tx_flush_timeout, dev);
+    for (uint8_t i = 0; i < ncm->tx.count; i++)
+        pbuf_free(ncm->tx.dg[i]);
+    ncm->tx.count = 0;
+    ncm->tx.urgent = false;
+}
+
+///---------------------------------------------------------------
+/// @brief writes the NTH and NDP for an NTB of @b count datagrams
+/// @return the NDP datagram index table, filled in by the caller with @b ncm_tx_set_datagram
+/// The trailing NDP entry is zeroed, alignment padding after the NDP is not.
+uint8_t *ncm_tx_write_headers(eth_device_t *dev, uint8_t *ntb, size_t ntb_len, uint8_t count)
+{
+    struct _ncm *ncm = dev->ncm;
+    size_t offset_ndp = ncm_align(ncm_nth_len(dev), ncm->ntb_params.wNdpOutAlignment, 0);
+    
+    // only the headers need zeroing, datagrams overwrite the rest
+    memset(ntb, 0, offset_ndp + ncm_ndp_len_for(dev, count));
+    
+    if (ncm->ntb32)
+    {
+        struct ncm_nth32 *nth = (struct ncm_nth32 *)ntb;
+        struct ncm_ndp32 *ndp = (struct ncm_ndp32 *)&ntb[offset_ndp];
+        nth->dwSignature = NCM_NTH32_SIG;
+        nth->wHeaderLength = NCM_NTH32_LEN;
+        nth->wSequence = ncm->sequence++;
+        nth->dwBlockLength = ntb_len;
+        nth->dwNdpIndex = offset_ndp;
+        
+        ndp->dwSignature = NCM_NDP32_SIG0;
+        ndp->wLength = ncm_ndp_len_for(dev, count);
+        return (uint8_t *)&ndp->dwDatagramIdx;
+    }
+    
+    // declare NTH, NDP, and NDP_IDX structures
+    struct ncm_nth *nth = (struct ncm_nth *)ntb;
+    struct ncm_ndp *ndp = (struct ncm_ndp *)&ntb[offset_ndp];
+    
+    // populate structs
+    nth->dwSignature = NCM_NTH_SIG;
+    nth->wHeaderLength = NCM_NTH_LEN;
+    nth->wSequence = ncm->sequence++;
+    nth->wBlockLength = ntb_len;
+    nth->wNdpIndex = offset_ndp;
+    
+    ndp->dwSignature = NCM_NDP_SIG0;
+    ndp->wLength = ncm_ndp_len_for(dev, count);
+    ndp->wNextNdpIndex = 0;
+    return (uint8_t *)&ndp->wDatagramIdx;
+}
+
+///---------------------------------------------------------------
+/// @brief fills in entry @b i of an NDP datagram index table
+void ncm_tx_set_datagram(eth_device_t *dev, uint8_t *table, uint8_t i, size_t index, size_t len)
+{
+    if (dev->ncm->ntb32)
+    {
+        struct ncm_ndp32_idx *idx = &((struct ncm_ndp32_idx *)table)[i];
+        idx->dwDatagramIndex = index;
+        idx->dwDatagramLen = len;
+    }
+    else
+    {
+        struct ncm_ndp_idx *idx = &((struct ncm_ndp_idx *)table)[i];
+        idx->wDatagramIndex = index;
+        idx->wDatagramLen = len;
+    }
+}
+
+///---------------------------------------------------------------
+/// @brief packs the queued datagrams into an NTB and queues the TX
+/// @return false if the TX queue is full or the NTB cannot be allocated, the datagrams
+/// stay queued until a slot frees or the flush timer fires
+bool ncm_tx_flush(eth_device_t *dev)
+{
+    struct _ncm *ncm = dev->ncm;
+    struct _ntb_params *params = &ncm->ntb_params;
+    uint8_t count = ncm->tx.count;
+    bool urgent = ncm->tx.urgent;
+    if (count == 0)
+        return true;
+    if (eth_tx_full(dev, urgent))
+        return false;
+    ncm->tx.urgent = false;
+    sys_untimeout(ncm_tx_flush_timeout, dev);
+    size_t ntb_len = ncm_tx_ntb_size(dev, NULL);
+    struct pbuf *p = ncm->tx.dg[0];
+    
+    // a lone contiguous datagram gets the NTH and NDP written into its own headroom
+    // (PBUF_LINK_ENCAPSULATION_HLEN), and is sent without copying
+    size_t hdr_len = ntb_len - p->tot_len;
+    if ((count == 1) && (p->len == p->tot_len) && (!pbuf_add_header(p, hdr_len)))
+    {
+        uint8_t *table = ncm_tx_write_headers(dev, p->payload, ntb_len, count);
+        size_t headers = ncm_tx_headers_len(dev, count);
+        memset((uint8_t *)p->payload + headers, 0, hdr_len - headers);
+        ncm_tx_set_datagram(dev, table, 0, hdr_len, p->tot_len - hdr_len);
+        ncm->tx.count = 0;
+        dev->stats.ntbs_out++;
+        eth_tx_enqueue(dev, p, hdr_len, urgent);
+        return true;
+    }
+    
+    // allocate TX packet buffer, sized to the NTB actually being sent
+    eth_mem_category(MEM_CAT_TX);
+    struct pbuf *obuf = pbuf_alloc(PBUF_RAW, ntb_len, PBUF_RAM);
+    if (obuf == NULL)
+    {
+        // keep the datagrams for the next TX completion or the flush timer
+        LINK_STATS_INC(link.memerr);
+        dev->stats.alloc_fails++;
+        ncm->tx.urgent = urgent;
+        sys_timeout(NCM_TX_FLUSH_TIMEOUT, ncm_tx_flush_timeout, dev);
+        return false;
+    }
+    uint8_t *ntb = (uint8_t *)obuf->payload;
+    uint8_t *table = ncm_tx_write_headers(dev, ntb, ntb_len, count);
+    size_t offset = ncm_tx_headers_len(dev, count);
+    
+    // copy each datagram to its aligned offset
+    for (uint8_t i = 0; i < count; i++)
+    {
+        p = ncm->tx.dg[i];
+        size_t aligned = ncm_align(offset, params->wNdpOutDivisor, params->wNdpOutPayloadRemainder);
+        memset(&ntb[offset], 0, aligned - offset);
+        offset = aligned;
+        ncm_tx_set_datagram(dev, table, i, offset, p->tot_len);
+        pbuf_copy_partial(p, &ntb[offset], p->tot_len, 0);
+        offset += p->tot_len;
+        pbuf_free(p);
+    }
+    ncm->tx.count = 0;
+    dev->stats.ntbs_out++;
+    
+    // queue the TX
+    eth_tx_enqueue(dev, obuf, 0, urgent);
+    return true;
+}
+
+///---------------------------------------------------------------
+/// @brief timer callback to send a partially filled NTB
+void ncm_tx_flush_timeout(void *arg)
+{
+    ncm_tx_flush((eth_device_t *)arg);
+}
+
+///---------------------------------------------------------------
+/// @brief linkoutput function for @b Network_Control_Model (NCM)
+err_t ncm_bulk_transmit(struct netif *netif, struct pbuf *p)
+{
+    eth_device_t *dev = (eth_device_t *)netif->state;
+    struct _ncm *ncm = dev->ncm;
+    bool urgent = eth_tx_urgent(p);
+    if (p->tot_len > ETHERNET_MTU)
+        return ERR_MEM;
+    
+    // if the datagram does not fit in the pending NTB, send that one first
+    // if that cannot be sent yet, push back until a TX slot frees
+    if (ncm->tx.count &&
+        ((ncm->tx.count >= ncm->tx.max_datagrams) || (ncm_tx_ntb_size(dev, p) > ncm->tx.max_size)))
+    {
+        // an urgent datagram takes the pending NTB along into the urgent slots
+        bool was_urgent = ncm->tx.urgent;
+        ncm->tx.urgent |= urgent;
+        if (!ncm_tx_flush(dev))
+        {
+            ncm->tx.urgent = was_urgent;
+            return ERR_MEM;
+        }
+    }
+    if (ncm_tx_ntb_size(dev, p) > ncm->tx.max_size)
+        return ERR_MEM;
+    
+    // queue the datagram, it is copied into the NTB on flush
+    // volatile payloads (PBUF_REF) may change after we return, so copy those now
+    struct pbuf *q = p;
+    if (PBUF_NEEDS_COPY(p))
+    {
+        eth_mem_category(MEM_CAT_TX);
+        if ((q = pbuf_clone(PBUF_RAW, PBUF_RAM, p)) == NULL)
+        {
+            LINK_STATS_INC(link.memerr);
+            dev->stats.alloc_fails++;
+            return ERR_MEM;
+        }
+    }
+    else
+        pbuf_ref(p);
+    ncm->tx.dg[ncm->tx.count++] = q;
+    ncm->tx.urgent |= urgent;
+    dev->stats.frames_out++;
+    if (urgent)
+        dev->stats.urgent++;
+    LINK_STATS_INC(link.xmit);
+    // Update SNMP stats(only if you use SNMP)
+    MIB2_STATS_NETIF_ADD(netif, ifoutoctets, p->tot_len);
+    
+    // send at once if the pipe is idle, the datagram is urgent or the datagram limit is reached
+    // else aggregate until a TX completes or the flush timer fires
+    if ((dev->tx.pending == 0) || ncm->tx.urgent || (ncm->tx.count >= ncm->tx.max_datagrams))
+        ncm_tx_flush(dev);
+    else if (ncm->tx.count == 1)
+        sys_timeout(NCM_TX_FLUSH_TIMEOUT, ncm_tx_flush_timeout, dev);
+    return ERR_OK;
+}
+
+/****************************************************************************
+ * Link aggregation
+ * A bonding interface (bo8) on top of up to NETIFS_MAX_ALLOWED devices, in
+ * the spirit of bridgeif: one netif carries the IP/MAC identity, the port
+ * netifs only move frames. Transmit flows are spread over the ports with link
+ * up by flow hash, so one TCP/UDP flow stays on one port and in order. Frames
+ * received on any port are input on the bond. The switch on the other end
+ * needs a static LAG over the ports.
+ */
+
+/* Defines the bonding interface */
+struct eth_bond
+{
+    struct netif iface;                             // the bonded interface, holds the IP configuration
+    uint8_t hwaddr[ETH_HWADDR_LEN];                 // MAC address of the bond, taken from its first port
+    eth_device_t *ports[NETIFS_MAX_ALLOWED];        // member devices, by ifnum
+    eth_device_t *active[NETIFS_MAX_ALLOWED];       // members with link up, indexed by flow hash
+    uint8_t active_count;                           // entries in active
+    struct eth_mcast mcast;                         // groups joined on the bond, mirrored to every port
+};
+static struct eth_bond *eth_bond = NULL;
+
+///------------------------------------------------------------------------
+/// @brief returns a hash of the flow a frame belongs to
+/// IPv4/IPv6 source and destination, plus ports for unfragmented TCP and UDP,
+/// other frames hash by destination MAC address
+uint8_t eth_bond_hash(struct pbuf *p)
+{
+    const uint8_t *frame = (const uint8_t *)p->payload;
+    const uint8_t *ip = frame + SIZEOF_ETH_HDR;
+    const uint8_t *bytes = frame;
+    uint8_t len = ETH_HWADDR_LEN;
+    uint8_t proto = 0;
+    uint8_t hash = 0;
+    if (p->len >= SIZEOF_ETH_HDR + IP_HLEN)
+    {
+        uint16_t type = (frame[12] << 8) | frame[13];
+        if (type == ETHTYPE_IP)
+        {
+            // addresses, then ports right after the header unless this is a fragment
+            bytes = ip + 12;
+            len = 8;
+            if (!eth_ip4_fragment(ip))
+                proto = ip[9];
+            ip += (ip[0] & 0x0f) * 4;
+        }
+        else if ((type == ETHTYPE_IPV6) && (p->len >= SIZEOF_ETH_HDR + IP6_HLEN))
+        {
+            // extension headers are not followed, their flows hash by address only
+            bytes = ip + 8;
+            len = 32;
+            proto = ip[6];
+            ip += IP6_HLEN;
+        }
+    }
+    for (uint8_t i = 0; i < len; i++)
+        hash ^= bytes[i];
+    if (((proto == IP_PROTO_TCP) || (proto == IP_PROTO_UDP)) && (ip + 4 <= frame + p->len))
+        hash ^= ip[0] ^ ip[1] ^ ip[2] ^ ip[3];
+    return hash;
+}
+
+///------------------------------------------------------------------------
+/// @brief linkoutput function of the bond, sends the frame on the port its flow hashes to
+err_t eth_bond_linkoutput(struct netif *netif, struct pbuf *p)
+{
+    struct eth_bond *bond = (struct eth_bond *)netif->state;
+    if (bond->active_count == 0)
+        return ERR_IF;
+    eth_device_t *port = bond->active[eth_bond_hash(p) % bond->active_count];
+    MIB2_STATS_NETIF_ADD(netif, ifoutoctets, p->tot_len);
+    if (((uint8_t *)p->payload)[0] & 1)
+        MIB2_STATS_NETIF_INC(netif, ifoutnucastpkts);
+    else
+        MIB2_STATS_NETIF_INC(netif, ifoutucastpkts);
+    return port->iface.linkoutput(&port->iface, p);
+}
+
+///------------------------------------------------------------------------
+/// @brief input function of the port netifs, hands the frame to the bond
+err_t eth_bond_input(struct pbuf *p, struct netif *inp)
+{
+    struct netif *netif = &((eth_device_t *)inp->state)->bond->iface;
+    MIB2_STATS_NETIF_ADD(netif, ifinoctets, p->tot_len);
+    return netif->input(p, netif);
+}
+
+///------------------------------------------------------------------------
+/// @brief igmp/mld filter of the bond, keeps the bond's table and passes changes on to the ports
+err_t eth_bond_mcast_update(struct netif *netif, const uint8_t *addr, enum netif_mac_filter_action action)
+{
+    struct eth_bond *bond = (struct eth_bond *)netif->state;
+    if (!eth_mcast_apply(&bond->mcast, addr, action))
+        return ERR_OK;
+    for (uint8_t i = 0; i < NETIFS_MAX_ALLOWED; i++)
+        if (bond->ports[i])
+            eth_mcast_update(bond->ports[i], addr, action);
+    return ERR_OK;
+}
+
+///------------------------------------------------------------------------
+/// @brief adds (or removes) the bond's multicast addresses to (from) a port's table
+void eth_bond_mcast_mirror(struct eth_bond *bond, eth_device_t *dev, enum netif_mac_filter_action action)
 {
-    eth_device_t *dev = (eth_device_t *)data;
-    uint8_t *recvbuf = dev->rx.buf;
-    static uint8_t rx_retries = 0;
-    if (status)
+    for (uint8_t i = 0; i < bond->mcast.count; i++)
+        eth_mcast_apply(&dev->mcast, bond->mcast.addr[i], action);
+    if (action == NETIF_ADD_MAC_FILTER)
+        dev->mcast.overflow += bond->mcast.overflow;
+    else
+        dev->mcast.overflow -= LWIP_MIN(dev->mcast.overflow, bond->mcast.overflow);
+    eth_filter_sync(dev);
+}
+
+///------------------------------------------------------------------------
+/// @brief rebuilds the list of ports with link up, the bond's link is up while any of them is
+void eth_bond_update(struct eth_bond *bond)
+{
+    struct netif *netif = &bond->iface;
+    eth_device_t *was = bond->active_count ? bond->active[0] : NULL;
+    uint8_t had = bond->active_count;
+    bond->active_count = 0;
+    if (eth_conf.do_bond_standby && was && (was->bond == bond) && netif_is_link_up(&was->iface))
+        bond->active[bond->active_count++] = was;   // no failback while the active port works
+    else
+        for (uint8_t i = 0; i < eth_standby_count; i++)
+        {
+            // ports in standby order, only the first one with link up in standby mode
+            eth_device_t *dev = eth_devices[eth_standby[i]];
+            if ((dev->bond != bond) || !netif_is_link_up(&dev->iface))
+                continue;
+            bond->active[bond->active_count++] = dev;
+            if (eth_conf.do_bond_standby)
+                break;
+        }
+    if (bond->active_count && !netif_is_link_up(netif))
     {
-        if(eth_xmit_fatal_error(dev, rx_retries))
-            return USB_ERROR_FAILED;
-        
-        LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_LEVEL_SERIOUS,
-                    ("INFO: rx endpoint failure, retry=%u", rx_retries));
-        rx_retries++;
-        usb_ScheduleBulkTransfer(dev->rx.endpoint, dev->rx.buf, ETHERNET_MTU, dev->rx.callback, data);
-        return USB_SUCCESS;
-    } else if (transferred)
+        netif_set_link_up(netif);
+        LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_STATE,
+                    ("INFO: netif=%c%c%u, link up", netif->name[0], netif->name[1], netif->num));
+        if(eth_conf.do_dhcp_auto)
+            dhcp_start(netif);
+        eth_link_up(netif);
+    }
+    else if (!bond->active_count && netif_is_link_up(netif))
     {
-        rx_retries = 0;
-        struct pbuf *p = pbuf_alloc(PBUF_RAW, transferred, PBUF_POOL);
-        if (p == NULL)
-            return USB_ERROR_NO_MEMORY;
-        pbuf_take(p, recvbuf, transferred);
-        LINK_STATS_INC(link.recv);
-        MIB2_STATS_NETIF_ADD(&dev->iface, ifinoctets, transferred);
-        
-        usb_ScheduleBulkTransfer(dev->rx.endpoint, dev->rx.buf, ETHERNET_MTU, dev->rx.callback, data);
-        
-        if (dev->iface.input(p, &dev->iface) != ERR_OK)
-            pbuf_free(p);
+        netif_set_link_down(netif);
+        LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_STATE,
+                    ("INFO: netif=%c%c%u, link down", netif->name[0], netif->name[1], netif->num));
+        eth_link_down(netif);
+    }
+    else if (bond->active_count && ((bond->active_count < had) || (bond->active[0] != was)))
+    {
+        // a port went away with frames in flight, its flows now go out another one
+        LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_STATE,
+                    ("INFO: netif=%c%c%u, %u active port(s), netif=%c%c%u first", netif->name[0], netif->name[1], netif->num,
+                     bond->active_count, bond->active[0]->iface.name[0], bond->active[0]->iface.name[1], bond->active[0]->iface.num));
+#if LWIP_IPV4
+        // let the switch learn the bond's MAC address on the new port
+        if (eth_conf.do_bond_standby)
+            etharp_gratuitous(netif);
+#endif
+        eth_failover_repoint(netif);
     }
-    return USB_SUCCESS;
 }
 
-///----------------------------------------------------------------
-/// @brief linkoutput function for @b Ethernet_Control_Model (ECM)
-err_t ecm_bulk_transmit(struct netif *netif, struct pbuf *p)
+///------------------------------------------------------------------------
+/// @brief link callback of the port netifs
+void eth_bond_port_link(struct netif *netif)
 {
     eth_device_t *dev = (eth_device_t *)netif->state;
-    if (p->tot_len > ETHERNET_MTU)
-        return ERR_MEM;
-    struct pbuf *tbuf = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_RAM);
-    LINK_STATS_INC(link.xmit);
-    // Update SNMP stats(only if you use SNMP)
-    MIB2_STATS_NETIF_ADD(netif, ifoutoctets, p->tot_len);
-    if (pbuf_copy(tbuf, p))
-        return ERR_MEM;
-    usb_ScheduleBulkTransfer(dev->tx.endpoint, tbuf->payload, tbuf->tot_len, bulk_transmit_callback, tbuf);
-    return ERR_OK;
+    if (dev->bond)
+        eth_bond_update(dev->bond);
 }
 
-/****************************************************************************
- * Code for Network Control Model (NCM)
- * for USB-Ethernet devices
- */
+///------------------------------------------------------------------------
+/// @brief turns a device's netif into a port of its bond
+/// @note also called by eth_netif_init() when a bonded device is resumed
+void eth_bond_port_setup(eth_device_t *dev)
+{
+    struct netif *netif = &dev->iface;
+    // ARP, IGMP and MLD run on the bond only
+    netif->flags &= ~(NETIF_FLAG_ETHARP | NETIF_FLAG_IGMP | NETIF_FLAG_MLD6);
+    memcpy(netif->hwaddr, dev->bond->hwaddr, ETH_HWADDR_LEN);
+    netif->input = eth_bond_input;
+    netif_set_link_callback(netif, eth_bond_port_link);
+}
 
-/* Flag Values for NCM Network Capabilities. */
-enum _cdc_ncm_bm_networkcapabilities
+///------------------------------------------------------------------------
+/// @brief bond NETIF initialization
+err_t eth_bond_netif_init(struct netif *netif)
 {
-    CAPABLE_ETHERNET_PACKET_FILTER,
-    CAPABLE_NET_ADDRESS,
-    CAPABLE_ENCAPSULATED_RESPONSE,
-    CAPABLE_MAX_DATAGRAM,
-    CAPABLE_NTB_INPUT_SIZE_8BYTE
-};
-/* Helper Macro for Returning State of Network Capabilities Flag. */
-#define ncm_device_supports(dev, bm) (((dev)->class.ncm.bm_capabilities >> (bm)) & 1)
+    struct eth_bond *bond = (struct eth_bond *)netif->state;
+    netif->linkoutput = eth_bond_linkoutput;
+    netif->output = etharp_output;
+    netif->output_ip6 = ethip6_output;
+    netif->mtu = ETHERNET_MTU;
+    netif->mtu6 = ETHERNET_MTU;
+    netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_ETHERNET | NETIF_FLAG_IGMP | NETIF_FLAG_MLD6;
+    MIB2_INIT_NETIF(netif, snmp_ifType_ethernet_csmacd, 100000000);
+    memcpy(netif->hwaddr, bond->hwaddr, NETIF_MAX_HWADDR_LEN);
+    netif->hwaddr_len = NETIF_MAX_HWADDR_LEN;
+#if LWIP_IPV4 && LWIP_IGMP
+    netif_set_igmp_mac_filter(netif, eth_igmp_mac_filter);
+#endif
+#if LWIP_IPV6 && LWIP_IPV6_MLD
+    netif_set_mld_mac_filter(netif, eth_mld_mac_filter);
+#endif
+    return ERR_OK;
+}
 
-/* Data Structure for NTB Config control request. */
-struct _ntb_config_data
+///------------------------------------------------------------------------
+/// @brief creates the bond, with the MAC address of its first port
+struct eth_bond *eth_bond_create(eth_device_t *dev)
 {
-    uint32_t dwNtbInMaxSize;
-    uint16_t wNtbInMaxDatagrams;
-    uint16_t reserved;
-};
+    struct eth_bond *bond = malloc(sizeof(struct eth_bond));
+    if (bond == NULL)
+        return NULL;
+    memset(bond, 0, sizeof(struct eth_bond));
+    memcpy(bond->hwaddr, dev->hwaddr, ETH_HWADDR_LEN);
+    struct netif *netif = &bond->iface;
+    if (netif_add_noaddr(netif, bond, eth_bond_netif_init, netif_input) == NULL)
+    {
+        free(bond);
+        return NULL;
+    }
+    netif->name[0] = 'b';
+    netif->name[1] = 'o';
+    // past the ifnums of the devices, so netif indexes stay unique
+    netif->num = NETIFS_MAX_ALLOWED;
+    netif_create_ip6_linklocal_address(netif, 1);
+    netif->ip6_autoconfig_enabled = 1;
+    netif_set_hostname(netif, hostname);
+    netif_set_up(netif);
+    LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_STATE,
+                ("INFO: netif=%c%c%u, CREATED", netif->name[0], netif->name[1], netif->num));
+    return bond;
+}
 
-/* NCM Transfer Header (NTH) Defintion */
-#define NCM_NTH_SIG 0x484D434E
-struct ncm_nth
+struct netif *eth_bond_add(uint8_t ifnum)
 {
-    uint32_t dwSignature;   // "NCMH"
-    uint16_t wHeaderLength; // size of this header structure (should be 12 for NTB-16)
-    uint16_t wSequence;     // counter for NTB's sent
-    uint16_t wBlockLength;  // size of the NTB
-    uint16_t wNdpIndex;     // offset to first NDP
-};
+    if ((ifnum >= NETIFS_MAX_ALLOWED) || (eth_devices[ifnum] == NULL))
+        return NULL;
+    eth_device_t *dev = eth_devices[ifnum];
+    struct netif *netif = &dev->iface;
+    if (dev->bond)
+        return &dev->bond->iface;
+    if ((eth_bond == NULL) && ((eth_bond = eth_bond_create(dev)) == NULL))
+        return NULL;
+    // the port gives up its own addresses, the bond answers for it
+    dhcp_release_and_stop(netif);
+    netif_set_addr(netif, NULL, NULL, NULL);
+    for (uint8_t i = 0; i < LWIP_IPV6_NUM_ADDRESSES; i++)
+        netif_ip6_addr_set_state(netif, i, IP6_ADDR_INVALID);
+    netif->ip6_autoconfig_enabled = 0;
+    if ((netif_default == NULL) || (netif_default == netif))
+        netif_set_default(&eth_bond->iface);
+    dev->bond = eth_bond;
+    eth_bond->ports[ifnum] = dev;
+    eth_bond_port_setup(dev);
+    eth_bond_mcast_mirror(eth_bond, dev, NETIF_ADD_MAC_FILTER);
+    eth_bond_update(eth_bond);
+    LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_STATE,
+                ("INFO: netif=%c%c%u, port of bond", netif->name[0], netif->name[1], netif->num));
+    return &eth_bond->iface;
+}
 
-/* NCM Datagram Pointers (NDP) Definition */
-struct ncm_ndp_idx
+///------------------------------------------------------------------------
+/// @brief takes a device out of its bond, the bond is removed with its last port
+void eth_bond_detach(eth_device_t *dev)
 {
-    uint16_t wDatagramIndex; // offset of datagram, if 0, then is end of datagram list
-    uint16_t wDatagramLen;   // length of datagram, if 0, then is end of datagram list
-};
-#define NCM_NDP_SIG0 0x304D434E
-#define NCM_NDP_SIG1 0x314D434E
-struct ncm_ndp
+    struct eth_bond *bond = dev->bond;
+    bond->ports[dev->iface.num] = NULL;
+    dev->bond = NULL;
+    for (uint8_t i = 0; i < NETIFS_MAX_ALLOWED; i++)
+        if (bond->ports[i])
+        {
+            eth_bond_update(bond);
+            return;
+        }
+    LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_STATE,
+                ("INFO: netif=%c%c%u, REMOVED", bond->iface.name[0], bond->iface.name[1], bond->iface.num));
+    sys_untimeout(eth_failover_timeout, &bond->iface);
+    netif_remove(&bond->iface);
+    free(bond);
+    eth_bond = NULL;
+}
+
+bool eth_bond_remove(uint8_t ifnum)
 {
-    uint32_t dwSignature;               // "NCM0"
-    uint16_t wLength;                   // size of NDP16
-    uint16_t wNextNdpIndex;             // offset to next NDP16
-    struct ncm_ndp_idx wDatagramIdx[1]; // pointer to end of NDP
-};
+    if ((ifnum >= NETIFS_MAX_ALLOWED) || (eth_devices[ifnum] == NULL) || (eth_devices[ifnum]->bond == NULL))
+        return false;
+    eth_device_t *dev = eth_devices[ifnum];
+    struct netif *netif = &dev->iface;
+    eth_bond_mcast_mirror(dev->bond, dev, NETIF_DEL_MAC_FILTER);
+    eth_bond_detach(dev);
+    // back to a standalone interface with its own address
+    netif_set_link_callback(netif, NULL);
+    netif->input = netif_input;
+    memcpy(netif->hwaddr, dev->hwaddr, ETH_HWADDR_LEN);
+    netif->flags |= NETIF_FLAG_ETHARP | NETIF_FLAG_IGMP | NETIF_FLAG_MLD6;
+    eth_filter_sync(dev);
+    netif_create_ip6_linklocal_address(netif, 1);
+    netif->ip6_autoconfig_enabled = 1;
+    if(netif_is_link_up(netif) && eth_conf.do_dhcp_auto)
+        dhcp_start(netif);
+    LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_STATE,
+                ("INFO: netif=%c%c%u, left bond", netif->name[0], netif->name[1], netif->num));
+    return true;
+}
 
-#define NCM_NTH_LEN sizeof(struct ncm_nth)
-#define NCM_NDP_LEN sizeof(struct ncm_ndp)
-#define NCM_RX_MAX_DATAGRAMS 4
-#define NCM_RX_DATAGRAMS_OVERFLOW_MUL 16 // this is here in the event that max datagrams is unsupported
-#define NCM_RX_QUEUE_LEN (NCM_RX_MAX_DATAGRAMS * NCM_RX_DATAGRAMS_OVERFLOW_MUL)
+/****************************************************************************
+ * Failover
+ * When the default interface has been without link for eth_conf.link_holddown
+ * ms, the default route moves to the first interface in the standby list
+ * with link up. The list is in attach order unless eth_set_standby() changes
+ * it, and a bond stands in for its ports. TCP connections routed through the
+ * new interface retransmit right away instead of waiting out their RTO.
+ */
 
-///------------------------------------------------------------
-/// @brief control setup for @b Network_Control_Model (NCM)
-usb_error_t ncm_control_setup(eth_device_t *eth)
+///------------------------------------------------------------------------
+/// @brief takes an interface out of the standby list
+void eth_standby_remove(uint8_t ifnum)
 {
-    if (eth->type != USB_NCM_SUBCLASS)
-        return USB_SUCCESS;
-    size_t transferred;
-    usb_error_t error = 0;
-    usb_control_setup_t get_ntb_params = {0b10100001, REQUEST_GET_NTB_PARAMETERS, 0, 0, 0x1c};
-    usb_control_setup_t ntb_config_request = {0b00100001, REQUEST_SET_NTB_INPUT_SIZE, 0, 0, ncm_device_supports(eth, CAPABLE_NTB_INPUT_SIZE_8BYTE) ? 8 : 4};
-    // usb_control_setup_t multicast_filter_request = {0b00100001, REQUEST_SET_ETHERNET_MULTICAST_FILTERS, 0, 0, 0};
-    usb_control_setup_t packet_filter_request = {0b00100001, REQUEST_SET_ETHERNET_PACKET_FILTER, 0x01, 0, 0};
-    struct _ntb_config_data ntb_config_data = {NCM_RX_NTB_MAX_SIZE, NCM_RX_MAX_DATAGRAMS, 0};
-    
-    /* Query NTB Parameters for device (NCM devices) */
-    error |= usb_DefaultControlTransfer(eth->device, &get_ntb_params, &eth->class.ncm.ntb_params, USB_CDC_MAX_RETRIES, &transferred);
-    
-    /* Set NTB Max Input Size to 2048 (recd minimum NCM spec v 1.2) */
-    error |= usb_DefaultControlTransfer(eth->device, &ntb_config_request, &ntb_config_data, USB_CDC_MAX_RETRIES, &transferred);
-    
-    /* Reset packet filters */
-    if (ncm_device_supports(eth, CAPABLE_ETHERNET_PACKET_FILTER))
-        error |= usb_DefaultControlTransfer(eth->device, &packet_filter_request, NULL, USB_CDC_MAX_RETRIES, &transferred);
-    
-    return error;
+    for (uint8_t i = 0; i < eth_standby_count; i++)
+        if (eth_standby[i] == ifnum)
+        {
+            memmove(&eth_standby[i], &eth_standby[i + 1], --eth_standby_count - i);
+            return;
+        }
 }
 
-///------------------------------------------------------------
-/// @brief linkinput function for @b Network_Control_Model (NCM)
-usb_error_t ncm_receive_callback(__attribute__((unused)) usb_endpoint_t endpoint,
-                                 usb_transfer_status_t status,
-                                 size_t transferred,
-                                 usb_transfer_data_t *data)
+bool eth_set_standby(const uint8_t *ifnums, uint8_t count)
 {
-    eth_device_t *dev = (eth_device_t *)data;
-    uint8_t *recvbuf = dev->rx.buf;
-    static uint8_t rx_retries = 0;
-    if (status)
+    if ((ifnums == NULL) || (count > NETIFS_MAX_ALLOWED))
+        return false;
+    for (uint8_t i = 0; i < count; i++)
+        if ((ifnums[i] >= NETIFS_MAX_ALLOWED) || (eth_devices[ifnums[i]] == NULL))
+            return false;
+    // move the listed interfaces to the front, in the order given
+    for (uint8_t i = count; i > 0; i--)
     {
-        if(eth_xmit_fatal_error(dev, rx_retries)){
-            pbuf_free(data);
-            return USB_ERROR_FAILED;
-        }
-        LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_LEVEL_SERIOUS,
-                        ("INFO: rx endpoint failure, retry=%u", rx_retries));
-        rx_retries++;
-        usb_ScheduleBulkTransfer(dev->rx.endpoint, dev->rx.buf, NCM_RX_NTB_MAX_SIZE, dev->rx.callback, data);
-        return USB_SUCCESS;
+        eth_standby_remove(ifnums[i - 1]);
+        memmove(&eth_standby[1], &eth_standby[0], eth_standby_count++);
+        eth_standby[0] = ifnums[i - 1];
     }
-    if (transferred)
+    return true;
+}
+
+///------------------------------------------------------------------------
+/// @brief restarts retransmission of the TCP connections routed through netif
+/// Segments sent on a link that went down are lost, and after a few timeouts
+/// the RTO has backed off to seconds. Rewinding it lets those connections
+/// recover as soon as the new route is in place.
+void eth_failover_repoint(struct netif *netif)
+{
+#if LWIP_TCP
+    for (struct tcp_pcb *pcb = tcp_active_pcbs; pcb != NULL; pcb = pcb->next)
     {
-        rx_retries = 0;
-        struct pbuf *rx_queue[NCM_RX_QUEUE_LEN];
-        uint16_t enqueued = 0;
-        bool parse_ntb = true;
-        
-        // get header and first NDP pointers
-        uint8_t *ntb = (uint8_t *)recvbuf;
-        struct ncm_nth *nth = (struct ncm_nth *)ntb;
-        if (nth->dwSignature != NCM_NTH_SIG)
-            return USB_SUCCESS; // validate NTH signature field. If invalid, fail out
-        
-        // start proc'ing first NDP
-        struct ncm_ndp *ndp = (struct ncm_ndp *)&ntb[nth->wNdpIndex];
-        
-        // repeat while ndp->wNextNdpIndex is non-zero
-        do
-        {
-            if (ndp->dwSignature != NCM_NDP_SIG0)
-                return USB_SUCCESS; // validate NDP signature field, if invalid, fail out
-            
-            // set datagram number to 0 and set datagram index pointer
-            uint16_t dg_num = 0;
-            struct ncm_ndp_idx *idx = (struct ncm_ndp_idx *)&ndp->wDatagramIdx;
-            
-            // a null datagram index structure indicates end of NDP
-            do
-            {
-                // attempt to allocate pbuf
-                if (enqueued >= NCM_RX_QUEUE_LEN)
-                {
-                    parse_ntb = false;
-                    break;
-                }
-                struct pbuf *p = pbuf_alloc(PBUF_RAW, idx[dg_num].wDatagramLen, PBUF_POOL);
-                if (p == NULL)
-                { // if allocation failed, break loops
-                    parse_ntb = false;
-                    break;
-                }
-                if (pbuf_take(p, &ntb[idx[dg_num].wDatagramIndex], idx[dg_num].wDatagramLen))
-                { // if pbuf take fails, break loops
-                    parse_ntb = false;
-                    break;
-                }
-                // enqueue packet, we will finish processing first
-                rx_queue[enqueued++] = p;
-                dg_num++;
-            } while ((idx[dg_num].wDatagramIndex) && (idx[dg_num].wDatagramLen));
-            // if next NDP is 0, NTB is done and so is my sanity
-            if (ndp->wNextNdpIndex == 0)
-                break;
-            // set next NDP
-            ndp = (struct ncm_ndp *)&ntb[ndp->wNextNdpIndex];
-        } while (parse_ntb);
-        
-        LINK_STATS_INC(link.recv);
-        MIB2_STATS_NETIF_ADD(&dev->iface, ifinoctets, transferred);
-        
-        // queue up next transfer first
-        usb_ScheduleBulkTransfer(dev->rx.endpoint, dev->rx.buf, NCM_RX_NTB_MAX_SIZE, dev->rx.callback, data);
-        
-        // hand packet queue to lwIP
-        for (int i = 0; i < enqueued; i++)
-            if (rx_queue[i])
-                if (dev->iface.input(rx_queue[i], &dev->iface) != ERR_OK)
-                    pbuf_free(rx_queue[i]);
+        if ((pcb->unacked == NULL) || (pcb->netif_idx != NETIF_NO_INDEX) ||
+            (ip_route(&pcb->local_ip, &pcb->remote_ip) != netif))
+            continue;
+        pcb->nrtx = 0;
+        pcb->rtime = 0;
+        if (pcb->sa)
+            pcb->rto = (s16_t)((pcb->sa >> 3) + pcb->sv);
+        tcp_rexmit_rto(pcb);
     }
-    return USB_SUCCESS;
+#endif
+}
+
+///------------------------------------------------------------------------
+/// @brief moves the default route off an interface whose link stayed down for the hold-down time
+void eth_failover_timeout(void *arg)
+{
+    struct netif *down = (struct netif *)arg;
+    if (netif_is_link_up(down) || (netif_default != down))
+        return;
+    for (uint8_t i = 0; i < eth_standby_count; i++)
+    {
+        eth_device_t *dev = eth_devices[eth_standby[i]];
+        struct netif *netif = dev->bond ? &dev->bond->iface : &dev->iface;
+        if ((netif == down) || !netif_is_link_up(netif))
+            continue;
+        netif_set_default(netif);
+        LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_STATE,
+                    ("INFO: setting new default, netif=%c%c%u", netif->name[0], netif->name[1], netif->num));
+        eth_failover_repoint(netif);
+        return;
+    }
+    netif_set_default(NULL);
+    LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_STATE,
+                ("INFO: setting new default, netif=NULL"));
 }
 
-/* This code packs a single TX Ethernet frame into an NCM transfer. */
-#define NCM_HBUF_SIZE 64
-#define get_next_offset(offset, divisor, remainder) \
-(offset) + (divisor) - ((offset) % (divisor)) + (remainder)
+///------------------------------------------------------------------------
+/// @brief link up on a device or bond, cancels a pending failover and takes the default route if it is free
+void eth_link_up(struct netif *netif)
+{
+    sys_untimeout(eth_failover_timeout, netif);
+    if (!netif_default)
+    {
+        LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_STATE,
+                    ("INFO: setting new default, netif=%c%c%u", netif->name[0], netif->name[1], netif->num));
+        netif_set_default(netif);
+    }
+}
 
-///---------------------------------------------------------------
-/// @brief linkoutput function for @b Network_Control_Model (NCM)
-err_t ncm_bulk_transmit(struct netif *netif, struct pbuf *p)
+///------------------------------------------------------------------------
+/// @brief link down on a device or bond, the default route moves after the hold-down time
+void eth_link_down(struct netif *netif)
 {
-    eth_device_t *dev = (eth_device_t *)netif->state;
-    uint16_t offset_ndp = get_next_offset(NCM_NTH_LEN, dev->class.ncm.ntb_params.wNdpInAlignment, 0);
-    if (p->tot_len > ETHERNET_MTU)
-        return ERR_MEM;
-    
-    // allocate TX packet buffer
-    struct pbuf *obuf = pbuf_alloc(PBUF_RAW, ETHERNET_MTU + NCM_HBUF_SIZE, PBUF_RAM);
-    if (obuf == NULL)
-        return ERR_MEM;
-    
-    memset(obuf->payload, 0, ETHERNET_MTU + NCM_HBUF_SIZE);
-    
-    // declare NTH, NDP, and NDP_IDX structures
-    uint8_t hdr_buf[NCM_HBUF_SIZE] = {0};
-    struct ncm_nth *nth = (struct ncm_nth *)hdr_buf;
-    struct ncm_ndp *ndp = (struct ncm_ndp *)&hdr_buf[offset_ndp];
-    
-    // populate structs
-    nth->dwSignature = NCM_NTH_SIG;
-    nth->wHeaderLength = NCM_NTH_LEN;
-    nth->wSequence = dev->class.ncm.sequence++;
-    nth->wBlockLength = NCM_HBUF_SIZE + ETHERNET_MTU;
-    nth->wNdpIndex = offset_ndp;
-    
-    ndp->dwSignature = NCM_NDP_SIG0;
-    ndp->wLength = NCM_NDP_LEN + 4;
-    ndp->wNextNdpIndex = 0;
-    
-    ndp->wDatagramIdx[0].wDatagramIndex = NCM_HBUF_SIZE;
-    ndp->wDatagramIdx[0].wDatagramLen = p->tot_len;
-    ndp->wDatagramIdx[1].wDatagramIndex = 0;
-    ndp->wDatagramIdx[1].wDatagramLen = 0;
-    
-    // absorb the populated structs into the obuf
-    pbuf_take(obuf, hdr_buf, NCM_HBUF_SIZE);
-    
-    // copy the datagram to the pbuf
-    pbuf_copy_partial(p, obuf->payload + NCM_HBUF_SIZE, p->tot_len, 0);
-    LINK_STATS_INC(link.xmit);
-    // Update SNMP stats(only if you use SNMP)
-    MIB2_STATS_NETIF_ADD(netif, ifoutoctets, p->tot_len);
-    
-    // queue the TX
-    // printf("sent packet %u at time %lu\n", sequence, sys_now());
-    usb_ScheduleBulkTransfer(dev->tx.endpoint, obuf->payload, ETHERNET_MTU + NCM_HBUF_SIZE, bulk_transmit_callback, obuf);
-    return ERR_OK;
+    if (netif_default == netif)
+        sys_timeout(eth_conf.link_holddown, eth_failover_timeout, netif);
 }
 
 ///----------------------------------------
@@ -516,6 +2209,14 @@ err_t eth_netif_init(struct netif *netif)
     MIB2_INIT_NETIF(netif, snmp_ifType_ethernet_csmacd, 100000000);
     memcpy(netif->hwaddr, dev->hwaddr, NETIF_MAX_HWADDR_LEN);
     netif->hwaddr_len = NETIF_MAX_HWADDR_LEN;
+#if LWIP_IPV4 && LWIP_IGMP
+    netif_set_igmp_mac_filter(netif, eth_igmp_mac_filter);
+#endif
+#if LWIP_IPV6 && LWIP_IPV6_MLD
+    netif_set_mld_mac_filter(netif, eth_mld_mac_filter);
+#endif
+    if (dev->bond)
+        eth_bond_port_setup(dev);
     // netif_set_link_callback(netif, eth_link_callback);
     // netif_set_status_callback(netif, eth_status_callback);
     return ERR_OK;
@@ -541,10 +2242,12 @@ enum _descriptor_parser_await_states
 bool init_ethernet_usb_device(usb_device_t device)
 {
     eth_device_t tmp = {0};
+    struct _ncm ncm_tmp = {0};      // moved into the device's state block by eth_state_alloc()
     eth_device_t *eth = NULL;
     size_t xferd, parsed_len, desc_len;
     usb_error_t err;
     tmp.device = device;
+    tmp.ncm = &ncm_tmp;
     
     if(ifnums_used == 0b11111111){
         LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_LEVEL_WARNING,
@@ -561,11 +2264,11 @@ bool init_ethernet_usb_device(usb_device_t device)
     {
         usb_interface_descriptor_t *addr;
         size_t len;
-    } if_bulk;
+    } if_bulk = {0};
     struct
     {
         uint8_t in, out, interrupt;
-    } endpoint_addr;
+    } endpoint_addr = {0};
     union
     {
         uint8_t bytes[DESCRIPTOR_MAX_LEN];   // allocate 256 bytes for descriptors
@@ -687,6 +2390,8 @@ bool init_ethernet_usb_device(usb_device_t device)
                         case USB_ETHERNET_FUNCTIONAL_DESCRIPTOR:
                         {
                             usb_ethernet_functional_descriptor_t *ethdesc = (usb_ethernet_functional_descriptor_t *)cs;
+                            // bit 15 only says the adapter hashes addresses, eth_rx_accept() checks them exactly
+                            tmp.filter.slots = ((ethdesc->wNumberMCFilters[1] & 0x7f) << 8) | ethdesc->wNumberMCFilters[0];
                             usb_control_setup_t get_mac_addr = {0b10100001, REQUEST_GET_NET_ADDRESS, 0, 0, 6};
                             size_t xferd_tmp;
                             uint8_t string_descriptor_buf[DESCRIPTOR_MAX_LEN];
@@ -735,7 +2440,7 @@ bool init_ethernet_usb_device(usb_device_t device)
                         case USB_NCM_FUNCTIONAL_DESCRIPTOR:
                         {
                             usb_ncm_functional_descriptor_t *ncm = (usb_ncm_functional_descriptor_t *)cs;
-                            tmp.class.ncm.bm_capabilities = ncm->bmNetworkCapabilities;
+                            tmp.ncm->bm_capabilities = ncm->bmNetworkCapabilities;
                         }
                             break;
                     }
@@ -761,6 +2466,14 @@ init_success:
     if ((tmp.tx.emit == NULL) || (tmp.rx.callback == NULL))
         return false;
     
+    // NCM rx sizes were negotiated by ncm_control_setup()
+    if (tmp.type == USB_ECM_SUBCLASS)
+    {
+        tmp.rx.size = ETHERNET_MTU;
+        tmp.rx.datagrams = 1;
+    }
+    tmp.tx.depth = LWIP_MIN(LWIP_MAX(eth_conf.tx_queue_depth, 1), ETH_TX_QUEUE_MAX);
+    
     // switch to alternate interface
     if (usb_SetInterface(device, if_bulk.addr, if_bulk.len))
         return false;
@@ -768,8 +2481,27 @@ init_success:
     // set endpoint data
     tmp.rx.endpoint = usb_GetDeviceEndpoint(device, endpoint_addr.in);
     tmp.tx.endpoint = usb_GetDeviceEndpoint(device, endpoint_addr.out);
+    // TX lengths are exact, so a transfer that is a multiple of the packet size needs a ZLP
+    usb_SetEndpointFlags(tmp.tx.endpoint, USB_AUTO_TERMINATE);
     tmp.interrupt.endpoint = usb_GetDeviceEndpoint(device, endpoint_addr.interrupt);
-    // allocate eth_device_t => contains type, usb device, metadata, and INT/RX buffers
+    tmp.interrupt.size = LWIP_MIN(LWIP_MAX(usb_GetEndpointMaxPacketSize(tmp.interrupt.endpoint), INTERRUPT_RX_MIN), INTERRUPT_RX_MAX);
+    
+    // allocate class state, tx slots and INT buffer sized for this device (RX buffers come later)
+    if (!eth_state_alloc(&tmp))
+        return false;
+    
+    // a reset that left transfers outstanding: their callbacks still use the old state block,
+    // so the old device cannot take the new config. Tear it down (its last completion frees it)
+    // and bring the adapter up as a new netif
+    eth = (eth_device_t *)usb_GetDeviceData(device);
+    if (eth && (eth->tx.busy || eth->filter.busy || eth->interrupt.busy))
+    {
+        LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_LEVEL_SERIOUS,
+                    ("INFO: device=%p, transfers outstanding on resume, recreating netif", device));
+        netif_set_link_down(&eth->iface);
+        netif_set_down(&eth->iface);
+        eth_device_teardown(eth);
+    }
     
     // better ifnum assignment
     uint8_t ifnum_assigned;
@@ -790,8 +2522,22 @@ init_success:
         // ## IF DEVICE ALREADY USED FOR NETIF ##
         // reuse existing eth_device_t address
         eth = (eth_device_t *)usb_GetDeviceData(device);
-        // copy new usb config without destroying netif config
-        memcpy(eth, &tmp, sizeof(eth_device_t) - sizeof(struct netif));
+        // drop TX datagrams still queued and rx buffers for the old config
+        if (eth->type == USB_NCM_SUBCLASS)
+            ncm_tx_discard(eth);
+        eth_tx_discard(eth);
+        eth_rx_detach(eth);
+        // no transfer refers to the old state block, devices with some outstanding were torn down above
+        free(eth->state);
+        // copy new usb config without destroying netif config, multicast subscriptions or stats
+        memcpy(eth, &tmp, offsetof(eth_device_t, mcast));
+        if (!eth_rx_alloc(eth))
+        {
+            LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_LEVEL_SERIOUS,
+                        ("ERROR: device=%p, rx buffer alloc failed", device));
+            eth_device_teardown(eth);
+            return false;
+        }
         LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_STATE,
                     ("INFO: netif=%c%c%u <- device=%p, RESUMED", eth->iface.name[0], eth->iface.name[1], eth->iface.num, device));
         eth_netif_init(&eth->iface);
@@ -799,14 +2545,28 @@ init_success:
     else {
         // ## ELSE CONFIG NEW NETIF ##
         if((eth = malloc(sizeof(eth_device_t)))==NULL)
+        {
+            free(tmp.state);
             return false;
+        }
         memcpy(eth, &tmp, sizeof(eth_device_t));
+        if (!eth_rx_alloc(eth))
+        {
+            LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_LEVEL_SERIOUS,
+                        ("ERROR: device=%p, rx buffer alloc failed", device));
+            eth_rx_detach(eth);
+            free(eth->state);
+            free(eth);
+            return false;
+        }
         struct netif *iface = &eth->iface;
         // add to lwIP list of active netifs (save pointer to eth_device_t too)
         if (netif_add_noaddr(iface, eth, eth_netif_init, netif_input) == NULL)
         {
             LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_LEVEL_SERIOUS,
                         ("ERROR: netif= <- device=%p, netif add failed", device));
+            eth_rx_detach(eth);
+            free(eth->state);
             free(eth);
             return false;
         }
@@ -824,6 +2584,8 @@ init_success:
         iface->ip6_autoconfig_enabled = 1;
         
         ifnums_used |= 1 << ifnum_assigned;  // set flag marking the ifnum used
+        eth_devices[ifnum_assigned] = eth;
+        eth_standby[eth_standby_count++] = ifnum_assigned;
         netif_set_hostname(iface, hostname); // set default hostname
         LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_STATE,
                     ("INFO: netif=%c%c%u <- device=%p, CREATED", iface->name[0], iface->name[1], iface->num, device));
@@ -831,8 +2593,12 @@ init_success:
     
     netif_set_up(&eth->iface); // tell lwIP that the interface is ready to receive
     // enqueue callbacks for receiving interrupt and RX transfers from this device.
-    usb_ScheduleInterruptTransfer(eth->interrupt.endpoint, eth->interrupt.buf, INTERRUPT_RX_MAX, interrupt_receive_callback, eth);
-    usb_ScheduleBulkTransfer(eth->rx.endpoint, eth->rx.buf, (tmp.type == USB_NCM_SUBCLASS) ? NCM_RX_NTB_MAX_SIZE : ETHERNET_MTU, eth->rx.callback, eth);
+    eth->interrupt.busy = (usb_ScheduleInterruptTransfer(eth->interrupt.endpoint, eth->interrupt.buf, eth->interrupt.size,
+                                                         interrupt_receive_callback, eth) == USB_SUCCESS);
+    eth_rx_schedule(eth);
+    // program the adapter filters from the groups joined so far
+    eth->filter.enabled = true;
+    eth_filter_sync(eth);
     return true;
 }
 
@@ -874,10 +2640,10 @@ eth_usb_event_callback(usb_event_t event, void *event_data,
         case USB_DEVICE_DISABLED_EVENT:
         {
             eth_device_t *eth_device = (eth_device_t *)usb_GetDeviceData(usb_device);
-            netif_set_link_down(&eth_device->iface);
-            netif_set_down(&eth_device->iface);
             if (eth_device)
             {
+                netif_set_link_down(&eth_device->iface);
+                netif_set_down(&eth_device->iface);
                 eth_device_teardown(eth_device);
                 LWIP_DEBUGF(ETH_DEBUG | LWIP_DBG_LEVEL_SEVERE,
                             ("INFO: device ptr=%p: disconnected", usb_device));
@@ -906,6 +2672,13 @@ bool eth_configure(struct eth_configurator *conf){
     return true;
 }
 
+bool eth_get_stats(uint8_t ifnum, struct eth_stats *stats)
+{
+    if ((ifnum >= NETIFS_MAX_ALLOWED) || (eth_devices[ifnum] == NULL) || (stats == NULL))
+        return false;
+    memcpy(stats, &eth_devices[ifnum]->stats, sizeof(struct eth_stats));
+    return true;
+}
 
 uint8_t eth_get_interfaces(void)
 {
@@ -7,6 +7,7 @@
 #ifndef cdc_h
 #define cdc_h
 
+#include <stddef.h>
 #include <stdint.h>
 #include <usbdrvce.h>
 
@@ -18,11 +19,82 @@
 /* Ethernet MTU - ECM & NCM */
 #define ETHERNET_MTU 1518
 
-/* Interrupt buffer size */
+/* Zero-copy rx buffers per device, kept queued on the bulk IN endpoint */
+#define ETH_RX_BUFFERS_DEFAULT 2
+#define ETH_RX_BUFFERS_MIN 2
+#define ETH_RX_BUFFERS_MAX 4
+
+/* Received frames queued per device for eth_poll() (deferred input) */
+#define ETH_RX_QUEUE_LEN 16
+
+/* USB-Ethernet interfaces (en0 to en7) */
+#define ETH_INTERFACES_MAX 8
+
+/* TX transfers queued per device */
+#define ETH_TX_QUEUE_DEFAULT 4
+#define ETH_TX_QUEUE_MAX 8
+
+/* TX slots per device that only urgent frames (ARP, ICMP, DNS, pure TCP ACKs) may take,
+ * and urgent frames are sent ahead of queued bulk data */
+#define ETH_TX_URGENT_SLOTS 1
+
+/* TX transfers on the host controller, all devices together - beyond this,
+ * queued transfers are dispatched round-robin by tx_weights */
+#ifndef ETH_TX_INFLIGHT_MAX
+#define ETH_TX_INFLIGHT_MAX 8
+#endif
+
+/* bulk TX transfers on the host controller per device - the endpoint sends them in order,
+ * so a queued urgent frame waits behind no more than these */
+#ifndef ETH_TX_BULK_INFLIGHT
+#define ETH_TX_BULK_INFLIGHT 2
+#endif
+
+/* TX scheduler quantum (bytes) - what a device of weight 1 may send per turn, at least
+ * the largest transfer (ETHERNET_MTU, NCM_TX_NTB_MAX_SIZE) */
+#define ETH_TX_QUANTUM 2048
+
+/* Default link hold-down (ms) - how long the default interface may be without link before
+ * the default route moves to a standby interface */
+#define ETH_LINK_HOLDDOWN_DEFAULT 500
+
+/* Interrupt buffer size - the endpoint's max packet size, within these bounds
+ * (ConnectionSpeedChange, the largest notification handled, is 16 bytes) */
+#define INTERRUPT_RX_MIN 16
 #define INTERRUPT_RX_MAX 64
 
-/* NCM rx ntb size */
-#define NCM_RX_NTB_MAX_SIZE 2048
+/* NCM rx ntb size - picked from dwNtbInMaxSize and the heap budget, in multiples of NCM_RX_NTB_GRANULE */
+#define NCM_RX_NTB_MIN_SIZE 2048
+#define NCM_RX_NTB_MAX_SIZE 16384
+#define NCM_RX_NTB_GRANULE 512
+
+/* NCM rx datagram pbufs per ntb - one per NCM_RX_BYTES_PER_DATAGRAM, datagrams beyond those are copied */
+#define NCM_RX_BYTES_PER_DATAGRAM 512
+#define NCM_RX_MAX_DATAGRAMS 32
+
+/* NCM ntb format - set to 1 to select NTB-32 on adapters that offer it (NTB-16 otherwise) */
+#ifndef NCM_RX_NTB32
+#define NCM_RX_NTB32 0
+#endif
+
+/* NCM rx coalescing - set to 0 to hand every TCP segment of an ntb to lwIP on its own */
+#ifndef NCM_RX_GRO
+#define NCM_RX_GRO 1
+#endif
+
+/* NCM tx ntb size - clamped to dwNtbOutMaxSize */
+#define NCM_TX_NTB_MAX_SIZE 2048
+
+/* NCM tx datagrams per ntb - clamped to wNtbOutMaxDatagrams */
+#define NCM_TX_MAX_DATAGRAMS 8
+
+/* NCM tx headroom - a lone datagram with this much headroom gets its NTH/NDP in place
+ * NTH + NDP16 for one datagram is 28 bytes, the rest covers wNdpOutDivisor alignment
+ * NTB-32 headers take 48 bytes, so with NTB-32 every datagram is copied */
+#define NCM_TX_HEADROOM 32
+
+/* NCM tx aggregation timeout (ms) - a partially filled ntb is sent after this long */
+#define NCM_TX_FLUSH_TIMEOUT 1
 
 /* USB CDC Ethernet Device Classes */
 #define USB_ECM_SUBCLASS 0x06
@@ -72,7 +144,7 @@ typedef struct
     uint8_t bFunctionLength;
     uint8_t bDescriptorType;
     uint8_t bDescriptorSubType;
-    uint16_t bcdNcmVersion;
+    uint8_t bcdNcmVersion[2];
     uint8_t bmNetworkCapabilities;
 } usb_ncm_functional_descriptor_t;
 
@@ -107,10 +179,14 @@ enum _cdc_notification_codes
     NOTIFY_CONNECTION_SPEED_CHANGE = 0x2A
 };
 
-/* Defines dummy struct for ECM instance data (no data) */
-struct _ecm
+/* Ethernet Packet Filter Bitmap (SetEthernetPacketFilter wValue) */
+enum _cdc_packet_filter
 {
-    uint8_t dummy;
+    PACKET_TYPE_PROMISCUOUS = 1,
+    PACKET_TYPE_ALL_MULTICAST = (1 << 1),
+    PACKET_TYPE_DIRECTED = (1 << 2),
+    PACKET_TYPE_BROADCAST = (1 << 3),
+    PACKET_TYPE_MULTICAST = (1 << 4)
 };
 
 /* Defines NTB Parameter Structure for CDC-NCM */
@@ -130,12 +206,100 @@ struct _ntb_params
     uint16_t wNtbOutMaxDatagrams;
 };
 
+/* Defines NTB aggregation state for CDC-NCM transmit */
+struct _ncm_tx
+{
+    struct pbuf *dg[NCM_TX_MAX_DATAGRAMS]; // datagrams queued for the next NTB
+    uint8_t count;                         // number of datagrams queued
+    uint8_t max_datagrams;                 // datagrams per NTB (from wNtbOutMaxDatagrams)
+    uint16_t max_size;                     // NTB size (from dwNtbOutMaxSize)
+    bool urgent;                           // an urgent datagram is queued, the NTB is sent at once
+};
+
 /* Defines struct for NCM instance data */
 struct _ncm
 {
     uint8_t bm_capabilities;       // device capabilities
     uint16_t sequence;             // per NCM device - transfer sequence counter
+    bool ntb32;                    // NTB-32 selected with SetNtbFormat, both directions
     struct _ntb_params ntb_params; // NTB parameters for TX
+    struct _ncm_tx tx;             // NTB aggregation for TX
+};
+
+/* Defines a datagram pbuf that points into an RX buffer */
+struct eth_rx_dg
+{
+    struct pbuf_custom pc;          // custom pbuf for one datagram, releases the buffer on free
+    struct eth_rx_buf *buf;         // rx buffer holding the datagram
+};
+
+/* Defines an RX buffer whose datagrams are handed to lwIP without copying */
+struct eth_rx_buf
+{
+    struct _eth_device_t *dev;      // owning device, NULL once the device is torn down
+    struct eth_rx_buf *next;        // next buffer in free list
+    uint8_t *data;                  // transfer buffer (follows dg[])
+    uint8_t refs;                   // datagram pbufs still pointing into data
+    struct eth_rx_dg dg[];          // datagram pbufs (1 for ECM, up to wNtbInMaxDatagrams for NCM)
+};
+
+/* Defines a TX transfer, queued or in flight */
+struct eth_tx_slot
+{
+    struct _eth_device_t *dev;      // owning device
+    struct pbuf *p;                 // buffer being sent, NULL if slot is free
+    uint16_t hlen;                  // link headers added to p in place
+    uint32_t queued;                // sys_now() when the transfer was queued
+};
+
+/* TX completion latency histogram - bucket 0 is under 1 ms, bucket n is 2^(n-1) to 2^n - 1 ms,
+ * and the last bucket takes everything slower */
+#define ETH_TX_LATENCY_BUCKETS 8
+
+/* Defines the per-device driver counters returned by eth_get_stats() */
+struct eth_stats
+{
+    uint32_t frames_in;             // frames handed to lwIP (or queued for eth_poll())
+    uint32_t frames_out;            // frames accepted by linkoutput
+    uint32_t bytes_in;              // bulk IN bytes, including NCM framing
+    uint32_t bytes_out;             // bulk OUT bytes, including NCM framing
+    uint32_t ntbs_in;               // NTBs received (NCM), frames_in / ntbs_in is datagrams per NTB
+    uint32_t ntbs_out;              // NTBs sent (NCM), frames_out / ntbs_out is datagrams per NTB
+    uint32_t filtered;              // frames dropped by the receive filter
+    uint32_t queue_drops;           // frames dropped because eth_poll() fell behind
+    uint32_t alloc_fails;           // pbuf allocations that failed on rx or tx
+    uint32_t tx_full;               // frames pushed back for want of a tx slot
+    uint16_t retries;               // transfers rescheduled after an error
+    uint16_t resets;                // device resets after max_retries consecutive errors
+    uint32_t tx_latency[ETH_TX_LATENCY_BUCKETS];   // tx scheduled-to-completed time histogram
+    uint32_t coalesced;             // TCP segments merged into the segment before them (NCM_RX_GRO)
+    uint32_t urgent;                // frames sent ahead of bulk data
+};
+
+/* Multicast MAC addresses accepted per device */
+#define ETH_MCAST_FILTERS_MAX 16
+
+/* Defines the multicast MAC addresses lwIP asked the device to receive */
+struct eth_mcast
+{
+    uint8_t addr[ETH_MCAST_FILTERS_MAX][6];   // subscribed group addresses
+    uint8_t users[ETH_MCAST_FILTERS_MAX];     // groups mapped to each address
+    uint8_t count;                            // addresses in use
+    uint8_t overflow;                         // groups that did not fit, accept all multicast while nonzero
+};
+
+struct eth_bond;
+
+/* Defines the filter requests sent to the adapter */
+struct eth_hw_filter
+{
+    usb_control_setup_t setup;                      // request in flight
+    uint8_t (*list)[6];                             // multicast filter list in flight (all-nodes first), min(slots, ETH_MCAST_FILTERS_MAX + 1) entries
+    uint16_t slots;                                 // multicast filters supported (wNumberMCFilters)
+    uint16_t packet_filter;                         // packet filter to program
+    bool enabled;                                   // device is set up, requests may be sent
+    bool busy;                                      // a request is in flight
+    bool dirty;                                     // table changed while a request was in flight
 };
 
 // usb device metadata
@@ -149,23 +313,49 @@ typedef struct _eth_device_t
         usb_endpoint_t endpoint;
         usb_error_t (*callback)(usb_endpoint_t endpoint, usb_transfer_status_t status,
                                 size_t transferred, usb_transfer_data_t *data);
-        uint8_t buf[NCM_RX_NTB_MAX_SIZE];
+        size_t size;                              // transfer size per rx buffer
+        uint8_t datagrams;                        // datagram pbufs per rx buffer
+        struct eth_rx_buf *bufs[ETH_RX_BUFFERS_MAX];  // zero-copy rx buffers owned by device
+        struct eth_rx_buf *free;                      // rx buffers not yet queued
+        uint8_t queued;                               // rx buffers on the bulk IN endpoint
+        struct pbuf **queue;                          // frames awaiting eth_poll(), ETH_RX_QUEUE_LEN entries (deferred input only)
+        uint8_t queue_head;                           // next frame to hand to lwIP
+        uint8_t queue_count;                          // frames queued
     } rx;
     struct
     {
         usb_endpoint_t endpoint;
         err_t (*emit)(struct netif *netif, struct pbuf *p);
+        struct eth_tx_slot *slots;                    // ring of depth + ETH_TX_URGENT_SLOTS entries, pending from head in use
+        uint8_t depth;                                // slots usable by bulk transfers
+        uint8_t pending;                              // slots in use, scheduled ones first, then urgent ones
+        uint8_t head;                                 // oldest slot in use
+        uint8_t scheduled;                            // slots from head handed to the host controller
+        uint8_t busy;                                 // transfers on the host controller
+        uint8_t urgent;                               // urgent transfers queued, right after the scheduled ones
+        uint32_t deficit;                             // bytes left to dispatch in this device's turn
+        bool blocked;                                 // tx was refused for want of a slot
     } tx;
     struct
     {
         usb_endpoint_t endpoint;
-        uint8_t buf[INTERRUPT_RX_MAX];
+        uint8_t *buf;                                 // notification buffer
+        uint8_t size;                                 // transfer size, INTERRUPT_RX_MIN to INTERRUPT_RX_MAX
+        bool busy;                                    // a transfer is on the host controller
     } interrupt;
-    union
+    struct
     {
-        struct _ncm ncm;
-        struct _ecm ecm;
-    } class;
+        uint8_t interrupt;                            // consecutive failed transfers per endpoint
+        uint8_t rx;
+        uint8_t tx;
+    } retries;
+    struct _ncm *ncm;               // NCM instance data, NULL for ECM
+    void *state;                    // allocation holding ncm and the buffers above, sized by eth_state_alloc()
+    bool detached;                  // torn down, freed once no transfer refers to it
+    struct eth_hw_filter filter;    // reprogrammed from mcast on resume
+    struct eth_mcast mcast;     // kept across resume, like the netif's group memberships
+    struct eth_stats stats;     // kept across resume
+    struct eth_bond *bond;      // bonding interface this device is a port of, NULL if none - kept across resume
     struct netif iface;
 } eth_device_t;
 extern eth_device_t eth;
@@ -179,13 +369,64 @@ struct eth_configurator {
     uint8_t max_retries;                    /** < default == 3 */
     bool do_reset_on_error;                 /** < default = true */
     bool do_dhcp_auto;       /** < default = true */
+    uint8_t rx_buffers;                     /** < default = 2, ETH_RX_BUFFERS_MIN to ETH_RX_BUFFERS_MAX */
+    uint8_t tx_queue_depth;                 /** < default = 4, 1 to ETH_TX_QUEUE_MAX */
+    bool do_deferred_input;                 /** < default = false, queue rx frames for eth_poll() */
+    uint16_t link_holddown;                 /** < default = 500, ms without link before the default route fails over */
+    bool do_bond_standby;                   /** < default = false, bond sends on one port, the others stand by */
+    uint8_t tx_weights[ETH_INTERFACES_MAX]; /** < default = 1 each, tx share of each ifnum when the host controller is busy */
 };
 
-#define ETH_CONFIGURATOR_V1 sizeof(struct eth_configurator)
+#define ETH_CONFIGURATOR_V1 offsetof(struct eth_configurator, rx_buffers)
+#define ETH_CONFIGURATOR_V2 offsetof(struct eth_configurator, tx_queue_depth)
+#define ETH_CONFIGURATOR_V3 offsetof(struct eth_configurator, do_deferred_input)
+#define ETH_CONFIGURATOR_V4 offsetof(struct eth_configurator, link_holddown)
+#define ETH_CONFIGURATOR_V5 offsetof(struct eth_configurator, tx_weights)
+#define ETH_CONFIGURATOR_V6 sizeof(struct eth_configurator)
 
 
 bool eth_configure(struct eth_configurator *conf);
 
+/// @brief Hands received frames to lwIP when deferred input is enabled.
+/// @param budget Maximum number of frames to process, shared round-robin across interfaces.
+/// @return Number of frames processed.
+/// @note Has no effect unless @b do_deferred_input is set with @b eth_configure.
+/// @note Call once per main loop iteration alongside @b usb_HandleEvents and @b sys_check_timeouts.
+unsigned int eth_poll(unsigned int budget);
+
+/// @brief Returns the driver counters of an interface.
+/// @param ifnum Interface number (netif->num), as in the bitmap from @b eth_get_interfaces.
+/// @param stats Receives a copy of the counters.
+/// @return False if no interface with that number exists.
+/// @note Counters are kept for as long as the interface exists, including across device resets.
+bool eth_get_stats(uint8_t ifnum, struct eth_stats *stats);
+
+/// @brief Adds an interface to the bonding interface (bo8), creating the bond on first use.
+/// @param ifnum Interface number (netif->num), as in the bitmap from @b eth_get_interfaces.
+/// @return The bonding netif, or NULL if no interface with that number exists or memory ran out.
+/// @note The bond takes the MAC address of its first port and carries the IP configuration: the port's
+/// own addresses, DHCP lease and default route are given up. Transmit flows are spread across the ports
+/// with link up by a hash of their addresses and ports, frames received on any port are input on the bond.
+/// @note The ports must be cabled to a switch with a static link aggregation group (no LACP) over them.
+/// @note The bond is removed together with its last port, by @b eth_bond_remove or when the device goes away.
+struct netif *eth_bond_add(uint8_t ifnum);
+
+/// @brief Returns an interface from the bonding interface to standalone use.
+/// @param ifnum Interface number (netif->num).
+/// @return False if the interface does not exist or is not a port of the bond.
+bool eth_bond_remove(uint8_t ifnum);
+
+/// @brief Sets the order in which interfaces take over the default route.
+/// @param ifnums Interface numbers (netif->num), most preferred first.
+/// @param count Number of entries in @b ifnums.
+/// @return False if an entry is not a registered interface, the order is then unchanged.
+/// @note Interfaces not listed follow the listed ones, in the order they were attached.
+/// @note When the default interface has been without link for @b link_holddown ms, the first interface in
+/// this order with link up becomes the default. A bond takes the place of its first listed port. With
+/// @b do_bond_standby set, the bond sends on the first port in this order with link up and only moves
+/// to the next one when that port loses its link.
+bool eth_set_standby(const uint8_t *ifnums, uint8_t count);
+
 /// @brief Polls for the registration status of interfaces.
 /// @return A bitmap indicating what NETIFs are registered (netif->num)
 /// @note Example: a return value of 0b00001101 indicates that en0, en2, and en3 currently exist.
@@ -265,6 +265,23 @@ _app_library_table:
     dl _udp_sendto
     dl _udp_sendto_if
     dl _udp_sendto_if_src
+    dl _eth_poll
+    dl _eth_get_stats
+    dl _eth_bond_add
+    dl _eth_bond_remove
+    dl _eth_set_standby
+    dl _mem_category_usage
+    dl _mem_pressure_level
+    dl _mem_pressure_check
+    dl _mem_ooseq_limit
+    dl _ip_reass_drop_all
+    dl _ip6_reass_drop_all
+    dl _memp_recycle_limit
+    dl _memp_recycle_flush
+    dl _mem_profile_reset
+    dl _mem_profile_display
+    dl _memp_profile_get
+    dl _pbuf_profile_get
 
 
 extern _eth_configure
@@ -530,3 +547,20 @@ extern _udp_send
 extern _udp_sendto
 extern _udp_sendto_if
 extern _udp_sendto_if_src
+extern _eth_poll
+extern _eth_get_stats
+extern _eth_bond_add
+extern _eth_bond_remove
+extern _eth_set_standby
+extern _mem_category_usage
+extern _mem_pressure_level
+extern _mem_pressure_check
+extern _mem_ooseq_limit
+extern _ip_reass_drop_all
+extern _ip6_reass_drop_all
+extern _memp_recycle_limit
+extern _memp_recycle_flush
+extern _mem_profile_reset
+extern _mem_profile_display
+extern _memp_profile_get
+extern _pbuf_profile_get
@@ -94,7 +94,6 @@ extern "C" {
 /* Modules initialization */
 err_t lwip_init(void);
 
-
 #ifdef __cplusplus
 }
 #endif
@@ -47,6 +47,14 @@ extern "C" {
 
 #include "lwip/arch.h"
 
+/* Slab layer for the fixed memp object sizes, see lwipopts.h */
+#ifndef MEM_SLAB
+#define MEM_SLAB 0
+#endif
+#ifndef MEM_SLAB_CHUNK_SIZE
+#define MEM_SLAB_CHUNK_SIZE 1024
+#endif
+
 typedef size_t mem_size_t;
 #define MEM_SIZE_F SZT_F
 
@@ -83,18 +91,89 @@ void custom_free(void* ptr);
 void* custom_calloc(size_t num, size_t size);
 
 
+// subsystems heap usage is accounted to, each with its own quota
+enum mem_category {
+    MEM_CAT_OTHER,          // pcbs, timeouts, netifs, anything not listed below
+    MEM_CAT_RX,             // pbuf pool buffers, received frames
+    MEM_CAT_TX,             // tcp segments and PBUF_RAM pbufs built for sending
+    MEM_CAT_REASS,          // IPv4/IPv6 reassembly
+    MEM_CAT_APP,            // altcp pcbs and TLS state
+    MEM_CATEGORIES
+};
+
+// heap usage against the configured watermarks
+enum mem_pressure {
+    MEM_PRESSURE_NONE,
+    MEM_PRESSURE_LOW,       // low_water reached
+    MEM_PRESSURE_HIGH       // high_water reached or an allocation failed, lwIP sheds what it can
+};
+
 struct mem_configurator {
     size_t version;
     void* (*in_malloc)(size_t);
     void (*in_free)(void *ptr);
     size_t heap_max;
+    void *arena;            // region memp pools and the pbuf pool are carved from at lwip_init(), NULL for none (MEM_SLAB)
+    size_t arena_size;      // not counted in heap_max
+    size_t quota[MEM_CATEGORIES];   // heap bytes each category may hold, 0 for no limit but heap_max
+    size_t ooseq_max;       // out-of-sequence bytes a TCP connection may hold, 0 for no limit
+    size_t low_water;       // heap usage reported as MEM_PRESSURE_LOW, 0 for 3/4 of heap_max
+    size_t high_water;      // heap usage reported as MEM_PRESSURE_HIGH, 0 for 7/8 of heap_max
+    void (*pressure)(enum mem_pressure level);  // told of level changes from sys_check_timeouts(), NULL for none
 };
 
-#define MEM_CONFIGURATOR_V1     sizeof(struct mem_configurator)
+#define MEM_CONFIGURATOR_V1     offsetof(struct mem_configurator, arena)
+#define MEM_CONFIGURATOR_V2     offsetof(struct mem_configurator, quota)
+#define MEM_CONFIGURATOR_V3     sizeof(struct mem_configurator)
+
+#if MEM_CUSTOM_ALLOCATOR
+// active configuration, drivers size their buffers against heap_max
+extern struct mem_configurator mem_conf;
+
+// category the next mem_malloc() is charged to, reset to MEM_CAT_OTHER by it
+extern uint8_t mem_category;
+extern volatile bool mem_pressure_pending;
+
+// heap bytes held by a category, including allocation headers
+size_t mem_category_usage(uint8_t category);
+enum mem_pressure mem_pressure_level(void);
+// runs the pressure callback and, at MEM_PRESSURE_HIGH, frees ooseq data, pending reassemblies, recycled memp objects and empty slab chunks
+// returns at once when nothing changed, programs without lwIP's timers call it from their main loop
+void mem_pressure_check(void);
+// TCP_OOSEQ_BYTES_LIMIT() of lwipopts.h, none are kept under high pressure
+u32_t mem_ooseq_limit(void);
+
+// mem_pressure_check() inlined for lwIP's own timers
+#define MEM_CHECK_PRESSURE() do { if (mem_pressure_pending) { mem_pressure_check(); } } while (0)
+#endif /* MEM_CUSTOM_ALLOCATOR */
 
 
 bool mem_configure(struct mem_configurator *mem);
 
+/* size histogram buckets: <32, <64, ... <2048, >=2048 bytes (mem_profile_display() lists all 8) */
+#define MEM_PROFILE_BUCKETS 8
+
+// allocations of one memp type or pbuf_alloc() layer/type (see memp_profile_get(), pbuf_profile_get())
+struct mem_profile {
+    u32_t allocs;           // successful allocations
+    u32_t fails;            // allocations that returned NULL
+    u32_t frees;
+    u32_t bytes;            // bytes requested by successful allocations
+    u32_t live;             // objects allocated and not yet freed
+    u32_t peak;             // most objects live at once
+    u32_t sizes[MEM_PROFILE_BUCKETS];   // successful allocations by requested size
+};
+
+#if MEM_PROFILE
+void mem_profile_alloc(struct mem_profile *prof, size_t size);
+void mem_profile_fail(struct mem_profile *prof);
+void mem_profile_free(struct mem_profile *prof);
+#endif /* MEM_PROFILE */
+// clears all counters, peaks restart from the objects live now - does nothing without MEM_PROFILE
+void mem_profile_reset(void);
+// lists the profiles in use, with MEM_PROFILE and LWIP_STATS_DISPLAY
+void mem_profile_display(void);
+
 #ifdef __cplusplus
 }
 #endif
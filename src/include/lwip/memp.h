@@ -73,7 +73,8 @@ extern const struct memp_desc* const memp_pools[MEMP_MAX];
   const struct memp_desc memp_ ## name = { \
     DECLARE_LWIP_MEMPOOL_DESC(desc) \
     LWIP_MEMPOOL_DECLARE_STATS_REFERENCE(memp_stats_ ## name) \
-    LWIP_MEM_ALIGN_SIZE(size) \
+    LWIP_MEM_ALIGN_SIZE(size), \
+    (num) \
   };
 
 #else /* MEMP_MEM_MALLOC */
@@ -148,6 +149,21 @@ void *memp_malloc(memp_t type);
 #endif
 void  memp_free(memp_t type, void *mem);
 
+#if MEMP_MEM_MALLOC && MEMP_RECYCLE && !MEMP_OVERFLOW_CHECK
+#define MEMP_RECYCLING 1
+void  memp_recycle_limit(memp_t type, u16_t max);
+u8_t  memp_recycle_flush(void);
+#else
+#define MEMP_RECYCLING 0
+#endif
+
+struct mem_profile;
+u8_t  memp_profile_get(memp_t type, struct mem_profile *prof);
+#if MEM_PROFILE
+/** Allocation profile of each pool, see struct mem_profile */
+extern struct mem_profile memp_profile[MEMP_MAX];
+#endif /* MEM_PROFILE */
+
 #ifdef __cplusplus
 }
 #endif
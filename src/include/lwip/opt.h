@@ -282,6 +282,25 @@
 #define MEMP_MEM_MALLOC                 0
 #endif
 
+/**
+ * MEMP_RECYCLE==1: With MEMP_MEM_MALLOC, keep up to MEMP_RECYCLE_MAX(type)
+ * freed objects of each pool for the next memp_malloc() of that pool instead
+ * of handing them back to the heap right away. memp_recycle_flush() gives them
+ * back; the custom allocator calls it under memory pressure, and memp_malloc()
+ * before failing. Not used with MEMP_OVERFLOW_CHECK.
+ */
+#if !defined MEMP_RECYCLE || defined __DOXYGEN__
+#define MEMP_RECYCLE                    0
+#endif
+
+/**
+ * MEMP_RECYCLE_MAX(type): freed objects of a pool kept for reuse with
+ * MEMP_RECYCLE, given its memp_t. memp_recycle_limit() changes it at runtime.
+ */
+#if !defined MEMP_RECYCLE_MAX || defined __DOXYGEN__
+#define MEMP_RECYCLE_MAX(type)          4
+#endif
+
 /**
  * MEMP_MEM_INIT==1: Force use of memset to initialize pool memory.
  * Useful if pool are moved in uninitialized section of memory. This will ensure
@@ -2349,6 +2368,16 @@
 #define MIB2_STATS                      0
 
 #endif /* LWIP_STATS */
+
+/**
+ * MEM_PROFILE==1: Profile allocations per memp type and per pbuf_alloc()
+ * layer/type: counts, bytes, live objects, peak and a size histogram (see
+ * struct mem_profile). Shown by stats_display() with LWIP_STATS_DISPLAY, read
+ * by programs through memp_profile_get() and pbuf_profile_get().
+ */
+#if !defined MEM_PROFILE || defined __DOXYGEN__
+#define MEM_PROFILE                     0
+#endif
 /**
  * @}
  */
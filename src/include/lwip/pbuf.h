@@ -40,6 +40,9 @@
 
 #include "lwip/opt.h"
 #include "lwip/err.h"
+#if MEM_PROFILE
+#include "lwip/mem.h"
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -222,6 +225,11 @@ struct pbuf {
 
   /** In case the user needs to store data custom data on a pbuf */
   LWIP_PBUF_CUSTOM_DATA
+
+#if MEM_PROFILE
+  /** pbuf_profile site + 1 this pbuf heads the allocation of, 0 for none */
+  u8_t profile;
+#endif /* MEM_PROFILE */
 };
 
 
@@ -273,6 +281,14 @@ void pbuf_free_ooseq(void);
 #define pbuf_init()
 
 struct pbuf *pbuf_alloc(pbuf_layer l, u16_t length, pbuf_type type);
+struct mem_profile;
+u8_t pbuf_profile_get(pbuf_layer l, pbuf_type type, struct mem_profile *prof);
+#if MEM_PROFILE
+/** pbuf_alloc() profiles, by layer (raw, link, ip, transport) and type (ram, rom, ref, pool) */
+#define PBUF_PROFILE_LAYERS 4
+#define PBUF_PROFILE_TYPES  4
+extern struct mem_profile pbuf_profile[PBUF_PROFILE_LAYERS * PBUF_PROFILE_TYPES];
+#endif /* MEM_PROFILE */
 struct pbuf *pbuf_alloc_reference(void *payload, u16_t length, pbuf_type type);
 #if LWIP_SUPPORT_CUSTOM_PBUF
 struct pbuf *pbuf_alloced_custom(pbuf_layer l, u16_t length, pbuf_type type,
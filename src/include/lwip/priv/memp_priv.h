@@ -118,10 +118,10 @@ struct memp_desc {
   /** Element size */
   u16_t size;
 
-#if !MEMP_MEM_MALLOC
-  /** Number of elements */
+  /** Number of elements (MEMP_MEM_MALLOC: objects reserved up front, if the allocator does) */
   u16_t num;
 
+#if !MEMP_MEM_MALLOC
   /** Base address */
   u8_t *base;
 
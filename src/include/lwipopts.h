@@ -102,8 +102,20 @@
 #define MEM_CUSTOM_MALLOC               custom_malloc
 #define MEM_CUSTOM_CALLOC               custom_calloc
 
+/* MEM_SLAB==1: allocations of the fixed memp object sizes (pcbs, tcp segments,
+   timeouts, pbuf pool buffers...) come from per-size free lists, carved from
+   MEM_SLAB_CHUNK_SIZE byte chunks of the program's heap. */
+#define MEM_SLAB 1
+#define MEM_SLAB_CHUNK_SIZE 1024
 #endif
 
+/* MEMP_RECYCLE==1: freed memp objects are kept for reuse, up to
+   MEMP_RECYCLE_MAX(type) per pool, and given back under memory pressure.
+   A TCP flow frees and allocates a segment and a pbuf or two per segment. */
+#define MEMP_RECYCLE 1
+#define MEMP_RECYCLE_MAX(type) ((((type) == MEMP_TCP_SEG) || ((type) == MEMP_PBUF) || \
+                                 ((type) == MEMP_PBUF_POOL)) ? 8 : 2)
+
 #define MAX_HEAP_USAGE 24576
 
 /* MEM_ALIGNMENT: should be set to the alignment of the CPU for which
@@ -160,6 +172,19 @@ a lot of data that needs to be copied, this should be set high. */
 /* PBUF_POOL_SIZE: the number of buffers in the pbuf pool. */
 #define PBUF_POOL_SIZE ((MAX_HEAP_USAGE / 2) / PBUF_POOL_BUFSIZE)
 
+/* PBUF_LINK_ENCAPSULATION_HLEN: headroom in front of the Ethernet header.
+   The USB-Ethernet driver writes NCM headers there instead of copying the
+   frame (see NCM_TX_HEADROOM). */
+#define PBUF_LINK_ENCAPSULATION_HLEN 32
+
+/* LWIP_SUPPORT_CUSTOM_PBUF: the USB-Ethernet driver hands its rx buffers
+   to lwIP as custom pbufs. */
+#define LWIP_SUPPORT_CUSTOM_PBUF 1
+
+/* LWIP_NETIF_TX_SINGLE_PBUF: build outgoing frames in one pbuf so the
+   USB-Ethernet driver can send them without linearizing a copy. */
+#define LWIP_NETIF_TX_SINGLE_PBUF 1
+
 /** SYS_LIGHTWEIGHT_PROT
  * define SYS_LIGHTWEIGHT_PROT in lwipopts.h if you want inter-task protection
  * for certain critical regions during buffer allocation, deallocation and memory
@@ -182,6 +207,12 @@ a lot of data that needs to be copied, this should be set high. */
    order. Define to 0 if your device is low on memory. */
 #define TCP_QUEUE_OOSEQ 1
 
+#if MEM_CUSTOM_ALLOCATOR==1
+/* Out-of-sequence data per connection: mem_configurator ooseq_max, and none
+   under high memory pressure. */
+#define TCP_OOSEQ_BYTES_LIMIT(pcb) mem_ooseq_limit()
+#endif
+
 /* TCP Maximum segment size. */
 #define TCP_MSS 512
 
@@ -273,6 +304,12 @@ a lot of data that needs to be copied, this should be set high. */
 #define SYS_STATS 1
 #endif /* LWIP_STATS */
 
+/* MEM_PROFILE==1: per memp type and pbuf_alloc() layer/type allocation
+   counters, for sizing the heap and pools. Costs a few hundred bytes. */
+#ifndef MEM_PROFILE
+#define MEM_PROFILE 0
+#endif
+
 /* ---------- NETBIOS options ---------- */
 #define LWIP_NETBIOS_RESPOND_NAME_QUERY 1
 